@@ -0,0 +1,463 @@
+/*
+ * Copyright 2022 Adrià Giménez Pastor.
+ *
+ * This file is part of adriagipas/NES.
+ *
+ * adriagipas/NES is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * adriagipas/NES is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with adriagipas/NES.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ *  apubench.c - Compara els dos motors de l'APU. Primer executa una
+ *               seqüència sintètica que sols utilitza l'APU (polsos,
+ *               triangle i soroll amb canvis de periode i volum cada
+ *               frame, i canals que se silencien i tornen a sonar),
+ *               on es veu el cost de l'APU aïllat, i després
+ *               cada ROM amb el mateix número de frames i sense
+ *               entrada. Per a cada cas mostra el temps per frame amb
+ *               el motor cicle a cicle i amb el motor per events, la
+ *               relació entre ells i quants buffers de sò són
+ *               distints, que sempre ha de ser 0.
+ *
+ *  Compilació (des d'aquesta carpeta):
+ *
+ *    gcc -O2 -std=gnu99 -I../src -o apubench apubench.c \
+ *        `find ../src -name '*.c'` -lm -pthread
+ *
+ *  Ús:
+ *
+ *    ./apubench [-n FRAMES] [ROM ...]
+ *
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "NES.h"
+
+
+
+
+/**********/
+/* MACROS */
+/**********/
+
+#define DEFAULT_FRAMES 1200
+
+/* Cicles d'UCP per frame en NTSC (aproximat). */
+#define SYNTH_CC 29781
+
+
+
+
+/*********/
+/* ESTAT */
+/*********/
+
+/* Execució actual. */
+static struct
+{
+
+  int       nframes;      /* Frames a executar. */
+  int       frame;        /* Frames executats. */
+  int       nbuffers;     /* Buffers de sò generats. */
+  int       maxbuffers;   /* Grandària de 'hashes'. */
+  NESu32   *hashes;       /* Hash de cada buffer de sò. */
+
+} _run;
+
+static NESu8 _prgram[0x2000];
+
+
+
+
+/*********************/
+/* FUNCIONS PRIVADES */
+/*********************/
+
+static void
+warning (
+         void       *udata,
+         const char *format,
+         ...
+         )
+{
+
+  va_list ap;
+
+
+  va_start ( ap, format );
+  fprintf ( stderr, "Warning: " );
+  vfprintf ( stderr, format, ap );
+  fprintf ( stderr, "\n" );
+  va_end ( ap );
+
+} /* end warning */
+
+
+static void
+update_screen (
+               const int *fb,
+               void      *udata
+               )
+{
+  if ( _run.frame < _run.nframes ) ++_run.frame;
+} /* end update_screen */
+
+
+/* FNV-1a dels bytes del buffer. */
+static void
+play_frame (
+            const double  frame[NES_APU_BUFFER_SIZE],
+            void         *udata
+            )
+{
+
+  const unsigned char *p, *end;
+  NESu32 h;
+
+
+  if ( _run.nbuffers == _run.maxbuffers ) return;
+  h= 2166136261U;
+  p= (const unsigned char *) frame;
+  for ( end= p+sizeof(double)*NES_APU_BUFFER_SIZE; p != end; ++p )
+    {
+      h^= *p;
+      h*= 16777619U;
+    }
+  _run.hashes[_run.nbuffers++]= h;
+
+} /* end play_frame */
+
+
+static NES_Bool
+check_pad_button (
+        	  NES_PadButton  button,
+        	  void          *udata
+        	  )
+{
+  return NES_FALSE;
+} /* end check_pad_button */
+
+
+static void
+check_signals (
+               NES_Bool *reset,
+               NES_Bool *stop,
+               void     *udata
+               )
+{
+
+  *reset= NES_FALSE;
+  *stop= (_run.frame == _run.nframes);
+
+} /* end check_signals */
+
+
+static double
+get_time (void)
+{
+
+  struct timespec ts;
+
+
+  clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+
+} /* end get_time */
+
+
+static void
+reset_run (
+           const int  nframes,
+           NESu32    *hashes,
+           const int  maxbuffers
+           )
+{
+
+  _run.nframes= nframes;
+  _run.frame= 0;
+  _run.nbuffers= 0;
+  _run.maxbuffers= maxbuffers;
+  _run.hashes= hashes;
+
+} /* end reset_run */
+
+
+/* Executa NFRAMES frames de la seqüència sintètica amb el motor
+   ENGINE. Torna els segons emprats. */
+static double
+run_synth (
+           const NES_APUEngine  engine,
+           const int            nframes,
+           NESu32              *hashes,
+           const int            maxbuffers
+           )
+{
+
+  unsigned int cc;
+  double t0;
+  int i;
+
+
+  reset_run ( nframes, hashes, maxbuffers );
+  NES_apu_set_engine ( engine );
+  NES_apu_init ( NES_NTSC, play_frame, NULL );
+  NES_apu_control ( 0x0F );
+  NES_apu_pulse1CR ( 0xBF );
+  NES_apu_pulse1RCR ( 0x00 );
+  NES_apu_pulse2CR ( 0x74 );
+  NES_apu_pulse2RCR ( 0x00 );
+  NES_apu_triangleCR1 ( 0xFF );
+  NES_apu_noiseCR ( 0x3A );
+  t0= get_time ();
+  for ( i= 0; i < nframes; ++i )
+    {
+      /* Silencia canals de tant en tant, perquè avancen sense
+         generar events. */
+      NES_apu_control ( (i&0x10) ? 0x0A : 0x0F );
+      NES_apu_pulse1CR ( (i%24) < 6 ? 0xB0 : 0xBF );
+      NES_apu_pulse1FTR ( (NESu8) (0x80+(i&0x3F)) );
+      NES_apu_pulse1CTR ( 0x01 );
+      if ( (i&0x7) == 0 )
+        {
+          NES_apu_pulse2FTR ( (NESu8) (0x40+(i&0x78)) );
+          NES_apu_pulse2CTR ( 0x02 );
+          NES_apu_triangleFR1 ( (NESu8) (i&0xF8) );
+          NES_apu_triangleFR2 ( 0x01 );
+        }
+      NES_apu_noiseFR1 ( (NESu8) (((i>>4)&0x1)<<7 | (i&0xF)) );
+      NES_apu_noiseFR2 ( 0x08 );
+      cc= SYNTH_CC;
+      NES_apu_clock ( &cc );
+    }
+
+  return get_time ()-t0;
+
+} /* end run_synth */
+
+
+/* Executa NFRAMES frames de ROM amb el motor ENGINE. Torna els segons
+   emprats o -1 si hi ha hagut un error. */
+static double
+run_rom (
+         NES_Rom             *rom,
+         const NES_APUEngine  engine,
+         const int            nframes,
+         NESu32              *hashes,
+         const int            maxbuffers
+         )
+{
+
+  static const NES_Frontend frontend=
+    {
+      warning,
+      update_screen,
+      play_frame,
+      check_pad_button,
+      check_pad_button,
+      check_signals,
+      NULL
+    };
+
+  double t0;
+
+
+  reset_run ( nframes, hashes, maxbuffers );
+  NES_apu_set_engine ( engine );
+  memset ( _prgram, 0, sizeof(_prgram) );
+  if ( NES_init ( rom, rom->tvmode, &frontend, _prgram, NULL ) != NES_NOERROR )
+    return -1;
+  t0= get_time ();
+  NES_loop ();
+
+  return get_time ()-t0;
+
+} /* end run_rom */
+
+
+/* Compara els hashes dels dos motors. */
+static int
+count_diffs (
+             const NESu32 *hc,
+             const int     nc,
+             const NESu32 *he,
+             const int     ne
+             )
+{
+
+  int i, ndiff;
+
+
+  ndiff= nc > ne ? nc-ne : ne-nc;
+  for ( i= 0; i < nc && i < ne; ++i )
+    if ( hc[i] != he[i] ) ++ndiff;
+
+  return ndiff;
+
+} /* end count_diffs */
+
+
+static void
+print_row (
+           const char   *name,
+           const char   *mapper,
+           const double  tc,
+           const double  te,
+           const int     nframes,
+           const int     ndiff,
+           const int     nbuffers
+           )
+{
+  printf ( "%-32s %-6s %9.3f %9.3f %7.2fx %6d/%d\n",
+           name, mapper,
+           1000.0*tc/nframes, 1000.0*te/nframes, tc/te, ndiff, nbuffers );
+} /* end print_row */
+
+
+static int
+bench_synth (
+             const int nframes
+             )
+{
+
+  NESu32 *hc, *he;
+  double tc, te;
+  int maxbuffers, nc;
+
+
+  maxbuffers= (int) (((long) nframes*SYNTH_CC)/NES_APU_BUFFER_SIZE) + 1;
+  hc= (NESu32 *) malloc ( sizeof(NESu32)*maxbuffers*2 );
+  if ( hc == NULL ) return -1;
+  he= hc+maxbuffers;
+  tc= run_synth ( NES_APU_CYCLE, nframes, hc, maxbuffers );
+  nc= _run.nbuffers;
+  te= run_synth ( NES_APU_EVENT, nframes, he, maxbuffers );
+  print_row ( "(synthetic)", "-", tc, te, nframes,
+              count_diffs ( hc, nc, he, _run.nbuffers ), nc );
+  free ( hc );
+
+  return 0;
+
+} /* end bench_synth */
+
+
+static int
+bench_rom (
+           const char *fname,
+           const int   nframes
+           )
+{
+
+  FILE *f;
+  NES_Rom rom;
+  NESu32 *hc, *he;
+  double tc, te;
+  int maxbuffers, nc;
+
+
+  /* Carrega. */
+  f= fopen ( fname, "rb" );
+  if ( f == NULL )
+    {
+      fprintf ( stderr, "Unable to open '%s'\n", fname );
+      return -1;
+    }
+  if ( NES_rom_load_from_ines ( f, &rom ) != 0 )
+    {
+      fprintf ( stderr, "Unable to load '%s'\n", fname );
+      fclose ( f );
+      return -1;
+    }
+  fclose ( f );
+  maxbuffers= (int) (((long) nframes*(SYNTH_CC+4000))/NES_APU_BUFFER_SIZE) + 1;
+  hc= (NESu32 *) malloc ( sizeof(NESu32)*maxbuffers*2 );
+  if ( hc == NULL ) { NES_rom_free ( rom ); return -1; }
+  he= hc+maxbuffers;
+
+  /* Executa. */
+  tc= run_rom ( &rom, NES_APU_CYCLE, nframes, hc, maxbuffers );
+  nc= _run.nbuffers;
+  te= tc < 0 ? -1 : run_rom ( &rom, NES_APU_EVENT, nframes, he, maxbuffers );
+  if ( te < 0 )
+    {
+      fprintf ( stderr, "Unable to run '%s' (%s)\n",
+        	fname, NES_mapper_name ( rom.mapper ) );
+      free ( hc );
+      NES_rom_free ( rom );
+      return -1;
+    }
+  print_row ( fname, NES_mapper_name ( rom.mapper ), tc, te, nframes,
+              count_diffs ( hc, nc, he, _run.nbuffers ), nc );
+
+  free ( hc );
+  NES_rom_free ( rom );
+
+  return 0;
+
+} /* end bench_rom */
+
+
+static void
+usage (
+       const char *prog
+       )
+{
+  fprintf ( stderr, "Usage: %s [-n FRAMES] [ROM ...]\n", prog );
+} /* end usage */
+
+
+
+
+/********/
+/* MAIN */
+/********/
+
+int
+main (
+      int   argc,
+      char *argv[]
+      )
+{
+
+  int i, nframes, ret;
+
+
+  nframes= DEFAULT_FRAMES;
+  i= 1;
+  if ( i+1 < argc && strcmp ( argv[i], "-n" ) == 0 )
+    {
+      nframes= atoi ( argv[i+1] );
+      i+= 2;
+    }
+  if ( nframes <= 0 )
+    {
+      usage ( argv[0] );
+      return EXIT_FAILURE;
+    }
+
+  printf ( "%-32s %-6s %9s %9s %8s %s\n",
+           "ROM", "Mapper", "cycle(ms)", "event(ms)", "gain", "diff" );
+  ret= EXIT_SUCCESS;
+  if ( bench_synth ( nframes ) != 0 ) ret= EXIT_FAILURE;
+  for ( ; i < argc; ++i )
+    if ( bench_rom ( argv[i], nframes ) != 0 )
+      ret= EXIT_FAILURE;
+
+  return ret;
+
+} /* end main */
@@ -0,0 +1,328 @@
+/*
+ * Copyright 2022 Adrià Giménez Pastor.
+ *
+ * This file is part of adriagipas/NES.
+ *
+ * adriagipas/NES is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * adriagipas/NES is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with adriagipas/NES.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ *  ppubench.c - Mesura el cost dels motors de la PPU. Per a cada ROM
+ *               executa el mateix número de frames amb el motor per
+ *               línies i amb el motor cicle a cicle, sense entrada ni
+ *               so, i mostra el temps per frame de cadascun, la
+ *               relació entre ells i quants frames són distints. Els
+ *               títols amb molts frames distints són els candidats a
+ *               utilitzar el motor cicle a cicle. El motor per línies
+ *               dibuixa la imatge una línia més amunt que el maquinari
+ *               (i que el motor cicle a cicle), per això es comparen
+ *               les línies 0-238 d'un amb les 1-239 de l'altre.
+ *
+ *  Compilació (des d'aquesta carpeta):
+ *
+ *    gcc -O2 -std=gnu99 -I../src -o ppubench ppubench.c \
+ *        `find ../src -name '*.c'` -lm -pthread
+ *
+ *  Ús:
+ *
+ *    ./ppubench [-n FRAMES] ROM [ROM ...]
+ *
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "NES.h"
+
+
+
+
+/**********/
+/* MACROS */
+/**********/
+
+#define DEFAULT_FRAMES 1200
+
+
+
+
+/*********/
+/* ESTAT */
+/*********/
+
+/* Execució actual. */
+static struct
+{
+
+  int       nframes;      /* Frames a executar. */
+  int       frame;        /* Frames executats. */
+  int       first;        /* Primera línia que es compara. */
+  NESu32   *hashes;       /* Hash de cada frame. */
+
+} _run;
+
+static NESu8 _prgram[0x2000];
+
+
+
+
+/*********************/
+/* FUNCIONS PRIVADES */
+/*********************/
+
+static void
+warning (
+         void       *udata,
+         const char *format,
+         ...
+         )
+{
+
+  va_list ap;
+
+
+  va_start ( ap, format );
+  fprintf ( stderr, "Warning: " );
+  vfprintf ( stderr, format, ap );
+  fprintf ( stderr, "\n" );
+  va_end ( ap );
+
+} /* end warning */
+
+
+/* FNV-1a dels hash de les línies que calcula la PPU. */
+static void
+update_screen (
+               const int *fb,
+               void      *udata
+               )
+{
+
+  const NESu64 *lines;
+  NESu32 h;
+  int i;
+
+
+  if ( _run.frame == _run.nframes ) return;
+  lines= NES_ppu_get_line_hashes ();
+  h= 2166136261U;
+  for ( i= _run.first; i < _run.first+239; ++i )
+    {
+      h^= (NESu32) (lines[i]^(lines[i]>>32));
+      h*= 16777619U;
+    }
+  _run.hashes[_run.frame++]= h;
+
+} /* end update_screen */
+
+
+static void
+play_frame (
+            const double  frame[NES_APU_BUFFER_SIZE],
+            void         *udata
+            )
+{
+} /* end play_frame */
+
+
+static NES_Bool
+check_pad_button (
+        	  NES_PadButton  button,
+        	  void          *udata
+        	  )
+{
+  return NES_FALSE;
+} /* end check_pad_button */
+
+
+static void
+check_signals (
+               NES_Bool *reset,
+               NES_Bool *stop,
+               void     *udata
+               )
+{
+
+  *reset= NES_FALSE;
+  *stop= (_run.frame == _run.nframes);
+
+} /* end check_signals */
+
+
+static double
+get_time (void)
+{
+
+  struct timespec ts;
+
+
+  clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+
+} /* end get_time */
+
+
+/* Executa NFRAMES frames de ROM amb el motor ENGINE i guarda els
+   hashes en HASHES. Torna els segons emprats o -1 si hi ha hagut un
+   error. */
+static double
+run (
+     NES_Rom             *rom,
+     const NES_PPUEngine  engine,
+     const int            nframes,
+     NESu32              *hashes
+     )
+{
+
+  static const NES_Frontend frontend=
+    {
+      warning,
+      update_screen,
+      play_frame,
+      check_pad_button,
+      check_pad_button,
+      check_signals,
+      NULL
+    };
+
+  double t0;
+
+
+  _run.nframes= nframes;
+  _run.frame= 0;
+  _run.first= (engine == NES_PPU_DOT) ? 1 : 0;
+  _run.hashes= hashes;
+  rom->ppu_engine= engine;
+  NES_ppu_set_hashing ( NES_TRUE );
+  NES_apu_set_silent ( NES_TRUE );
+  memset ( _prgram, 0, sizeof(_prgram) );
+  if ( NES_init ( rom, rom->tvmode, &frontend, _prgram, NULL ) != NES_NOERROR )
+    return -1;
+  t0= get_time ();
+  NES_loop ();
+
+  return get_time ()-t0;
+
+} /* end run */
+
+
+static int
+bench_rom (
+           const char *fname,
+           const int   nframes
+           )
+{
+
+  FILE *f;
+  NES_Rom rom;
+  NESu32 *hl, *hd;
+  double tl, td;
+  int i, ndiff;
+
+
+  /* Carrega. */
+  f= fopen ( fname, "rb" );
+  if ( f == NULL )
+    {
+      fprintf ( stderr, "Unable to open '%s'\n", fname );
+      return -1;
+    }
+  if ( NES_rom_load_from_ines ( f, &rom ) != 0 )
+    {
+      fprintf ( stderr, "Unable to load '%s'\n", fname );
+      fclose ( f );
+      return -1;
+    }
+  fclose ( f );
+  hl= (NESu32 *) malloc ( sizeof(NESu32)*nframes*2 );
+  if ( hl == NULL ) { NES_rom_free ( rom ); return -1; }
+  hd= hl+nframes;
+
+  /* Executa. */
+  tl= run ( &rom, NES_PPU_LINE, nframes, hl );
+  td= tl < 0 ? -1 : run ( &rom, NES_PPU_DOT, nframes, hd );
+  if ( td < 0 )
+    {
+      fprintf ( stderr, "Unable to run '%s' (%s)\n",
+        	fname, NES_mapper_name ( rom.mapper ) );
+      free ( hl );
+      NES_rom_free ( rom );
+      return -1;
+    }
+  for ( ndiff= i= 0; i < nframes; ++i )
+    if ( hl[i] != hd[i] ) ++ndiff;
+  printf ( "%-32s %-6s %9.3f %9.3f %7.2fx %6d/%d\n",
+           fname, NES_mapper_name ( rom.mapper ),
+           1000.0*tl/nframes, 1000.0*td/nframes, td/tl, ndiff, nframes );
+
+  free ( hl );
+  NES_rom_free ( rom );
+
+  return 0;
+
+} /* end bench_rom */
+
+
+static void
+usage (
+       const char *prog
+       )
+{
+  fprintf ( stderr, "Usage: %s [-n FRAMES] ROM [ROM ...]\n", prog );
+} /* end usage */
+
+
+
+
+/********/
+/* MAIN */
+/********/
+
+int
+main (
+      int   argc,
+      char *argv[]
+      )
+{
+
+  int i, nframes, ret;
+
+
+  nframes= DEFAULT_FRAMES;
+  i= 1;
+  if ( i+1 < argc && strcmp ( argv[i], "-n" ) == 0 )
+    {
+      nframes= atoi ( argv[i+1] );
+      i+= 2;
+    }
+  if ( i == argc || nframes <= 0 )
+    {
+      usage ( argv[0] );
+      return EXIT_FAILURE;
+    }
+
+  printf ( "%-32s %-6s %9s %9s %8s %s\n",
+           "ROM", "Mapper", "line(ms)", "dot(ms)", "cost", "diff" );
+  ret= EXIT_SUCCESS;
+  for ( ; i < argc; ++i )
+    if ( bench_rom ( argv[i], nframes ) != 0 )
+      ret= EXIT_FAILURE;
+
+  return ret;
+
+} /* end main */
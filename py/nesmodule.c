@@ -59,7 +59,14 @@
       }                                                                 \
   } while(0)
 
-#define NBUFF 4
+/* Grandària de la cua d'àudio i marques, en blocs d'SDL. */
+#define RING_CHUNKS 8
+#define RING_LOW 2
+#define RING_HIGH 4
+
+/* Correcció màxima de la freqüència del so. L'objectiu està entre
+   les marques, 'sync_audio' no deixa passar de la marca alta. */
+#define RATE_DELTA 0.005
 
 
 
@@ -70,13 +77,6 @@
 
 enum { FALSE= 0, TRUE };
 
-typedef struct
-{
-  
-  double       *v;
-  volatile int  full;
-  
-} buffer_t;
 
 
 
@@ -124,17 +124,10 @@ static int _control;
 static struct
 {
   
-  buffer_t buffers[NBUFF];
-  int      buff_in;
-  int      buff_out;
-  char     silence;
-  int      pos;
-  int      size;
-  int      nsamples;
-  int      ccpersec;
-  double   ratio;
-  double   pos2;
-  double   sysfreq;
+  NES_AudioRing  ring;
+  SDL_sem       *sem;         /* El desperta la cua. */
+  int            samples;     /* Mostres de cada bloc. */
+  NESs16        *chunk;       /* On escriu el simulador. */
   
 } _audio;
 
@@ -183,30 +176,48 @@ init_palette (void)
 } /* end init_palette */
 
 
+static void
+play_chunk (
+            const void *buffer,
+            void       *udata
+            )
+{
+  NES_audio_ring_write ( &_audio.ring, (const NESs16 *) buffer, _audio.samples );
+} /* end play_chunk */
+
+
 static void
 audio_callback (
                 void  *userdata,
                 Uint8 *stream,
                 int    len
                 )
+{
+  NES_audio_ring_read ( &_audio.ring, (NESs16 *) stream, len/sizeof(NESs16) );
+} /* end audio_callback */
+
+
+static void
+wake_producer (
+               void *udata
+               )
+{
+  SDL_SemPost ( _audio.sem );
+} /* end wake_producer */
+
+
+/* Espera mentre hi haja massa so pendent, és el que fa que la
+   simulació vaja a la velocitat real, i corregeix la freqüència
+   perquè la cua no es buide quan la simulació no dona l'abast. */
+static void
+sync_audio (void)
 {
   
-  int i;
-  const double *buffer;
-  
-  
-  assert ( _audio.size == len );
-  if ( _audio.buffers[_audio.buff_out].full )
-    {
-      buffer= _audio.buffers[_audio.buff_out].v;
-      for ( i= 0; i < len; ++i )
-        stream[i]= 127 + (Uint8) ((128*buffer[i]) + 0.5);
-      _audio.buffers[_audio.buff_out].full= 0;
-      _audio.buff_out= (_audio.buff_out+1)%NBUFF;
-    }
-  else for ( i= 0; i < len; ++i ) stream[i]= _audio.silence;
+  while ( NES_audio_ring_fill ( &_audio.ring ) >= (int) _audio.ring.high )
+    SDL_SemWaitTimeout ( _audio.sem, 10 );
+  NES_audio_ring_rate_control ( &_audio.ring );
   
-} /* end audio_callback */
+} /* end sync_audio */
 
 
 /* Torna 0 si tot ha anat bé. */
@@ -215,19 +226,13 @@ init_audio (void)
 {
   
   SDL_AudioSpec desired, obtained;
-  int n;
-  double *mem;
-  
   
-  /* Únic camp de l'estat que s'inicialitza abans. */
-  _audio.buff_out= _audio.buff_in= 0;
-  for ( n= 0; n < NBUFF; ++n ) _audio.buffers[n].full= 0;
   
   /* Inicialitza. */
   desired.freq= 44100;
-  desired.format= AUDIO_U8;
+  desired.format= AUDIO_S16SYS;
   desired.channels= 1;
-  desired.samples= 2048;
+  desired.samples= 1024;
   desired.size= 2048;
   desired.callback= audio_callback;
   desired.userdata= NULL;
@@ -242,24 +247,34 @@ init_audio (void)
       obtained= desired;
     }
   
-  /* Inicialitza estat. */
-  mem= (double *) malloc ( sizeof(double)*obtained.size*NBUFF );
-  for ( n= 0; n < NBUFF; ++n, mem+= obtained.size )
-    _audio.buffers[n].v= (double *) mem;
-  _audio.silence= (char) obtained.silence;
-  _audio.pos= 0;
-  _audio.size= obtained.size;
-  _audio.nsamples= _audio.size;
-  if ( obtained.freq >= NES_CPU_NTSC_CYCLES_PER_SEC )
+  /* Inicialitza estat. Cada bloc del simulador és un buffer
+     d'SDL. */
+  _audio.samples= obtained.samples;
+  _audio.chunk= (NESs16 *) malloc ( sizeof(NESs16)*obtained.samples );
+  _audio.sem= SDL_CreateSemaphore ( 0 );
+  if ( _audio.chunk == NULL || _audio.sem == NULL ||
+       NES_audio_ring_init ( &_audio.ring, RING_CHUNKS*obtained.samples,
+        		     RING_LOW*obtained.samples,
+        		     RING_HIGH*obtained.samples,
+        		     wake_producer, NULL, NULL ) != 0 )
     {
       SDL_CloseAudio ();
-      return "Freqüència massa gran";
+      free ( _audio.chunk );
+      if ( _audio.sem != NULL ) SDL_DestroySemaphore ( _audio.sem );
+      return "No s'ha pogut reservar memòria per a l'àudio";
     }
-  _audio.sysfreq= (double) obtained.freq;
-  _audio.ratio= 1.0;
-  _audio.ccpersec= 0;
-  /*_audio.ratio=  / (double) obtained.freq;*/
-  _audio.pos2= 0.0;
+  if ( NES_apu_configure ( obtained.freq, NES_APU_S16, obtained.samples,
+        		   _audio.chunk, play_chunk ) != 0 )
+    {
+      SDL_CloseAudio ();
+      free ( _audio.chunk );
+      SDL_DestroySemaphore ( _audio.sem );
+      NES_audio_ring_free ( &_audio.ring );
+      return "Format d'àudio no suportat";
+    }
+  NES_audio_ring_set_rate_control ( &_audio.ring,
+        			    (RING_LOW+RING_HIGH)/2*obtained.samples,
+        			    RATE_DELTA );
   
   return NULL;
   
@@ -271,7 +286,9 @@ close_audio (void)
 {
   
   SDL_CloseAudio ();
-  free ( _audio.buffers[0].v );
+  free ( _audio.chunk );
+  SDL_DestroySemaphore ( _audio.sem );
+  NES_audio_ring_free ( &_audio.ring );
   
 } /* end close_audio */
 
@@ -287,6 +304,8 @@ update_tvmode (void)
   _screen.width= NES_PPU_COLS;
   _screen.height= _rom.tvmode==NES_PAL ? NES_PPU_PAL_ROWS : NES_PPU_NTSC_ROWS;
   _screen.fb_off= _rom.tvmode==NES_PAL ? 0 : 8*NES_PPU_COLS;
+  if ( _rom.tvmode == NES_PAL ) NES_ppu_set_window ( 0, 0, 0, 0 );
+  else NES_ppu_set_window ( 8, 8, 0, 0 );
   prev= _screen.surface;
   _screen.surface= SDL_SetVideoMode ( _screen.width, _screen.height, 32,
                                       SDL_HWSURFACE | SDL_GL_DOUBLEBUFFER );
@@ -298,12 +317,6 @@ update_tvmode (void)
       return;
     }
   SDL_WM_SetCaption ( "NES", "NES" );
-
-  /* Audio. */
-  _audio.ccpersec=
-    _rom.tvmode==NES_PAL ?
-    NES_CPU_PAL_CYCLES_PER_SEC : NES_CPU_NTSC_CYCLES_PER_SEC;
-  _audio.ratio= _audio.ccpersec / _audio.sysfreq;
   
 } /* end update_tvmode */
 
@@ -372,37 +385,8 @@ play_frame (
             )
 {
   
-  int nofull, j;
-  double *buffer;
-  
-  
-  for (;;)
-    {
-      
-      while ( _audio.buffers[_audio.buff_in].full ) SDL_Delay ( 1 );
-      buffer= _audio.buffers[_audio.buff_in].v;
-      
-      j= (int) (_audio.pos2 + 0.5);
-      while ( (nofull= (_audio.pos != _audio.nsamples)) &&
-              j < NES_APU_BUFFER_SIZE )
-        {
-          buffer[_audio.pos++]= frame[j];
-          _audio.pos2+= _audio.ratio;
-          j= (int) (_audio.pos2 + 0.5);
-        }
-      if ( !nofull )
-        {
-          _audio.pos= 0;
-          _audio.buffers[_audio.buff_in].full= 1;
-          _audio.buff_in= (_audio.buff_in+1)%NBUFF;
-        }
-      if ( j >= NES_APU_BUFFER_SIZE )
-        {
-          _audio.pos2-= NES_APU_BUFFER_SIZE;
-          break;
-        }
-      
-    }
+  /* No es crida, l'àudio arriba per 'play_chunk'
+     ('NES_apu_configure'). */
   
 } /* end play_frame */
 
@@ -442,6 +426,7 @@ check_signals (
   SDL_Event event;
   
   
+  sync_audio ();
   *stop= *reset= NES_FALSE;
   while ( SDL_PollEvent ( &event ) )
     switch ( event.type )
@@ -770,6 +755,49 @@ NES_get_vram (
 } /* end NES_get_vram */
 
 
+/* Les vistes es tornen com 'memoryview' sobre els buffers de la PPU,
+   sense copiar-les. Són vàlides fins a la següent crida. */
+static PyObject *
+NES_get_views (
+               PyObject *self,
+               PyObject *args
+               )
+{
+  
+  const NES_PPUViews *v;
+  int palette;
+  
+  
+  CHECK_INITIALIZED;
+  CHECK_ROM;
+  palette= 0;
+  if ( !PyArg_ParseTuple ( args, "|i", &palette ) )
+    return NULL;
+  
+  v= NES_ppu_get_views ( palette );
+  if ( v == NULL )
+    {
+      NES_ppu_set_views ( NES_TRUE );
+      v= NES_ppu_get_views ( palette );
+    }
+  
+  return Py_BuildValue ( "(NNNN)",
+        		 PyMemoryView_FromMemory ( (char *) v->pt[0],
+        					   sizeof(v->pt[0]),
+        					   PyBUF_READ ),
+        		 PyMemoryView_FromMemory ( (char *) v->pt[1],
+        					   sizeof(v->pt[1]),
+        					   PyBUF_READ ),
+        		 PyMemoryView_FromMemory ( (char *) v->nt,
+        					   sizeof(v->nt),
+        					   PyBUF_READ ),
+        		 PyMemoryView_FromMemory ( (char *) v->obj,
+        					   sizeof(v->obj),
+        					   PyBUF_READ ) );
+  
+} /* end NES_get_views */
+
+
 static PyObject *
 NES_get_obj_ram (
         	 PyObject *self,
@@ -793,6 +821,36 @@ NES_get_obj_ram (
 } /* end NES_get_obj_ram */
 
 
+static PyObject *
+NES_get_audio_stats (
+        	     PyObject *self,
+        	     PyObject *args
+        	     )
+{
+  
+  NES_AudioRingStats stats;
+  int reset;
+  
+  
+  CHECK_INITIALIZED;
+  reset= 0;
+  if ( !PyArg_ParseTuple ( args, "|p", &reset ) )
+    return NULL;
+  NES_audio_ring_get_stats ( &_audio.ring, &stats,
+        		     reset ? NES_TRUE : NES_FALSE );
+  
+  return Py_BuildValue ( "{s:i,s:i,s:i,s:I,s:I,s:d,s:I}",
+        		 "fill", stats.fill,
+        		 "min_fill", stats.min_fill,
+        		 "max_fill", stats.max_fill,
+        		 "overruns", stats.overruns,
+        		 "underruns", stats.underruns,
+        		 "ratio", stats.ratio,
+        		 "adjustments", stats.adjustments );
+  
+} /* end NES_get_audio_stats */
+
+
 static PyObject *
 NES_get_palette (
         	 PyObject *self,
@@ -892,13 +950,10 @@ NES_loop_module (
         	 )
 {
   
-  int n;
-  
-  
   CHECK_INITIALIZED;
   CHECK_ROM;
   
-  for ( n= 0; n < NBUFF; ++n ) _audio.buffers[n].full= 0;
+  NES_audio_ring_clear ( &_audio.ring );
   SDL_PauseAudio ( 0 );
   NES_loop ();
   SDL_PauseAudio ( 1 );
@@ -938,10 +993,12 @@ NES_set_rom (
   Py_ssize_t size;
   NES_Error err;
   const char *data;
+  int dot_ppu;
   
   
   CHECK_INITIALIZED;
-  if ( !PyArg_ParseTuple ( args, "O!", &PyBytes_Type, &bytes ) )
+  dot_ppu= 0;
+  if ( !PyArg_ParseTuple ( args, "O!|p", &PyBytes_Type, &bytes, &dot_ppu ) )
     return NULL;
   
   size= PyBytes_Size ( bytes );
@@ -952,6 +1009,7 @@ NES_set_rom (
       PyErr_SetString ( NESError, "Unable to load the iNES rom" );
       return NULL;
     }
+  if ( dot_ppu ) _rom.ppu_engine= NES_PPU_DOT;
   
   /* Inicialitza el simulador. */
   _control= 0;
@@ -1046,8 +1104,19 @@ static PyMethodDef NESMethods[]=
       "Get the current VRAM as a sequence of bytes" },
     { "get_obj_ram", NES_get_obj_ram, METH_VARARGS,
       "Get the current sprite RAM as a sequence of bytes" },
+    { "get_views", NES_get_views, METH_VARARGS,
+      "Get the PPU debug views as a tuple of RGB memoryviews (pattern"
+      " table 0, pattern table 1, nametables and sprites). Only the tiles"
+      " that changed since the last call are redrawn. The optional"
+      " argument is the palette (0-7) used for the pattern tables" },
     { "get_rom_mapper_state", NES_get_rom_mapper_state, METH_VARARGS,
       "Get the current state of the ROM mapping into a dictionary" },
+    { "get_audio_stats", NES_get_audio_stats, METH_VARARGS,
+      "Get the audio queue statistics into a dictionary (fill level in"
+      " samples, minimum and maximum fill, dropped and missing samples,"
+      " current resampling ratio and number of ratio adjustments). If"
+      " the optional argument is True the minimum and maximum are"
+      " reset" },
     { "get_palette", NES_get_palette, METH_VARARGS,
       "Get the NES palette as a tuple of 512 RGB colors" },
     { "init", NES_init_module, METH_VARARGS,
@@ -1055,7 +1124,9 @@ static PyMethodDef NESMethods[]=
     { "loop", NES_loop_module, METH_VARARGS,
       "Run the simulator into a loop and block" },
     { "set_rom", NES_set_rom, METH_VARARGS,
-      "Set a iNES ROM into the simulator. The ROM should be of type bytes."},
+      "Set a iNES ROM into the simulator. The ROM should be of type bytes."
+      " If the optional second argument is True the cycle-accurate PPU"
+      " engine is used"},
     { "set_tracer", NES_set_tracer, METH_VARARGS,
       "Set a python object to trace the execution. The object can"
       " implement one of these methods:\n"
@@ -2,6 +2,9 @@ from distutils.core import setup, Extension
 
 module= Extension ( 'NES',
                     sources= [ '../src/apu.c',
+                               '../src/apu_async.c',
+                               '../src/apu_log.c',
+                               '../src/audio.c',
                                '../src/cpu_dis.c',
                                '../src/main.c',
                                '../src/mapper_names.c',
@@ -11,6 +14,7 @@ module= Extension ( 'NES',
                                '../src/joypads.c',
                                '../src/mapper.c',
                                '../src/mem.c',
+                               '../src/post.c',
                                '../src/ppu.c',
                                '../src/rom.c',
                                '../src/mappers/aorom.c',
@@ -23,6 +27,7 @@ module= Extension ( 'NES',
                                'nesmodule.c'
                                 ],
                     depends= [ '../src/NES.h', '../src/op.h',
+                               '../src/apu.c',
                                '../src/mappers/aorom.h',
                                '../src/mappers/cnrom.h',
                                '../src/mappers/mmc1.h',
@@ -30,7 +35,7 @@ module= Extension ( 'NES',
                                '../src/mappers/mmc3.h',
                                '../src/mappers/nrom.h',
                                '../src/mappers/unrom.h' ],
-                    libraries= [ 'SDL' ],
+                    libraries= [ 'SDL', 'm', 'pthread' ],
                     include_dirs= [ '../src' ] )
 
 setup ( name= 'NES',
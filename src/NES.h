@@ -49,6 +49,9 @@ typedef enum
 typedef signed char NESs8;
 typedef unsigned char NESu8;
 typedef unsigned short NESu16;
+typedef signed short NESs16;
+typedef unsigned int NESu32;
+typedef unsigned long long NESu64;
 
 /* Error */
 typedef enum
@@ -265,6 +268,16 @@ typedef enum
     NES_FOURSCREEN
   } NES_Mirroring;
 
+/* Motor de la PPU. */
+typedef enum
+  {
+    NES_PPU_LINE= 0,    /* Renderitza línia a línia. És ràpid però
+        		   ignora els canvis a meitat de línia. */
+    NES_PPU_DOT         /* Cicle a cicle. És més lent però reprodueix
+        		   els canvis a meitat de línia i el rellotge
+        		   del MMC3. */
+  } NES_PPUEngine;
+
 /* Grandària d'una pàgina CHR. */
 #define NES_CHR_SIZE 8192
 
@@ -299,6 +312,10 @@ typedef struct
   NES_CHR       *chrs;         /* Pàgines CHR. */
   NESu8         *trainer;      /* Els 512 bytes de trainer. NULL si no
         			  en té. */
+  NES_PPUEngine  ppu_engine;   /* Motor de la PPU. Les funcions que
+        			  lligen ROMs el fixen a NES_PPU_LINE, el
+        			  'frontend' pot canviar-lo per als títols
+        			  que ho necessiten. */
   
 } NES_Rom;
 
@@ -506,6 +523,26 @@ NES_mem_write (
                const NESu8  data
                );
 
+/* Copia en DST els 256 bytes de la pàgina PAGE ($XX00-$XXFF) sense
+   cap efecte lateral. Torna NES_FALSE, sense copiar res, si la pàgina
+   és d'entrada/eixida ($2000-$5FFF), si no hi ha RAM del cartutx o si
+   està activat el mode traça (cal llegir byte a byte). */
+NES_Bool
+NES_mem_read_page (
+        	   const NESu8 page,
+        	   NESu8       dst[256]
+        	   );
+
+/* Llig en DATA el byte de l'adreça ADDR sense cap efecte
+   lateral. Torna NES_FALSE, sense llegir res, si l'adreça és
+   d'entrada/eixida ($2000-$5FFF), si no hi ha RAM del cartutx o si
+   està activat el mode traça. */
+NES_Bool
+NES_mem_peek (
+              const NESu16  addr,
+              NESu8        *data
+              );
+
 /* Activa/Desactiva el mode traça en el mòdul de memòria. */
 void
 NES_mem_set_mode_trace (
@@ -543,6 +580,80 @@ typedef void (NES_UpdateScreen) (
         			 void      *udata
         			 );
 
+/* Valors de 'NES_PPULine.flags'. */
+#define NES_PPU_LINE_PF           0x01    /* Fons activat. */
+#define NES_PPU_LINE_OBJ          0x02    /* Sprites activats. */
+#define NES_PPU_LINE_PF_CLIPPING  0x04    /* 'Clipping' del fons. */
+#define NES_PPU_LINE_OBJ_CLIPPING 0x08    /* 'Clipping' dels sprites. */
+
+/* Tot allò que determina els píxels d'una línia, tal i com estava en
+ * el moment de dibuixar-la. Els tiles i els patrons dels sprites ja
+ * estan llegits de la VRAM, per tant no depenen dels bancs del
+ * mapper.
+ */
+typedef struct
+{
+  
+  NESu8  palettes[32];     /* Paletes. */
+  NESu8  pbitmap;          /* Mascara per a desactivar el color. */
+  NESu8  emph;             /* Emfasis del color. */
+  NESu8  flags;            /* Mascara de bits NES_PPU_LINE_*. */
+  NESu8  FH;               /* Scroll horitzontal fi. */
+  NESu16 p0,p1;            /* Registres de patrons al començar. */
+  NESu8  atr[2];           /* Atributs al començar. */
+  NESu8  tiles[32][3];     /* Patró baix, patró alt i atribut dels
+        		      tiles llegits. */
+  int    nobjs;            /* Número de sprites. */
+  NESu8  objs[8][4];       /* X, atributs, patró baix i patró alt de
+        		      cada sprite, en ordre de prioritat. */
+  
+} NES_PPULine;
+
+/* Les 240 línies visibles d'un frame. */
+typedef struct
+{
+  
+  NES_PPULine lines[240];
+  
+} NES_PPUFrame;
+
+/* Tipus de la funció que rep un frame en mode de renderitzat ajornat.
+ * El frame és vàlid fins que torna la següent crida a aquesta funció.
+ */
+typedef void (NES_PPUFrameReady) (
+        			  const NES_PPUFrame *frame,
+        			  void               *udata
+        			  );
+
+/* Número màxim de rectangles en 'NES_PPUDamage'. */
+#define NES_PPU_MAX_DAMAGE_RECTS 16
+
+/* Rectangle en píxels. */
+typedef struct
+{
+  
+  int x,y;
+  int width,height;
+  
+} NES_PPURect;
+
+/* Regions del frame que han canviat respecte a l'anterior frame
+ * renderitzat.
+ */
+typedef struct
+{
+  
+  NESu32      lines[8];       /* Mapa de bits de les línies que han
+        			 canviat. La línia Y és el bit Y%32 de
+        			 lines[Y/32]. */
+  int         nrects;         /* Número de rectangles. */
+  NES_PPURect rects[NES_PPU_MAX_DAMAGE_RECTS]; /* Rectangles que
+        					  contenen tots els
+        					  píxels que han
+        					  canviat. */
+  
+} NES_PPUDamage;
+
 /* Files en la pantalla segons el tipus de televisor. */
 #define NES_PPU_PAL_ROWS 240
 #define NES_PPU_NTSC_ROWS 224
@@ -550,8 +661,9 @@ typedef void (NES_UpdateScreen) (
 /* Columnes. */
 #define NES_PPU_COLS 256
 
-/* Processa clocks de UCP. */
-void
+/* Processa clocks de UCP. Torna cert si la línia IRQ del mapper
+   (MMC3) està activa. */
+NES_Bool
 NES_ppu_clock (
                int cc
                );
@@ -569,14 +681,15 @@ NES_ppu_CR2 (
              );
 
 /* Inicialitza PPU, requereix que s'haja incialitzat previament el
- * MAPPER i la MEM.
+ * MAPPER i la MEM. ENGINE indica el motor que s'utilitza.
  */
 void
 NES_ppu_init (
-              const NES_TVMode  tvmode,
-              const NES_Mapper  mapper,
-              NES_UpdateScreen *update_screen,
-              void             *udata
+              const NES_TVMode     tvmode,
+              const NES_Mapper     mapper,
+              const NES_PPUEngine  engine,
+              NES_UpdateScreen    *update_screen,
+              void                *udata
               );
 
 void
@@ -591,6 +704,154 @@ NES_ppu_init_state (void);
 void
 NES_ppu_sync (void);
 
+/* Els mappers criden a aquesta funció, després de 'NES_ppu_sync',
+   quan canvien com està mapejada la VRAM (bancs CHR o
+   'mirroring'). */
+void
+NES_ppu_vram_changed (void);
+
+/* El MMC3 crida a aquesta funció, després de 'NES_ppu_sync', quan
+   canvia la configuració o l'estat de la seua IRQ, perquè la PPU
+   torne a calcular quan s'activarà. */
+void
+NES_ppu_irq_changed (void);
+
+/* Descarta NFRAMES frames per cada frame renderitzat (0 per a
+ * renderitzar-los tots). En els frames descartats no es generen els
+ * píxels ni es crida a la funció que actualitza la pantalla, però tot
+ * allò que el programa pot observar (col·lisió del sprite 0,
+ * desbordament de sprites, estat dels mappers, interrupcions) és
+ * idèntic a quan es renderitzen.
+ */
+void
+NES_ppu_set_frame_skip (
+        		int nframes
+        		);
+
+/* Activa/Desactiva el renderitzat sota demanda. Mentre està actiu
+ * sols es renderitzen els frames demanats amb 'NES_ppu_request_frame'
+ * i s'ignora el valor de 'NES_ppu_set_frame_skip'.
+ */
+void
+NES_ppu_set_render_on_demand (
+        		      const NES_Bool val
+        		      );
+
+/* Demana que es renderitze el pròxim frame que comence. */
+void
+NES_ppu_request_frame (void);
+
+/* Activa/Desactiva el seguiment de les regions del frame que
+ * canvien. Sols té efecte quan la PPU escriu en el 'frame buffer' (no
+ * en el renderitzat ajornat).
+ */
+void
+NES_ppu_set_damage_tracking (
+        		     const NES_Bool val
+        		     );
+
+/* Torna les regions que han canviat en l'últim frame. Està pensada
+ * per a ser cridada des de la funció que actualitza la pantalla.
+ */
+const NES_PPUDamage *
+NES_ppu_get_damage (void);
+
+/* Activa/Desactiva el càlcul d'un hash de 64 bits de cada línia del
+ * 'frame buffer' a mesura que la PPU l'escriu, i del frame complet a
+ * partir dels de les línies. Les línies de fora de la finestra visible
+ * es calculen amb el contingut que tenen. No es calcula en els frames
+ * descartats ni amb el renderitzat ajornat.
+ */
+void
+NES_ppu_set_hashing (
+        	     const NES_Bool val
+        	     );
+
+/* Torna el hash de l'últim frame. Està pensada per a ser cridada des
+ * de la funció que actualitza la pantalla. Amb el renderitzat ajornat
+ * torna 0.
+ */
+NESu64
+NES_ppu_get_frame_hash (void);
+
+/* Torna els hash de les 240 línies de l'últim frame. */
+const NESu64 *
+NES_ppu_get_line_hashes (void);
+
+/* Retalla de la imatge TOP files per dalt, BOTTOM per baix, LEFT
+ * columnes per l'esquerra i RIGHT per la dreta (per exemple 8,8,0,0
+ * per a quedar-se amb les NES_PPU_NTSC_ROWS files d'un televisor
+ * NTSC). Els píxels de fora no es generen i en el 'frame buffer'
+ * conserven el valor que tenien, però la resta de la PPU (col·lisió
+ * del sprite 0, mappers, interrupcions) funciona igual. Per defecte
+ * no es retalla res. No afecta al renderitzat ajornat, on el
+ * 'frontend' tria les línies que dibuixa.
+ */
+void
+NES_ppu_set_window (
+        	    const int top,
+        	    const int bottom,
+        	    const int left,
+        	    const int right
+        	    );
+
+/* Format de l'observació reduïda. */
+typedef enum
+  {
+    NES_PPU_OBS_GREY= 0,    /* Un byte de lluminositat per píxel. */
+    NES_PPU_OBS_RGB         /* Tres bytes (R,G,B) per píxel. */
+  } NES_PPUObsFormat;
+
+/* Configura una observació reduïda de WIDTHxHEIGHT píxels (com a molt
+ * 256x240) de la finestra visible. Cada píxel de l'observació és el
+ * píxel de la imatge més pròxim al seu centre, i es calcula quan la
+ * PPU escriu la línia. Si ONLY és cert la PPU sols combina les línies
+ * que apareixen en l'observació, i la resta del 'frame buffer' no
+ * s'actualitza (però es fa tot allò que el programa pot observar). Un
+ * WIDTH o HEIGHT de 0 la desactiva. No es genera en els frames
+ * descartats ni amb el renderitzat ajornat.
+ */
+void
+NES_ppu_set_observation (
+        		 const int              width,
+        		 const int              height,
+        		 const NES_PPUObsFormat format,
+        		 const NES_Bool         only
+        		 );
+
+/* Torna l'observació de l'últim frame, fila a fila. Està pensada per
+ * a ser cridada des de la funció que actualitza la pantalla.
+ */
+const NESu8 *
+NES_ppu_get_observation (void);
+
+/* Activa el renderitzat ajornat. La PPU sols llig de la VRAM les
+ * línies (la col·lisió del sprite 0 i el MMC3 continuen igual) i al
+ * final de cada frame, en compte de cridar a la funció que actualitza
+ * la pantalla, crida a FRAME_READY. Les línies es poden dibuixar
+ * després amb 'NES_ppu_render_lines', per exemple repartint-les entre
+ * diferents fils. NULL el desactiva. El motor cicle a cicle no pot
+ * descriure una línia amb 'NES_PPULine', per tant l'ignora i sempre
+ * crida a la funció que actualitza la pantalla.
+ */
+void
+NES_ppu_set_deferred_render (
+        		     NES_PPUFrameReady *frame_ready,
+        		     void              *udata
+        		     );
+
+/* Dibuixa en FB les línies [BEGIN,END[ de FRAME. No accedeix a
+ * l'estat de la PPU, per tant es pot cridar des de qualsevol fil i
+ * per a rangs distints a la vegada.
+ */
+void
+NES_ppu_render_lines (
+        	      const NES_PPUFrame *frame,
+        	      const int           begin,
+        	      const int           end,
+        	      int                 fb[61440]
+        	      );
+
 /* Accés directe a memòria. Copia de $(BYTE)00 256 bytes a la memòria
  * d'objectes.
  */
@@ -651,6 +912,117 @@ NES_ppu_write (
                NESu8 byte
                );
 
+/* Torna quants cicles de UCP, a partir d'ara, poden passar abans que
+   un accés als registres necessite posar al dia la PPU. Fins eixe
+   moment la PPU no canvia d'estat (ni genera NMI). Torna 0 amb el
+   motor cicle a cicle. */
+int
+NES_ppu_idle_cc (void);
+
+/* Equival a N crides a 'NES_ppu_write' seguides, sense posar al dia
+   la PPU entre elles. Sols es pot utilitzar si totes les escriptures
+   es fan abans de 'NES_ppu_idle_cc' cicles. */
+void
+NES_ppu_write_block (
+        	     const NESu8 *data,
+        	     const int    n
+        	     );
+
+/* Sprite en 'NES_PPUTileMap'. */
+typedef struct
+{
+  
+  NESu8 index;         /* Posició en la memòria d'objectes. */
+  NESu8 x;
+  NESu8 y;             /* Com en la memòria d'objectes, el sprite
+        		  comença en la línia següent. */
+  NESu8 tile;
+  NESu8 palette;       /* 0-3. */
+  NESu8 flags;         /* Bits 5-7 dels atributs (darrere del fons,
+        		  'flip' horitzontal i 'flip' vertical). */
+  
+} NES_PPUTileMapObj;
+
+/* Estat semàntic d'un frame. Per a cada fila de tiles de la pantalla
+ * es guarden els tiles i les paletes que es veuen en el centre de
+ * cada cel·la de 8x8, ja aplicat el scroll tal i com estava en eixa
+ * línia. Els sprites són els que han aparegut en alguna línia del
+ * frame, en l'ordre de la memòria d'objectes.
+ */
+typedef struct
+{
+  
+  NESu8             tiles[30][32];
+  NESu8             palettes[30][32];
+  NESu8             pt[30];         /* Taula de patrons del fons (0 o
+        			       1). */
+  NES_Bool          pf[30];         /* El fons estava activat. */
+  NES_Bool          size16;         /* Sprites de 8x16. */
+  NESu8             obj_pt;         /* Taula de patrons dels sprites
+        			       de 8x8 (0 o 1). */
+  int               nobjs;
+  NES_PPUTileMapObj objs[64];
+  
+} NES_PPUTileMap;
+
+/* Activa/Desactiva la generació de 'NES_PPUTileMap'. Es genera en
+ * tots els frames, també en els descartats, i llegir-lo no afecta a
+ * l'estat de la PPU ni del mapper.
+ */
+void
+NES_ppu_set_tilemap (
+        	     const NES_Bool val
+        	     );
+
+/* Torna l'estat semàntic de l'últim frame complet. S'actualitza al
+ * començar el VBlank.
+ */
+const NES_PPUTileMap *
+NES_ppu_get_tilemap (void);
+
+/* Dimensions de les vistes de depuració. */
+#define NES_PPU_VIEW_PT_SIZE  128    /* Taula de patrons: 16x16 tiles. */
+#define NES_PPU_VIEW_NT_COLS  512    /* Les 4 taules de noms en 2x2. */
+#define NES_PPU_VIEW_NT_ROWS  480
+#define NES_PPU_VIEW_OBJ_COLS 64     /* Els 64 sprites en 8x8 cel·les */
+#define NES_PPU_VIEW_OBJ_ROWS 128    /* de 8x16. */
+
+/* Vistes de depuració de la VRAM i la memòria d'objectes. 'pt' són
+ * les dos taules de patrons, 'nt' les quatre taules de noms dibuixades
+ * amb la taula de patrons del fons i 'obj' els sprites en l'ordre de
+ * la memòria d'objectes.
+ */
+typedef struct
+{
+  
+  NES_Color pt[2][NES_PPU_VIEW_PT_SIZE*NES_PPU_VIEW_PT_SIZE];
+  NES_Color nt[NES_PPU_VIEW_NT_COLS*NES_PPU_VIEW_NT_ROWS];
+  NES_Color obj[NES_PPU_VIEW_OBJ_COLS*NES_PPU_VIEW_OBJ_ROWS];
+  NES_Bool  pt_changed;    /* Indiquen quines vistes han canviat des */
+  NES_Bool  nt_changed;    /* de l'anterior crida a */
+  NES_Bool  obj_changed;   /* 'NES_ppu_get_views'. */
+  
+} NES_PPUViews;
+
+/* Activa/Desactiva les vistes de depuració. Mentre estan actives la
+ * PPU apunta quins tiles de la VRAM canvien, i 'NES_ppu_get_views'
+ * sols torna a dibuixar aquells que han canviat.
+ */
+void
+NES_ppu_set_views (
+        	   const NES_Bool val
+        	   );
+
+/* Actualitza les vistes de depuració i torna un punter a elles, que
+ * és vàlid fins a la següent crida. PALETTE (0-7) és la paleta amb què
+ * es dibuixen les taules de patrons. Torna NULL si les vistes no estan
+ * actives.
+ */
+const NES_PPUViews *
+NES_ppu_get_views (
+        	   const int palette
+        	   );
+
 /* Llig l'estat actual de la VRAM. És a dir torna el contingut actual
  * entre [0000:3FFF. És posible que internament tinga mirroring o
  * pàgines de VROM.
@@ -676,6 +1048,64 @@ NES_ppu_load_state (
         	    );
 
 
+/********/
+/* POST */
+/********/
+/* Postprocessat de la imatge. Les funcions treballen sobre els
+ * 'frame buffers' d'índexs de color de 256x240 que genera la PPU (el
+ * que rep NES_UpdateScreen o el que dibuixa 'NES_ppu_render_lines'),
+ * i processen les files [BEGIN,END[ de FB. No tenen estat, per tant
+ * es poden cridar des de la funció que actualitza la pantalla, després
+ * de cada 'NES_ppu_render_lines', o des d'altres fils i per a rangs
+ * distints a la vegada. Fora del fil de la simulació cal treballar
+ * sobre una còpia de FB, perquè la PPU el torna a escriure en el
+ * següent frame.
+ */
+
+/* Columnes de la imatge que genera 'NES_post_ntsc'. */
+#define NES_POST_NTSC_COLS 512
+
+/* Escala repetint els píxels. FACTOR pot ser 2, 3 o 4. DST té
+ * 256*FACTOR columnes i 240*FACTOR files d'índexs de color.
+ */
+void
+NES_post_nearest (
+        	  const int  fb[61440],
+        	  const int  begin,
+        	  const int  end,
+        	  const int  factor,
+        	  int       *dst
+        	  );
+
+/* Escala amb Scale2x (FACTOR 2) o Scale3x (FACTOR 3). DST té
+ * 256*FACTOR columnes i 240*FACTOR files d'índexs de color.
+ */
+void
+NES_post_scalex (
+        	 const int  fb[61440],
+        	 const int  begin,
+        	 const int  end,
+        	 const int  factor,
+        	 int       *dst
+        	 );
+
+/* Simula la senyal de vídeo composta NTSC: genera la senyal que
+ * trauria la PPU per a cada índex de color (amb l'èmfasi) i la
+ * descodifica en RGB, reproduint els artefactes de color. DST té
+ * NES_POST_NTSC_COLS columnes i 240 files. PHASE (0, 1 o 2) és la
+ * fase de la subportadora al principi del frame, en el maquinari
+ * canvia de frame en frame.
+ */
+void
+NES_post_ntsc (
+               const int  fb[61440],
+               const int  begin,
+               const int  end,
+               const int  phase,
+               NES_Color *dst
+               );
+
+
 /***********/
 /* JOYPADS */
 /***********/
@@ -806,7 +1236,116 @@ NES_cpu_load_state (
  */
 #define NES_APU_BUFFER_SIZE 17000
 
-/* Tipus de la funció que reprodueix un 'frame' de sò. */
+/* Motor de l'APU. Els dos generen exactament les mateixes mostres. */
+typedef enum
+  {
+    NES_APU_EVENT= 0,   /* Sols avalua l'eixida quan algun
+        		   temporitzador, el 'frame sequencer' o el
+        		   buffer poden canviar-la, i ompli de colp els
+        		   cicles entre mig. És el motor per defecte. */
+    NES_APU_CYCLE       /* Avalua l'eixida cicle a cicle. Es manté
+        		   com a referència. */
+  } NES_APUEngine;
+
+/* Límits de la freqüència de mostreig de 'NES_apu_set_rate'. */
+#define NES_APU_MIN_RATE 8000
+#define NES_APU_MAX_RATE 192000
+
+/* Número de mostres que rep 'NES_PlayFrame' quan s'ha fixat una
+ * freqüència de mostreig amb 'NES_apu_set_rate'.
+ */
+#define NES_APU_RATE_CHUNK 512
+
+/* Formats de 'NES_apu_configure'. En estèreo els dos canals són
+ * iguals i les mostres van intercalades (esquerra, dreta).
+ */
+typedef enum
+  {
+    NES_APU_S16= 0,     /* Sencers de 16 bits amb signe. */
+    NES_APU_S16_STEREO,
+    NES_APU_F32,        /* 'float' entre -1 i 1. */
+    NES_APU_F32_STEREO
+  } NES_APUFormat;
+
+/* Grandària mínima dels blocs de 'NES_apu_configure'. */
+#define NES_APU_MIN_CHUNK 64
+
+/* Bytes que ocupa un bloc de CHUNK mostres en el format FORMAT. */
+#define NES_APU_CHUNK_BYTES(FORMAT,CHUNK)        			\
+  ((CHUNK)*((FORMAT)==NES_APU_S16 ? 2 :        			\
+            ((FORMAT)==NES_APU_F32_STEREO ? 8 : 4)))
+
+/* Tipus de la funció que rep els blocs de 'NES_apu_configure'. El
+ * buffer és el que s'ha passat a 'NES_apu_configure', ple amb el
+ * número de mostres indicat. UDATA és el de 'NES_init'.
+ */
+typedef void (NES_PlayChunk) (
+        		      const void *buffer,
+        		      void       *udata
+        		      );
+
+/* Canals de l'APU. */
+typedef enum
+  {
+    NES_APU_SQ1= 0,
+    NES_APU_SQ2,
+    NES_APU_TRG,
+    NES_APU_NOISE,
+    NES_APU_DMC,
+    NES_APU_NCHANNELS
+  } NES_APUChannel;
+
+/* Modes de 'NES_apu_set_stems'. */
+typedef enum
+  {
+    NES_APU_STEMS_OFF= 0,
+    NES_APU_STEMS_LEVELS,   /* El nivell de cada canal en cada cicle. */
+    NES_APU_STEMS_EVENTS    /* Sols els canvis de nivell. */
+  } NES_APUStemsMode;
+
+/* Número màxim d'events que es passen de colp. */
+#define NES_APU_STEMS_EVENTS_SIZE 4096
+
+/* Canvi de nivell d'un canal. */
+typedef struct
+{
+  
+  NESu64 cc;            /* Cicle, comptant des de 'NES_apu_set_stems'. */
+  NESu8  channel;       /* NES_APU_SQ1 ... NES_APU_DMC. */
+  NESu8  level;         /* 0-15, o 0-127 per al DMC. */
+  
+} NES_APUStemEvent;
+
+/* Pistes separades. En mode NES_APU_STEMS_LEVELS 'levels[c][i]' és el
+ * nivell del canal 'c' en l'i-èssim cicle del frame de l'APU (que
+ * coincideix amb la mostra 'i' de 'NES_PlayFrame' si no hi ha
+ * freqüència d'eixida). En mode NES_APU_STEMS_EVENTS sols hi ha
+ * events, el primer de cada canal és el seu nivell inicial.
+ */
+typedef struct
+{
+  
+  int                     nsamples;
+  const NESu8            *levels[NES_APU_NCHANNELS];
+  int                     nevents;
+  const NES_APUStemEvent *events;
+  
+} NES_APUStems;
+
+/* Tipus de la funció que rep les pistes separades. Es crida al final
+ * de cada frame de l'APU, just després de passar la mescla, i en
+ * mode NES_APU_STEMS_EVENTS també quan s'ompli el buffer d'events.
+ */
+typedef void (NES_PlayStems) (
+        		      const NES_APUStems *stems,
+        		      void               *udata
+        		      );
+
+/* Tipus de la funció que reprodueix un 'frame' de sò. Per defecte
+ * rep NES_APU_BUFFER_SIZE mostres, una per cicle d'UCP. Si s'ha
+ * fixat una freqüència amb 'NES_apu_set_rate' rep NES_APU_RATE_CHUNK
+ * mostres a eixa freqüència.
+ */
 typedef void (NES_PlayFrame) (
         		      const double  frame[NES_APU_BUFFER_SIZE],
         		      void         *udata
@@ -850,6 +1389,98 @@ NES_apu_init (
 void
 NES_apu_init_state (void);
 
+/* Fixa la freqüència de mostreig de l'eixida. Amb 0 (per defecte)
+ * es genera una mostra per cicle d'UCP. Amb qualsevol altre valor
+ * entre NES_APU_MIN_RATE i NES_APU_MAX_RATE es sintetitza
+ * directament a eixa freqüència amb graons limitats en banda, sense
+ * 'aliasing' i amb un retard d'unes 8 mostres. Es manté entre
+ * inicialitzacions. Torna -1 si la freqüència no és vàlida.
+ */
+int
+NES_apu_set_rate (
+        	  const int rate
+        	  );
+
+/* Igual que 'NES_apu_set_rate' però en compte de passar les mostres
+ * a 'NES_PlayFrame' s'escriuen en FORMAT en BUFFER, que és de
+ * l'usuari i ha de tindre NES_APU_CHUNK_BYTES(FORMAT,CHUNK) bytes, i
+ * cada vegada que s'ompli es crida a PLAY_CHUNK. Els frames de l'APU
+ * s'ajusten perquè cada bloc es genere tan prompte com és possible,
+ * per tant la latència depén de CHUNK (mínim NES_APU_MIN_CHUNK). La
+ * component continua s'elimina amb un filtre passa-alt. Amb RATE 0
+ * es torna a generar una mostra per cicle. Torna -1 si algun
+ * paràmetre no és vàlid.
+ */
+int
+NES_apu_configure (
+        	   const int            rate,
+        	   const NES_APUFormat  format,
+        	   const int            chunk,
+        	   void                *buffer,
+        	   NES_PlayChunk       *play_chunk
+        	   );
+
+/* Límits de 'NES_apu_set_ratio'. */
+#define NES_APU_MIN_RATIO 0.5
+#define NES_APU_MAX_RATIO 2.0
+
+/* Corregeix la freqüència d'eixida de 'NES_apu_set_rate' i
+ * 'NES_apu_configure' sense reiniciar la síntesi: es generen RATIO
+ * mostres per cada mostra a la freqüència fixada. Serveix per a
+ * sincronitzar l'àudio amb la imatge amb correccions xicotetes
+ * (per exemple 1.002). Es manté entre inicialitzacions. Torna -1 si
+ * està fora de NES_APU_MIN_RATIO..NES_APU_MAX_RATIO.
+ */
+int
+NES_apu_set_ratio (
+        	   const double ratio
+        	   );
+
+double
+NES_apu_get_ratio (void);
+
+/* Amb cert, quan hi ha freqüència d'eixida, en compte de sintetitzar
+ * amb graons es genera la mescla cicle a cicle com sense freqüència
+ * i es remostreja amb un filtre FIR polifàsic (vectoritzat amb AVX2
+ * si està disponible). És més costós però filtra la mescla
+ * completa. Reinicia la síntesi.
+ */
+void
+NES_apu_set_resampler (
+        	       const NES_Bool val
+        	       );
+
+/* Activa (o desactiva amb NES_APU_STEMS_OFF) l'eixida de cada canal
+ * per separat a més de la mescla, que no canvia. Mentre està activa
+ * l'APU avalua tots els canals cicle a cicle. Desactivada no té cap
+ * cost.
+ */
+void
+NES_apu_set_stems (
+        	   const NES_APUStemsMode  mode,
+        	   NES_PlayStems          *play_stems
+        	   );
+
+/* Amb NES_TRUE l'APU deixa de generar sò: no es crida a
+ * 'play_frame' ni a cap altra funció de sò. Continua avançant tot el
+ * que pot observar el programa (comptadors de longitud, IRQ del
+ * 'frame sequencer' i del DMC, i lectures per DMA del DMC amb els
+ * seus cicles), per tant l'execució és idèntica a la que es fa amb
+ * sò. Per defecte NES_FALSE.
+ */
+void
+NES_apu_set_silent (
+        	    const NES_Bool val
+        	    );
+
+/* Fixa el motor de l'APU. Es pot canviar en qualsevol moment, l'estat
+ * és el mateix per als dos motors.
+ */
+void
+NES_apu_set_engine (
+        	    const NES_APUEngine engine
+        	    );
+
 /* Reseteja l'APU. */
 void
 NES_apu_reset (void);
@@ -972,6 +1603,344 @@ NES_apu_load_state (
         	    FILE *f
         	    );
 
+/* Síntesi en un fil a part ('apu_async.c'). El fil de la simulació
+ * sols avança el que observa el programa (com amb
+ * 'NES_apu_set_silent') i apunta les escriptures en els registres,
+ * amb el cicle en què es fan, i els bytes que llig el DMC en dos cues
+ * sense bloquejos d'un productor i un consumidor. Un altre fil les
+ * consumeix amb una segona còpia de l'APU que és la que genera el
+ * sò, per tant 'play_frame' i la resta de funcions de sò es criden
+ * des d'eixe fil. La configuració de l'eixida ('NES_apu_configure',
+ * 'NES_apu_set_ratio', ...) es passa a les dos còpies. Si el fil no
+ * dona l'abast i s'omplin les cues el fil de la simulació
+ * s'espera. Es manté entre inicialitzacions i l'activació té efecte
+ * en la següent 'NES_apu_init'. Desactivar-la para el fil en eixe
+ * moment, després de generar el sò pendent, i l'APU principal
+ * continua generant-lo. Cal desactivar-la abans d'alliberar el que
+ * utilitzen les funcions de sò. Per defecte NES_FALSE.
+ */
+void
+NES_apu_set_async (
+        	   const NES_Bool val
+        	   );
+
+/* Funcions internes per a la síntesi en un fil a part, les crida
+ * 'apu.c'.
+ */
+#define NES_APU_ASYNC_RESET 0x0000 /* "Adreça" per a 'NES_apu_reset'. */
+
+void
+NES_apu_async_enable (
+        	      const NES_Bool val
+        	      );
+
+/* Para el fil després de processar tot el que queda. */
+void
+NES_apu_async_stop (void);
+
+NES_Bool
+NES_apu_async_init (
+        	    const NES_TVMode  tvmode,
+        	    NES_PlayFrame    *play_frame,
+        	    void             *udata
+        	    );
+
+void
+NES_apu_async_init_state (void);
+
+int
+NES_apu_async_save_state (
+        		  FILE *f
+        		  );
+
+int
+NES_apu_async_load_state (
+        		  FILE *f
+        		  );
+
+void
+NES_apu_async_clock (
+        	     const unsigned int cc
+        	     );
+
+void
+NES_apu_async_write (
+        	     const NESu16 addr,
+        	     const NESu8  data
+        	     );
+
+void
+NES_apu_async_dmc (
+        	   const NESu8 data
+        	   );
+
+void
+NES_apu_async_configure (
+        		 const int            rate,
+        		 const NES_APUFormat  format,
+        		 const int            chunk,
+        		 void                *buffer,
+        		 NES_PlayChunk       *play_chunk
+        		 );
+
+void
+NES_apu_async_set_ratio (
+        		 const double ratio
+        		 );
+
+void
+NES_apu_async_set_resampler (
+        		     const NES_Bool val
+        		     );
+
+void
+NES_apu_async_set_stems (
+        		 const NES_APUStemsMode  mode,
+        		 NES_PlayStems          *play_stems
+        		 );
+
+void
+NES_apu_async_set_silent (
+        		  const NES_Bool val
+        		  );
+
+void
+NES_apu_async_set_engine (
+        		  const NES_APUEngine engine
+        		  );
+
+/* Registre de la música ('apu_log.c'). En compte de les mostres
+ * s'escriuen en F les escriptures en els registres $4000-$4017, amb
+ * el cicle en què es fan, i els bytes que llig el DMC, en un format
+ * compacte semblant al VGM (uns pocs kilobytes per minut). Després
+ * es pot tornar a generar el so amb 'NES_apu_log_play' amb qualsevol
+ * configuració de l'eixida. El registre comença en la següent
+ * 'NES_apu_init' i amb F NULL s'acaba en eixe moment. No es pot
+ * carregar un estat mentre es registra. Torna -1 si no s'ha pogut
+ * escriure el registre que s'acaba.
+ */
+int
+NES_apu_set_log (
+        	 FILE *f
+        	 );
+
+/* Torna a generar el so d'un registre de NBYTES bytes amb el mode de
+ * televisió amb què es va registrar, com si fora
+ * 'NES_apu_init'. Utilitza la configuració de l'eixida que hi haja
+ * ('NES_apu_configure', 'NES_apu_set_ratio', ...) i no es pot cridar
+ * mentre s'executa la simulació. Torna -1 si el registre no és
+ * vàlid, en eixe cas el so es genera fins on es puga.
+ */
+int
+NES_apu_log_play (
+        	  const NESu8   *data,
+        	  const size_t   nbytes,
+        	  NES_PlayFrame *play_frame,
+        	  void          *udata
+        	  );
+
+/* Funcions internes per al registre de la música, les crida
+ * 'apu.c'.
+ */
+int
+NES_apu_log_enable (
+        	    FILE *f
+        	    );
+
+NES_Bool
+NES_apu_log_init (
+        	  const NES_TVMode tvmode
+        	  );
+
+void
+NES_apu_log_clock (
+        	   const unsigned int cc
+        	   );
+
+void
+NES_apu_log_write (
+        	   const NESu16 addr,
+        	   const NESu8  data
+        	   );
+
+void
+NES_apu_log_dmc (
+        	 const NESu16 addr,
+        	 const NESu8  data
+        	 );
+
+/* Mentre READ no siga NULL els bytes del DMC es trauen d'ella i no
+ * s'afegeixen els cicles de DMA, que ja estan en les marques de
+ * temps del registre.
+ */
+typedef NESu8 (NES_APUReplayRead) (
+        			   const NESu16 addr
+        			   );
+
+void
+NES_apu_set_replay (
+        	    NES_APUReplayRead *read
+        	    );
+
+
+/*********/
+/* AUDIO */
+/*********/
+/* Cua d'àudio per als 'frontends', sense bloquejos, per a un
+ * productor (el fil de la simulació, des de 'play_chunk' o
+ * 'play_frame') i un consumidor (normalment el fil de la targeta de
+ * so). Cap de les dos bandes s'espera mai: si no hi ha lloc les
+ * mostres es descarten, i si no n'hi ha prou es repeteix l'última.
+ * Per a no córrer més que el so, el productor pot esperar-se fora de
+ * la simulació (per exemple en 'NES_CheckSignals') mentre la cua
+ * estiga per damunt de la marca alta, i el consumidor el desperta
+ * quan baixa fins a la marca baixa.
+ */
+
+/* Tipus de les funcions per a despertar l'altra banda. */
+typedef void (NES_AudioRingWake) (
+        			  void *udata
+        			  );
+
+typedef struct
+{
+  
+  NESs16            *v;
+  unsigned int       size;         /* Mostres, potència de 2. */
+  unsigned int       low;          /* Marca baixa. */
+  unsigned int       high;         /* Marca alta. */
+  NES_AudioRingWake *wake_producer; /* Quan baixa fins a 'low'. */
+  NES_AudioRingWake *wake_consumer; /* Quan puja fins a 'high'. */
+  void              *udata;
+  unsigned int       in;           /* Sols l'escriu el productor. */
+  unsigned int       overruns;     /* Mostres descartades. */
+  unsigned int       out;          /* Sols l'escriu el consumidor. */
+  unsigned int       underruns;    /* Mostres que faltaven. */
+  NESs16             last;
+  double             target;       /* Control de la freqüència, sols */
+  double             max_delta;    /* el toca el productor. */
+  double             avg;
+  double             ratio;
+  unsigned int       adjustments;
+  unsigned int       min_fill;
+  unsigned int       max_fill;
+  
+} NES_AudioRing;
+
+/* Estadístiques de la cua. */
+typedef struct
+{
+  
+  int          fill;         /* Mostres en la cua. */
+  int          min_fill;     /* Mínim i màxim des de l'última */
+  int          max_fill;     /* consulta amb RESET. */
+  unsigned int overruns;     /* Mostres descartades. */
+  unsigned int underruns;    /* Mostres que faltaven. */
+  double       ratio;        /* Valor actual de 'NES_apu_set_ratio'. */
+  unsigned int adjustments;  /* Canvis de 'ratio'. */
+  
+} NES_AudioRingStats;
+
+/* Inicialitza la cua amb lloc per a almenys SIZE mostres. Les
+ * funcions per a despertar poden ser NULL. Torna -1 si no hi ha
+ * memòria o si no es compleix 0 <= LOW < HIGH <= SIZE.
+ */
+int
+NES_audio_ring_init (
+        	     NES_AudioRing     *ring,
+        	     const int          size,
+        	     const int          low,
+        	     const int          high,
+        	     NES_AudioRingWake *wake_producer,
+        	     NES_AudioRingWake *wake_consumer,
+        	     void              *udata
+        	     );
+
+void
+NES_audio_ring_free (
+        	     NES_AudioRing *ring
+        	     );
+
+/* Buida la cua i torna la relació a 1. No es pot cridar mentre
+ * l'utilitzen.
+ */
+void
+NES_audio_ring_clear (
+        	      NES_AudioRing *ring
+        	      );
+
+/* Mostres en la cua. Es pot cridar des de qualsevol banda. */
+int
+NES_audio_ring_fill (
+        	     const NES_AudioRing *ring
+        	     );
+
+/* Afegeix N mostres (productor). Torna les que caben. */
+int
+NES_audio_ring_write (
+        	      NES_AudioRing *ring,
+        	      const NESs16  *v,
+        	      const int      n
+        	      );
+
+/* Com 'NES_audio_ring_write' però amb mostres reals en [-1,1], com
+ * les que rep 'NES_PlayFrame' amb 'NES_apu_set_rate', que es
+ * converteixen a 16 bits saturant.
+ */
+int
+NES_audio_ring_write_double (
+        		     NES_AudioRing *ring,
+        		     const double  *v,
+        		     const int      n
+        		     );
+
+/* Trau N mostres (consumidor) en DST. Si no n'hi ha prou completa
+ * amb l'última. Torna les que hi havia.
+ */
+int
+NES_audio_ring_read (
+        	     NES_AudioRing *ring,
+        	     NESs16        *dst,
+        	     const int      n
+        	     );
+
+/* Control dinàmic de la freqüència. Si el productor no va exactament
+ * a la velocitat del consumidor (el rellotge de la targeta de so no
+ * és el de la pantalla ni el del NES), la cua acaba buidant-se o
+ * omplint-se. Per a evitar-ho sense descartar frames es corregeix
+ * la relació de 'NES_apu_set_ratio' en funció de quant s'allunya la
+ * cua de TARGET mostres, com a molt en MAX_DELTA (per exemple 0.005,
+ * que no s'aprecia en el to). Amb MAX_DELTA 0 es desactiva. Torna
+ * -1 si MAX_DELTA no està en [0,0.05] o TARGET no està en
+ * (0,grandària].
+ */
+int
+NES_audio_ring_set_rate_control (
+        			 NES_AudioRing *ring,
+        			 const int      target,
+        			 const double   max_delta
+        			 );
+
+/* Mostreja la cua i, si el control està actiu, actualitza la relació
+ * cridant a 'NES_apu_set_ratio'. L'ha de cridar el productor
+ * regularment, fora de 'NES_PlayChunk' i 'NES_PlayFrame' (per
+ * exemple en 'NES_CheckSignals'). Torna la relació actual.
+ */
+double
+NES_audio_ring_rate_control (
+        		     NES_AudioRing *ring
+        		     );
+
+/* Estadístiques (productor). Si RESET es tornen a calcular el mínim
+ * i el màxim des d'ara.
+ */
+void
+NES_audio_ring_get_stats (
+        		  NES_AudioRing      *ring,
+        		  NES_AudioRingStats *stats,
+        		  const NES_Bool      reset
+        		  );
+
 
 /*******/
 /* DMA */
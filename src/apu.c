@@ -25,9 +25,16 @@
  */
 
 
+#include <math.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
 
 #include "NES.h"
 
@@ -38,6 +45,11 @@
 /* MACROS */
 /**********/
 
+#ifdef USE_AVX2
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#define HAS_AVX2 __builtin_cpu_supports ( "avx2" )
+#endif
+
 #define SAVE(VAR)                                               \
   if ( fwrite ( &(VAR), sizeof(VAR), 1, f ) != 1 ) return -1
 
@@ -48,6 +60,37 @@
   if ( !(COND) ) return -1;
 
 
+/* Quan la síntesi es fa en un altre fil ('apu_async.c') o es
+   registra la música ('apu_log.c') s'apunten les escriptures en els
+   registres i els bytes que llig el DMC. La còpia de l'APU del fil
+   es compila amb NES_APU_ASYNC_CORE. */
+#ifdef NES_APU_ASYNC_CORE
+#define LOG_WRITE(ADDR,DATA)
+#define LOG_DMC(ADDR,DATA)
+#define LOG_CLOCK(CC)
+#define DMC_READ(ADDR) NES_mem_read ( (ADDR) )
+#define ASYNC(CALL)
+#else
+#define LOG_WRITE(ADDR,DATA)                                    \
+  do {                                                          \
+    if ( _async ) NES_apu_async_write ( (ADDR), (DATA) );       \
+    if ( _logging ) NES_apu_log_write ( (ADDR), (DATA) );       \
+  } while(0)
+#define LOG_DMC(ADDR,DATA)                                      \
+  do {                                                          \
+    if ( _async ) NES_apu_async_dmc ( (DATA) );                 \
+    if ( _logging ) NES_apu_log_dmc ( (ADDR), (DATA) );         \
+  } while(0)
+#define LOG_CLOCK(CC)                                           \
+  do {                                                          \
+    if ( _logging ) NES_apu_log_clock ( (CC) );                 \
+  } while(0)
+#define DMC_READ(ADDR)                                          \
+  (_replay != NULL ? _replay ( (ADDR) ) : NES_mem_read ( (ADDR) ))
+#define ASYNC(CALL) CALL
+#endif
+
+
 #define LC_CLOCK(LC)                                  \
   if ( (LC).count != 0 && !(LC).halted ) --(LC).count
 
@@ -80,6 +123,19 @@
   _dmc.dma.remain= (_dmc.dma.length<<4)+1
 
 
+/* Síntesi limitada en banda. */
+#define BLIP_PHASES 32
+#define BLIP_TAPS   16
+#define BLIP_FRAC   32
+#define BLIP_SIZE   (4096+BLIP_TAPS)
+
+
+/* Remostrejador FIR polifàsic. */
+#define FIR_PHASES 64
+#define FIR_TAPS   48
+#define FIR_HIST   (NES_APU_BUFFER_SIZE+FIR_TAPS)
+
+
 
 
 /*********/
@@ -250,6 +306,209 @@ static const int _dmc_periods[2][16]=
 
 
 
+/* Resposta a un graó limitada en banda, derivada i mostrejada amb
+ * BLIP_PHASES desplaçaments distints. És un 'sinc' amb tall a 0.45
+ * de la freqüència de mostreig i finestra de Blackman.
+ */
+static const double _blip_kernel_table[BLIP_PHASES][BLIP_TAPS]=
+  {
+    {
+      0.000105580, -0.000775544, 0.001010492, 0.002750565,
+      -0.018319021, 0.060073055, -0.163825186, 0.618980058,
+      0.618980058, -0.163825186, 0.060073055, -0.018319021,
+      0.002750565, 0.001010492, -0.000775544, 0.000105580
+    },
+    {
+      0.000083758, -0.000606509, 0.000428183, 0.004153422,
+      -0.020907342, 0.063667471, -0.166056235, 0.587238501,
+      0.649686232, -0.160087364, 0.055799539, -0.015443378,
+      0.001241735, 0.001625434, -0.000953456, 0.000130010
+    },
+    {
+      0.000064619, -0.000447479, -0.000118145, 0.005443679,
+      -0.023199946, 0.066583770, -0.166842004, 0.554615693,
+      0.679206611, -0.154788604, 0.050851570, -0.012291770,
+      -0.000365080, 0.002269104, -0.001138916, 0.000156898
+    },
+    {
+      0.000048177, -0.000299378, -0.000625704, 0.006616067,
+      -0.025191343, 0.068828326, -0.166250712, 0.521268525,
+      0.707395452, -0.147882633, 0.045239614, -0.008878547,
+      -0.002060529, 0.002937047, -0.001330387, 0.000186024
+    },
+    {
+      0.000034381, -0.000162926, -0.001092256, 0.007666656,
+      -0.026878866, 0.070412637, -0.164356671, 0.487355672,
+      0.734112594, -0.139331582, 0.038980116, -0.005221058,
+      -0.003833922, 0.003624266, -0.001526133, 0.000217093
+    },
+    {
+      0.000023123, -0.000038654, -0.001516109, 0.008592822,
+      -0.028262569, 0.071353027, -0.161239623, 0.453036620,
+      0.759224349, -0.129106463, 0.032095618, -0.001339634,
+      -0.005673264, 0.004325247, -0.001724224, 0.000249733
+    },
+    {
+      0.000014248, 0.000073099, -0.001896095, 0.009393203,
+      -0.029345111, 0.071670322, -0.156984055, 0.418470694,
+      0.782604353, -0.117187577, 0.024614820, 0.002742462,
+      -0.007565296, 0.005033980, -0.001922546, 0.000283498
+    },
+    {
+      0.000007555, 0.000172168, -0.002231555, 0.010067651,
+      -0.030131612, 0.071389498, -0.151678495, 0.383816093,
+      0.804134369, -0.103564881, 0.016572611, 0.006999111,
+      -0.009495566, 0.005743992, -0.002118809, 0.000317870
+    },
+    {
+      0.000002805, 0.000258557, -0.002522310, 0.010617168,
+      -0.030629500, 0.070539308, -0.145414800, 0.349228946,
+      0.823705042, -0.088238284, 0.008010043, 0.011401439,
+      -0.011448496, 0.006448390, -0.002310566, 0.000352258
+    },
+    {
+      -0.000000267, 0.000332422, -0.002768638, 0.011043839,
+      -0.030848344, 0.069151902, -0.138287434, 0.314862398,
+      0.841216598, -0.071217878, -0.001025745, 0.015917955,
+      -0.013407480, 0.007139898, -0.002495230, 0.000386005
+    },
+    {
+      -0.000001953, 0.000394065, -0.002971243, 0.011350755,
+      -0.030799672, 0.067262420, -0.130392754, 0.280865714,
+      0.856579482, -0.052524116, -0.010481648, 0.020514712,
+      -0.015354986, 0.007810919, -0.002670091, 0.000418394
+    },
+    {
+      -0.000002554, 0.000443911, -0.003131217, 0.011541934,
+      -0.030496781, 0.064908589, -0.121828289, 0.247383434,
+      0.869714927, -0.032187903, -0.020298768, 0.025155495,
+      -0.017272673, 0.008453584, -0.002832340, 0.000448651
+    },
+    {
+      -0.000002382, 0.000482501, -0.003250010, 0.011622231,
+      -0.029954542, 0.062130303, -0.112692043, 0.214554560,
+      0.880555458, -0.010250635, -0.030412638, 0.029802039,
+      -0.019141528, 0.009059823, -0.002979099, 0.000475959
+    },
+    {
+      -0.000001746, 0.000510472, -0.003329390, 0.011597253,
+      -0.029189196, 0.058969215, -0.103081803, 0.182511799,
+      0.889045322, 0.013235849, -0.040753495, 0.034414278,
+      -0.020942005, 0.009621430, -0.003107441, 0.000499458
+    },
+    {
+      -0.000000949, 0.000528544, -0.003371405, 0.011473262,
+      -0.028218147, 0.055468313, -0.093094479, 0.151380851,
+      0.895140835, 0.038209372, -0.051246600, 0.038950611,
+      -0.022654187, 0.010130142, -0.003214428, 0.000518265
+    },
+    {
+      -0.000000278, 0.000537503, -0.003378346, 0.011257083,
+      -0.027059757, 0.051671519, -0.082825455, 0.121279764,
+      0.898810662, 0.064597610, -0.061812609, 0.043368200,
+      -0.024257949, 0.010577716, -0.003297139, 0.000531477
+    },
+    {
+      0.000000000, 0.000538189, -0.003352705, 0.010956012,
+      -0.025733138, 0.047623285, -0.072367986, 0.092318340,
+      0.900036008, 0.092318340, -0.072367986, 0.047623285,
+      -0.025733138, 0.010956012, -0.003352705, 0.000538189
+    },
+    {
+      0.000000000, 0.000531477, -0.003297138, 0.010577713,
+      -0.024257942, 0.043368188, -0.061812592, 0.064597592,
+      0.898810412, 0.121279730, -0.082825432, 0.051671505,
+      -0.027059749, 0.011257080, -0.003378345, 0.000537503
+    },
+    {
+      0.000000000, 0.000518265, -0.003214425, 0.010130133,
+      -0.022654165, 0.038950574, -0.051246552, 0.038209336,
+      0.895139986, 0.151380708, -0.093094390, 0.055468260,
+      -0.028218120, 0.011473251, -0.003371402, 0.000528543
+    },
+    {
+      0.000000000, 0.000499457, -0.003107436, 0.009621414,
+      -0.020941968, 0.034414218, -0.040753424, 0.013235826,
+      0.889043770, 0.182511480, -0.103081623, 0.058969112,
+      -0.029189145, 0.011597233, -0.003329384, 0.000510471
+    },
+    {
+      0.000000000, 0.000475957, -0.002979091, 0.009059801,
+      -0.019141482, 0.029801968, -0.030412565, -0.010250610,
+      0.880553361, 0.214554049, -0.112691774, 0.062130156,
+      -0.029954471, 0.011622204, -0.003250002, 0.000482500
+    },
+    {
+      0.000000000, 0.000448650, -0.002832333, 0.008453563,
+      -0.017272629, 0.025155430, -0.020298716, -0.032187821,
+      0.869712706, 0.247382802, -0.121827978, 0.064908423,
+      -0.030496703, 0.011541904, -0.003131209, 0.000443910
+    },
+    {
+      0.000000000, 0.000418393, -0.002670085, 0.007810904,
+      -0.015354956, 0.020514672, -0.010481627, -0.052524013,
+      0.856577809, 0.280865166, -0.130392499, 0.067262289,
+      -0.030799612, 0.011350733, -0.002971237, 0.000394064
+    },
+    {
+      0.000000000, 0.000386005, -0.002495229, 0.007139896,
+      -0.013407477, 0.015917951, -0.001025745, -0.071217859,
+      0.841216373, 0.314862314, -0.138287397, 0.069151883,
+      -0.030848336, 0.011043836, -0.002768638, 0.000332422
+    },
+    {
+      0.000000000, 0.000352259, -0.002310573, 0.006448408,
+      -0.011448528, 0.011401471, 0.008010066, -0.088238531,
+      0.823707353, 0.349229926, -0.145415208, 0.070539506,
+      -0.030629586, 0.010617197, -0.002522317, 0.000258557
+    },
+    {
+      0.000000000, 0.000317873, -0.002118825, 0.005744036,
+      -0.009495637, 0.006999164, 0.016572736, -0.103565664,
+      0.804140444, 0.383818992, -0.151679641, 0.071390037,
+      -0.030131839, 0.010067727, -0.002231571, 0.000172169
+    },
+    {
+      0.000000000, 0.000283502, -0.001922573, 0.005034052,
+      -0.007565404, 0.002742501, 0.024615170, -0.117189247,
+      0.782615504, 0.418476657, -0.156986292, 0.071671344,
+      -0.029345529, 0.009393337, -0.001896122, 0.000073100
+    },
+    {
+      0.000000000, 0.000249739, -0.001724264, 0.004325347,
+      -0.005673395, -0.001339665, 0.032096360, -0.129109448,
+      0.759241905, 0.453047096, -0.161243352, 0.071354677,
+      -0.028263223, 0.008593021, -0.001516144, -0.000038655
+    },
+    {
+      0.000000000, 0.000217100, -0.001526185, 0.003624391,
+      -0.003834054, -0.005221237, 0.038981457, -0.139336373,
+      0.734137834, 0.487372428, -0.164362322, 0.070415058,
+      -0.026879790, 0.007666920, -0.001092294, -0.000162932
+    },
+    {
+      0.000000000, 0.000186033, -0.001330451, 0.002937189,
+      -0.002060628, -0.008878975, 0.045241793, -0.147889758,
+      0.707429534, 0.521293639, -0.166258722, 0.068831642,
+      -0.025192557, 0.006616386, -0.000625734, -0.000299392
+    },
+    {
+      0.000000000, 0.000156908, -0.001138990, 0.002269251,
+      -0.000365104, -0.012292564, 0.050854856, -0.154798607,
+      0.679250504, 0.554651535, -0.166852786, 0.066588073,
+      -0.023201446, 0.005444030, -0.000118153, -0.000447508
+    },
+    {
+      0.000000000, 0.000130021, -0.000953536, 0.001625570,
+      0.001241839, -0.015444672, 0.055804213, -0.160100773,
+      0.649740652, 0.587287691, -0.166070145, 0.063672804,
+      -0.020909093, 0.004153770, 0.000428219, -0.000606560
+    }
+  };
+
+
+
+
 /*********/
 /* ESTAT */
 /*********/
@@ -266,6 +525,114 @@ static double _frame[NES_APU_BUFFER_SIZE];
 static unsigned int _nsamples;
 
 
+/* Cicles del frame actual. Sempre és NES_APU_BUFFER_SIZE excepte
+ * quan es sintetitza a la freqüència de l'amfitrió, que s'ajusta
+ * perquè el frame acabe quan es completa el següent bloc.
+ */
+static unsigned int _frame_size;
+
+
+/* Motor. */
+static NES_APUEngine _engine= NES_APU_EVENT;
+
+
+/* Sense sò. */
+static NES_Bool _silent;
+
+
+#ifndef NES_APU_ASYNC_CORE
+/* La síntesi es fa en un altre fil. */
+static NES_Bool _async;
+
+/* Es registra la música. */
+static NES_Bool _logging;
+
+/* Es reprodueix un registre ('NES_apu_set_replay'). */
+static NES_APUReplayRead *_replay;
+#endif
+
+
+/* Correcció de la freqüència de l'eixida ('NES_apu_set_ratio'). */
+static double _ratio= 1.0;
+
+
+/* Síntesi a la freqüència de l'amfitrió. Sols es guarden els canvis
+ * de l'eixida en el cicle en què es produeixen, com a graons
+ * limitats en banda en 'buf', i al acabar cada frame de l'APU
+ * s'integren les mostres que ja no poden canviar. Si no hi ha
+ * 'play_chunk' les mostres es passen a 'play_frame' en 'out', si
+ * no es filtren, es converteixen a 'format' i s'escriuen en el
+ * buffer de l'usuari.
+ */
+static struct
+{
+  
+  int            rate;           /* 0 si està desactivada. */
+  NES_APUFormat  format;
+  int            chunk;          /* Mostres per bloc. */
+  void          *buffer;         /* Buffer de l'usuari. */
+  NES_PlayChunk *play_chunk;
+  double         hp_a;           /* Filtre passa-alt. */
+  double         hp_x;
+  double         hp_y;
+  int    ccpersec;               /* Cicles d'UCP per segon. */
+  NESu64 factor;                 /* Mostres per cicle amb BLIP_FRAC
+        			    bits de fracció. */
+  NESu64 offset;                 /* Posició en 'buf' del cicle 0 del
+        			    frame actual. */
+  double last;                   /* Últim valor de l'eixida. */
+  double sum;                    /* Integrador. */
+  int    nout;                   /* Mostres en '_frame'. */
+  double kernel[BLIP_PHASES][BLIP_TAPS];
+  double buf[BLIP_SIZE];
+  double out[NES_APU_RATE_CHUNK];  /* Bloc per a 'play_frame'. */
+  
+} _blip;
+
+
+/* Pistes separades. En mode NES_APU_STEMS_LEVELS 'n' és el número
+ * de cicles apuntats en 'levels', que coincideix amb '_nsamples'. En
+ * mode NES_APU_STEMS_EVENTS és el número d'events en 'events'.
+ */
+static struct
+{
+  
+  NES_APUStemsMode  mode;
+  NES_PlayStems    *play_stems;
+  NESu64            cc;          /* Cicles des de l'activació. */
+  int               last[NES_APU_NCHANNELS];
+  int               n;
+  NESu8             levels[NES_APU_NCHANNELS][NES_APU_BUFFER_SIZE];
+  NES_APUStemEvent  events[NES_APU_STEMS_EVENTS_SIZE];
+  
+} _stems;
+
+
+/* Remostrejador per a quan es vol la mescla cicle a cicle a la
+ * freqüència de l'amfitrió. Primer es fa la mitjana de cada D cicles
+ * (unes 4 vegades la freqüència d'eixida) i després es remostreja
+ * amb un 'sinc' amb finestra de Blackman de FIR_TAPS coeficients i
+ * FIR_PHASES fases, tallat a 0.45 de la freqüència d'eixida.
+ */
+static struct
+{
+  
+  NES_Bool enabled;
+  int      D;                           /* Cicles per mostra
+        				   intermèdia. */
+  int      cnt;                         /* Cicles en 'acc'. */
+  double   acc;
+  double   step;                        /* Mostres intermèdies per
+        				   mostra d'eixida. */
+  double   pos;                         /* Posició en 'hist' de la
+        				   següent mostra d'eixida. */
+  int      nhist;
+  double   kernel[FIR_PHASES][FIR_TAPS];
+  double   hist[FIR_HIST];
+  
+} _fir;
+
+
 /* Frame Sequencer. NOTA: no implemente el divisor, per que
  * directament cridaré la funció en la freqüència necessària.
  */
@@ -716,7 +1083,8 @@ static void
 dmc_dma_read (void)
 {
   
-  _dmc.buffer.sample= NES_mem_read ( _dmc.dma.addr );
+  _dmc.buffer.sample= DMC_READ ( _dmc.dma.addr );
+  LOG_DMC ( _dmc.dma.addr, _dmc.buffer.sample );
   _dmc.buffer.empty= NES_FALSE;
   if ( ++_dmc.dma.addr == 0x0000 ) _dmc.dma.addr= 0x8000;
   if ( --_dmc.dma.remain == 0 )
@@ -893,188 +1261,1151 @@ clock_frame (void)
 } /* end clock_frame */
 
 
+/* Fixa la grandària del següent frame perquè acabe just quan es
+   pot completar el bloc actual. */
+static void
+blip_next_frame (void)
+{
+  
+  NESu64 need, cc;
+  
+  
+  need= ((NESu64) (_blip.chunk-_blip.nout))<<BLIP_FRAC;
+  cc= need > _blip.offset ?
+    (need-_blip.offset+_blip.factor-1)/_blip.factor : 1;
+  _frame_size= cc > NES_APU_BUFFER_SIZE ? NES_APU_BUFFER_SIZE : (int) cc;
+  
+} /* end blip_next_frame */
 
 
-/**********************/
-/* FUNCIONS PÚBLIQUES */
-/**********************/
+/* Com 'blip_next_frame' per al remostrejador. */
+static void
+fir_next_frame (void)
+{
+  
+  int need;
+  long cc;
+  
+  
+  need= (int) (_fir.pos + (_blip.chunk-_blip.nout-1)*_fir.step) +
+    FIR_TAPS - _fir.nhist;
+  cc= need > 0 ? (long) need*_fir.D - _fir.cnt : 1;
+  if ( cc < 1 ) cc= 1;
+  _frame_size= cc > NES_APU_BUFFER_SIZE ? NES_APU_BUFFER_SIZE : (int) cc;
+  
+} /* end fir_next_frame */
 
-NES_Bool
-NES_apu_clock (
-               unsigned int *cc
-               )
+
+/* Comença de nou la síntesi. També reinicia el frame. */
+static void
+blip_reset (void)
 {
   
-  unsigned int CC;
-  int sq1_out, sq2_out, trg_out, noise_out, dmc_out;
-  NES_Bool ret;
+  int i;
   
   
-  ret= NES_FALSE;
-  CC= *cc;
-  while ( CC )
+  _nsamples= 0;
+  _frame_size= NES_APU_BUFFER_SIZE;
+  _stems.n= 0;
+  _blip.offset= 0;
+  _blip.last= 0.0;
+  _blip.sum= 0.0;
+  _blip.hp_x= 0.0;
+  _blip.hp_y= 0.0;
+  _blip.nout= 0;
+  for ( i= 0; i < BLIP_SIZE; ++i )
+    _blip.buf[i]= 0.0;
+  _fir.cnt= 0;
+  _fir.acc= 0.0;
+  _fir.pos= 0.0;
+  /* Silenci abans del principi, perquè la primera mostra d'eixida
+     estiga centrada en el cicle 0. */
+  for ( i= 0; i < FIR_TAPS/2-1; ++i )
+    _fir.hist[i]= 0.0;
+  _fir.nhist= FIR_TAPS/2-1;
+  if ( _blip.rate && _blip.factor != 0 )
     {
-      
-      /* Calcula l'eixida de cada canal. */
-      sq1_out= calc_sq_out ( &_sq1 );
-      sq2_out= calc_sq_out ( &_sq2 );
-      trg_out= CALC_TRG_OUT;
-      noise_out= calc_noise_out ();
-      dmc_out= _dmc.counter_dac;
-      
-      /* Calcula valor instant 't'. */
-      _frame[_nsamples++]=
-        _square_out[sq1_out+sq2_out] +
-        _tnd_out[3*trg_out+(noise_out<<1)+dmc_out];
-      if ( ++_fseq.cc == _fseq.ccperframe )
-        ret|= clock_frame ();
-      if ( _nsamples == NES_APU_BUFFER_SIZE )
-        {
-          _nsamples= 0;
-          _play_frame ( _frame, _udata );
-        }
-      
-      /* Clock els canals. */
-      clock_sq_timer ( &_sq1 );
-      clock_sq_timer ( &_sq2 );
-      clock_trg_timer ();
-      clock_noise_timer ();
-      if ( clock_dmc_timer () )
+      if ( _fir.enabled ) fir_next_frame ();
+      else blip_next_frame ();
+    }
+  
+} /* end blip_reset */
+
+
+/* Normalitza la taula perquè cada fase sume exactament 1 i
+   l'integrador no derive. */
+static void
+blip_init_kernel (void)
+{
+  
+  int p, j;
+  double sum;
+  
+  
+  for ( p= 0; p < BLIP_PHASES; ++p )
+    {
+      for ( sum= 0.0, j= 0; j < BLIP_TAPS; ++j )
+        sum+= _blip_kernel_table[p][j];
+      for ( j= 0; j < BLIP_TAPS; ++j )
+        _blip.kernel[p][j]= _blip_kernel_table[p][j]/sum;
+    }
+  
+} /* end blip_init_kernel */
+
+
+/* L'eixida canvia a VALUE en el cicle CC del frame actual. */
+static void
+blip_add (
+          const unsigned int cc,
+          const double       value
+          )
+{
+  
+  NESu64 pos;
+  const double *k;
+  double *b, delta;
+  int j;
+  
+  
+  pos= _blip.offset + cc*_blip.factor;
+  b= &(_blip.buf[pos>>BLIP_FRAC]);
+  k= _blip.kernel[(pos>>(BLIP_FRAC-5))&(BLIP_PHASES-1)];
+  delta= value-_blip.last;
+  for ( j= 0; j < BLIP_TAPS; ++j )
+    b[j]+= delta*k[j];
+  _blip.last= value;
+  
+} /* end blip_add */
+
+
+/* Escriu una mostra en el bloc actual. */
+static void
+output_sample (
+             const double sample
+             )
+{
+  
+  double y;
+  int i;
+  
+  
+  if ( _blip.play_chunk == NULL )
+    {
+      _blip.out[_blip.nout++]= sample;
+      if ( _blip.nout == _blip.chunk )
         {
-          (*cc)+= 4;
-          CC+= 4;
+          _blip.nout= 0;
+          _play_frame ( _blip.out, _udata );
         }
-      ret|= _dmc.iflag;
-
-      --CC;
-      
+      return;
     }
   
-  return ret;
+  /* Lleva la component continua i satura. */
+  _blip.hp_y= _blip.hp_a*(_blip.hp_y + sample - _blip.hp_x);
+  _blip.hp_x= sample;
+  y= _blip.hp_y;
+  if ( y > 1.0 ) y= 1.0;
+  else if ( y < -1.0 ) y= -1.0;
   
-} /* end NES_apu_clock */
+  i= _blip.nout++;
+  switch ( _blip.format )
+    {
+    case NES_APU_S16:
+      ((NESs16 *) _blip.buffer)[i]= (NESs16) (y*32767.0);
+      break;
+    case NES_APU_S16_STEREO:
+      ((NESs16 *) _blip.buffer)[2*i]=
+        ((NESs16 *) _blip.buffer)[2*i+1]= (NESs16) (y*32767.0);
+      break;
+    case NES_APU_F32:
+      ((float *) _blip.buffer)[i]= (float) y;
+      break;
+    case NES_APU_F32_STEREO:
+      ((float *) _blip.buffer)[2*i]=
+        ((float *) _blip.buffer)[2*i+1]= (float) y;
+      break;
+    }
+  if ( _blip.nout == _blip.chunk )
+    {
+      _blip.nout= 0;
+      _blip.play_chunk ( _blip.buffer, _udata );
+    }
+  
+} /* end output_sample */
 
 
-void
-NES_apu_conf_fseq (
-        	   NESu8 data
-        	   )
+/* Integra les mostres que ja no poden canviar. */
+static void
+blip_end_frame (void)
 {
   
-  _fseq.step= 0;
-  _fseq.clock= data&0x80 ?
-    fseq_clock_mode1 : fseq_clock_mode0;
-  _fseq.irq= data&0x40 ? NES_FALSE : NES_TRUE;
+  int n, i;
   
-} /* end NES_apu_conf_fseq */
+  
+  _blip.offset+= _frame_size*_blip.factor;
+  n= (int) (_blip.offset>>BLIP_FRAC);
+  for ( i= 0; i < n; ++i )
+    {
+      _blip.sum+= _blip.buf[i];
+      output_sample ( _blip.sum );
+    }
+  for ( i= 0; i < BLIP_TAPS; ++i )
+    _blip.buf[i]= _blip.buf[n+i];
+  for ( ; i < n+BLIP_TAPS; ++i )
+    _blip.buf[i]= 0.0;
+  _blip.offset-= ((NESu64) n)<<BLIP_FRAC;
+  blip_next_frame ();
+  
+} /* end blip_end_frame */
 
 
-void
-NES_apu_control (
-        	 NESu8 data
-        	 )
+/* Calcula els coeficients per a la freqüència d'eixida actual. */
+static void
+fir_init (void)
 {
   
-  if ( data&0x10 )
+  int p, k;
+  double fc, x, w, v, sum;
+  
+  
+  _fir.D= _blip.ccpersec/(4*_blip.rate);
+  if ( _fir.D < 1 ) _fir.D= 1;
+  fc= 0.9*_blip.rate*_fir.D/(double) _blip.ccpersec;
+  for ( p= 0; p < FIR_PHASES; ++p )
     {
-      if ( _dmc.dma.remain == 0 )
+      sum= 0.0;
+      for ( k= 0; k < FIR_TAPS; ++k )
         {
-          DMC_RESTART;
-          if ( _dmc.buffer.empty )
-            {
-              dmc_dma_read ();
-              NES_dma_extra_cc+= 4;
-            }
+          x= k - (FIR_TAPS/2-1) - p/(double) FIR_PHASES;
+          w= (x + FIR_TAPS/2)/FIR_TAPS;
+          v= x == 0.0 ? 1.0 : sin ( M_PI*fc*x )/(M_PI*fc*x);
+          v*= 0.42 - 0.5*cos ( 2*M_PI*w ) + 0.08*cos ( 4*M_PI*w );
+          _fir.kernel[p][k]= v;
+          sum+= v;
         }
+      for ( k= 0; k < FIR_TAPS; ++k )
+        _fir.kernel[p][k]/= sum;
     }
-  else _dmc.dma.remain= 0;
-  if ( (data&0x08) == 0 ) _noise.length.count= 0;
-  if ( (data&0x04) == 0 ) _trg.length.count= 0;
-  if ( (data&0x02) == 0 ) _sq2.length.count= 0;
-  if ( (data&0x01) == 0 ) _sq1.length.count= 0;
   
-} /* NES_apu_control */
+} /* end fir_init */
 
 
-NESu8
-NES_apu_CSR (void)
+/* Es sumen 4 carrils per separat i al final (0+2)+(1+3), com fa la
+   versió amb AVX2, perquè les dues donen el mateix resultat. */
+static double
+fir_dot (
+         const double *x,
+         const double *h
+         )
 {
   
-  NESu8 ret;
+  double acc[4];
+  int k, j;
   
   
-  ret= 0x00;
-  if ( _dmc.iflag ) ret|= 0x80;
-  if ( _fseq.iflag ) ret|= 0x40;
-  if ( _dmc.dma.remain > 0 ) ret|= 0x10;
-  if ( _noise.length.count > 0 ) ret|= 0x08;
-  if ( _trg.length.count > 0 ) ret|= 0x04;
-  if ( _sq2.length.count > 0 ) ret|= 0x02;
-  if ( _sq1.length.count > 0 ) ret|= 0x01;
-  _fseq.iflag= NES_FALSE;
+  for ( j= 0; j < 4; ++j )
+    acc[j]= 0.0;
+  for ( k= 0; k < FIR_TAPS; k+= 4 )
+    for ( j= 0; j < 4; ++j )
+      acc[j]+= x[k+j]*h[k+j];
   
-  return ret;
+  return (acc[0]+acc[2]) + (acc[1]+acc[3]);
   
-} /* NES_apu_CSR */
+} /* end fir_dot */
 
 
-void
-NES_apu_init (
-              const NES_TVMode  tvmode,
-              NES_PlayFrame    *play_frame,
-              void             *udata
+#ifdef USE_AVX2
+static double TARGET_AVX2
+fir_dot_avx2 (
+              const double *x,
+              const double *h
               )
 {
   
-  /* Valors estimats empiracament per gent en foros. La idea és que
-     PAL~50Hz i NTSC~60Hz. */
-  _fseq.ccperframe= tvmode==NES_PAL ? 8313 : 7458;
-  _dmc.periods= &(_dmc_periods[tvmode][0]);
-  _noise.periods= &(_noise_periods[tvmode][0]);
+  __m256d acc;
+  __m128d lo;
+  int k;
   
-  _play_frame= play_frame;
-  _udata= udata;
   
-  NES_apu_init_state ();
+  acc= _mm256_setzero_pd ();
+  for ( k= 0; k < FIR_TAPS; k+= 4 )
+    acc= _mm256_add_pd ( acc, _mm256_mul_pd ( _mm256_loadu_pd ( x+k ),
+        					 _mm256_loadu_pd ( h+k ) ) );
+  lo= _mm_add_pd ( _mm256_castpd256_pd128 ( acc ),
+        	   _mm256_extractf128_pd ( acc, 1 ) );
   
-} /* end NES_apu_init */
+  return _mm_cvtsd_f64 ( _mm_add_sd ( lo, _mm_unpackhi_pd ( lo, lo ) ) );
+  
+} /* end fir_dot_avx2 */
+#endif
 
 
-void
-NES_apu_init_state (void)
+/* Remostreja la mescla del frame actual. */
+static void
+fir_end_frame (void)
 {
-
-  int i;
   
+  const double *p, *end;
+  double *hist;
+  int n, ip;
+  double (*dot) (const double *,const double *);
   
-  for ( i= 0; i < NES_APU_BUFFER_SIZE; ++i )
-    _frame[i]= 0.0;
-  NES_apu_reset ();
   
-} /* end NES_apu_init_state */
+  dot= fir_dot;
+#ifdef USE_AVX2
+  if ( HAS_AVX2 ) dot= fir_dot_avx2;
+#endif
+  
+  /* Mitjana de cada D cicles. */
+  hist= _fir.hist;
+  n= _fir.nhist;
+  for ( p= _frame, end= p+_frame_size; p != end; ++p )
+    {
+      _fir.acc+= *p;
+      if ( ++_fir.cnt == _fir.D )
+        {
+          hist[n++]= _fir.acc/_fir.D;
+          _fir.acc= 0.0;
+          _fir.cnt= 0;
+        }
+    }
+  
+  /* Filtra. */
+  while ( (ip= (int) _fir.pos) + FIR_TAPS <= n )
+    {
+      output_sample ( dot ( &(hist[ip]),
+        		    _fir.kernel[(int) ((_fir.pos-ip)*FIR_PHASES)] ) );
+      _fir.pos+= _fir.step;
+    }
+  
+  /* Descarta el que ja no es necessita. */
+  ip= (int) _fir.pos;
+  if ( ip > n ) ip= n;
+  memmove ( hist, &(hist[ip]), sizeof(double)*(n-ip) );
+  _fir.nhist= n-ip;
+  _fir.pos-= ip;
+  fir_next_frame ();
+  
+} /* end fir_end_frame */
 
 
-void
-NES_apu_reset (void)
+/* Aplica '_ratio' a la síntesi. */
+static void
+update_ratio (void)
 {
   
-  _nsamples= 0;
-  fseq_reset ();
-  sq_reset ( &_sq1 );
-  sq_reset ( &_sq2 );
-  trg_reset ();
-  noise_reset ();
-  dmc_reset ();
+  double rate;
   
-} /* NES_apu_reset */
+  
+  if ( _blip.rate == 0 || _blip.ccpersec == 0 ) return;
+  rate= _blip.rate*_ratio;
+  _blip.factor= (NESu64) (rate*(((NESu64) 1)<<BLIP_FRAC)/_blip.ccpersec + 0.5);
+  _fir.step= _blip.ccpersec/(_fir.D*rate);
+  
+} /* end update_ratio */
 
 
-void
-NES_apu_pulse1CR (
+/* Afegeix N mostres amb valor SAMPLE. */
+static void
+put_samples (
+             const double sample,
+             const int    n
+             )
+{
+  
+  double *p, *end;
+  
+  
+  if ( _blip.rate && !_fir.enabled )
+    {
+      if ( sample != _blip.last ) blip_add ( _nsamples, sample );
+    }
+  else
+    {
+      p= &(_frame[_nsamples]);
+      for ( end= p+n; p != end; ++p )
+        *p= sample;
+    }
+  _nsamples+= n;
+  
+} /* end put_samples */
+
+
+static double
+calc_sample (void)
+{
+  
+  int sq1_out, sq2_out, trg_out, noise_out, dmc_out;
+  
+  
+  sq1_out= calc_sq_out ( &_sq1 );
+  sq2_out= calc_sq_out ( &_sq2 );
+  trg_out= CALC_TRG_OUT;
+  noise_out= calc_noise_out ();
+  dmc_out= _dmc.counter_dac;
+  
+  return
+    _square_out[sq1_out+sq2_out] +
+    _tnd_out[3*trg_out+(noise_out<<1)+dmc_out];
+  
+} /* end calc_sample */
+
+
+/* Passa al consumidor el que s'ha apuntat dels canals. */
+static void
+stems_flush (void)
+{
+  
+  NES_APUStems stems;
+  int i;
+  
+  
+  stems.nsamples= 0;
+  stems.nevents= 0;
+  stems.events= _stems.events;
+  for ( i= 0; i < NES_APU_NCHANNELS; ++i )
+    stems.levels[i]= _stems.levels[i];
+  if ( _stems.mode == NES_APU_STEMS_LEVELS ) stems.nsamples= _stems.n;
+  else stems.nevents= _stems.n;
+  _stems.n= 0;
+  _stems.play_stems ( &stems, _udata );
+  
+} /* end stems_flush */
+
+
+/* Executa un cicle del 'frame sequencer' i dels canals, sense tocar
+   les mostres. CC són els cicles que resten, i igual que en
+   'NES_apu_clock' s'incrementa junt amb *TOTAL si hi ha DMA. */
+static NES_Bool
+clock_channels (
+        	unsigned int *total,
+        	unsigned int *CC
+        	)
+{
+  
+  NES_Bool ret;
+  
+  
+  ret= NES_FALSE;
+  if ( ++_fseq.cc == _fseq.ccperframe )
+    ret|= clock_frame ();
+  
+  /* Clock els canals. */
+  clock_sq_timer ( &_sq1 );
+  clock_sq_timer ( &_sq2 );
+  clock_trg_timer ();
+  clock_noise_timer ();
+  if ( clock_dmc_timer () )
+    {
+      /* En la còpia del fil, i quan es reprodueix un registre, els
+         cicles de DMA ja estan comptats en les marques de temps. */
+#ifndef NES_APU_ASYNC_CORE
+      if ( _replay == NULL )
+        {
+          (*total)+= 4;
+          (*CC)+= 4;
+        }
+#endif
+    }
+  ret|= _dmc.iflag;
+  --(*CC);
+  
+  return ret;
+  
+} /* end clock_channels */
+
+
+/* Executa un cicle després de generar la mostra. */
+static NES_Bool
+clock_cycle_end (
+        	 unsigned int *total,
+        	 unsigned int *CC
+        	 )
+{
+  
+  if ( _nsamples == _frame_size )
+    {
+      _nsamples= 0;
+      if ( !_blip.rate ) _play_frame ( _frame, _udata );
+      else if ( _fir.enabled ) fir_end_frame ();
+      else blip_end_frame ();
+      if ( _stems.mode != NES_APU_STEMS_OFF ) stems_flush ();
+    }
+  
+  return clock_channels ( total, CC );
+  
+} /* end clock_cycle_end */
+
+
+static NES_Bool
+clock_cycle (
+             unsigned int *total,
+             unsigned int *CC
+             )
+{
+  
+  /* Calcula valor instant 't'. */
+  put_samples ( calc_sample (), 1 );
+  
+  return clock_cycle_end ( total, CC );
+  
+} /* end clock_cycle */
+
+
+/* Eixida actual de cada canal. */
+static void
+calc_levels (
+             int levels[NES_APU_NCHANNELS]
+             )
+{
+  
+  levels[NES_APU_SQ1]= calc_sq_out ( &_sq1 );
+  levels[NES_APU_SQ2]= calc_sq_out ( &_sq2 );
+  levels[NES_APU_TRG]= CALC_TRG_OUT;
+  levels[NES_APU_NOISE]= calc_noise_out ();
+  levels[NES_APU_DMC]= _dmc.counter_dac;
+  
+} /* end calc_levels */
+
+
+/* Com 'clock_cycles' però apunta l'eixida de cada canal. Sols
+   s'utilitza quan estan activades les pistes separades, així els
+   altres motors no paguen res. */
+static NES_Bool
+clock_stems (
+             unsigned int *cc
+             )
+{
+  
+  unsigned int CC;
+  NES_Bool ret;
+  int levels[NES_APU_NCHANNELS];
+  NES_APUStemEvent *e;
+  int i;
+  
+  
+  ret= NES_FALSE;
+  CC= *cc;
+  while ( CC )
+    {
+      calc_levels ( levels );
+      if ( _stems.mode == NES_APU_STEMS_LEVELS )
+        {
+          for ( i= 0; i < NES_APU_NCHANNELS; ++i )
+            _stems.levels[i][_stems.n]= (NESu8) levels[i];
+          ++_stems.n;
+        }
+      else
+        {
+          for ( i= 0; i < NES_APU_NCHANNELS; ++i )
+            if ( levels[i] != _stems.last[i] )
+              {
+                e= &(_stems.events[_stems.n++]);
+                e->cc= _stems.cc;
+                e->channel= (NESu8) i;
+                e->level= (NESu8) levels[i];
+                _stems.last[i]= levels[i];
+              }
+          if ( _stems.n > NES_APU_STEMS_EVENTS_SIZE-NES_APU_NCHANNELS )
+            stems_flush ();
+        }
+      ++_stems.cc;
+      put_samples ( _square_out[levels[NES_APU_SQ1]+levels[NES_APU_SQ2]] +
+        	    _tnd_out[3*levels[NES_APU_TRG]+
+        		     (levels[NES_APU_NOISE]<<1)+
+        		     levels[NES_APU_DMC]], 1 );
+      ret|= clock_cycle_end ( cc, &CC );
+    }
+  
+  return ret;
+  
+} /* end clock_stems */
+
+
+static NES_Bool
+clock_cycles (
+              unsigned int *cc
+              )
+{
+  
+  unsigned int CC;
+  NES_Bool ret;
+  
+  
+  ret= NES_FALSE;
+  CC= *cc;
+  while ( CC )
+    ret|= clock_cycle ( cc, &CC );
+  
+  return ret;
+  
+} /* end clock_cycles */
+
+
+/* Els canals que no se senten poden avançar el temporitzador sense
+   que canvie l'eixida. El volum, la longitud i el periode sols
+   canvien en els clocks del 'frame sequencer' o en les escriptures,
+   per tant no canvien dins d'un bloc. */
+#define SQ_AUDIBLE(SQ)        					\
+  ((SQ).length.count != 0 && (SQ).period >= 8 &&        	\
+   ((SQ).sweep.result <= 0x7FF || (SQ).sweep.negated) &&        \
+   EG_GET_VOL ( (SQ).envelope ) != 0)
+
+#define TRG_AUDIBLE                                             \
+  (_trg.period >= 2 && _trg.length.count != 0 &&                \
+   _trg.linearctr.counter != 0)
+
+#define NOISE_AUDIBLE                                                   \
+  (_noise.length.count != 0 && EG_GET_VOL ( _noise.envelope ) != 0)
+
+
+/* Número de vegades que un temporitzador amb valor TIMER i que es
+   recarrega amb PERIOD arriba a 0 en N cicles. Actualitza TIMER. */
+static int
+advance_timer (
+               int       *timer,
+               const int  period,
+               const int  n
+               )
+{
+  
+  int rest, ret;
+  
+  
+  if ( n < *timer ) { *timer-= n; return 0; }
+  rest= n-*timer;
+  ret= 1 + rest/period;
+  *timer= period - rest%period;
+  
+  return ret;
+  
+} /* end advance_timer */
+
+
+static void
+sq_advance (
+            SquareChannel *sq,
+            const int      n
+            )
+{
+  
+  int e;
+  
+  
+  e= advance_timer ( &(sq->timer), sq->period+1, n );
+  if ( e == 0 ) return;
+  sq->step= (sq->step + ((e+sq->divider2)>>1))&0x7;
+  sq->divider2^= e&0x1;
+  
+} /* end sq_advance */
+
+
+static void
+trg_advance (
+             const int n
+             )
+{
+  
+  int e;
+  
+  
+  e= advance_timer ( &_trg.timer, _trg.period+1, n );
+  if ( _trg.length.count != 0 && _trg.linearctr.counter != 0 )
+    _trg.step= (_trg.step+e)&0x1F;
+  
+} /* end trg_advance */
+
+
+static void
+noise_advance (
+               const int n
+               )
+{
+  
+  int e, aux;
+  
+  
+  e= advance_timer ( &_noise.timer, _noise.periods[_noise.index], n );
+  for ( ; e > 0; --e )
+    {
+      if ( _noise.mode0 )
+        aux= (_noise.shiftr^(_noise.shiftr>>1))&0x1;
+      else
+        aux= (_noise.shiftr^(_noise.shiftr>>6))&0x1;
+      _noise.shiftr>>= 1;
+      _noise.shiftr|= (aux<<14);
+    }
+  
+} /* end noise_advance */
+
+
+/* Cicles fins al següent event, comptant el cicle en el que es
+   produeix. Un event és qualsevol cosa que pot canviar l'eixida: que
+   el temporitzador d'un canal que se sent arribe a 0, un clock del
+   'frame sequencer' o que s'ompli el buffer. El temporitzador del DMC
+   sempre és un event. Pot tornar valors menors que 1 si l'estat és
+   estrany (per exemple després de carregar un estat). */
+static int
+cycles_to_event (
+        	 const unsigned int CC
+        	 )
+{
+  
+  int n;
+  
+  
+  n= CC > NES_APU_BUFFER_SIZE ? NES_APU_BUFFER_SIZE : (int) CC;
+  if ( _sq1.timer < n && SQ_AUDIBLE ( _sq1 ) ) n= _sq1.timer;
+  if ( _sq2.timer < n && SQ_AUDIBLE ( _sq2 ) ) n= _sq2.timer;
+  if ( _trg.timer < n && TRG_AUDIBLE ) n= _trg.timer;
+  if ( _noise.timer < n && NOISE_AUDIBLE ) n= _noise.timer;
+  if ( _dmc.timer < n ) n= _dmc.timer;
+  if ( _fseq.ccperframe-_fseq.cc < n ) n= _fseq.ccperframe-_fseq.cc;
+  if ( (int) (_frame_size-_nsamples) < n )
+    n= _frame_size-_nsamples;
+  
+  return n;
+  
+} /* end cycles_to_event */
+
+
+/* Igual que 'clock_cycles' però els cicles anteriors a cada event,
+   en els que l'eixida no canvia, s'ompli de colp i els canals que no
+   se senten avancen sense generar mostres. El cicle de
+   l'event s'executa amb 'clock_cycle', per tant el resultat és
+   idèntic. */
+static NES_Bool
+clock_events (
+              unsigned int *cc
+              )
+{
+  
+  unsigned int CC;
+  NES_Bool ret;
+  int n;
+  
+  
+  ret= NES_FALSE;
+  CC= *cc;
+  while ( CC )
+    {
+      n= cycles_to_event ( CC ) - 1;
+      if ( n > 0 )
+        {
+          put_samples ( calc_sample (), n );
+          _fseq.cc+= n;
+          sq_advance ( &_sq1, n );
+          sq_advance ( &_sq2, n );
+          trg_advance ( n );
+          noise_advance ( n );
+          _dmc.timer-= n;
+          ret|= _dmc.iflag;
+          CC-= n;
+        }
+      ret|= clock_cycle ( cc, &CC );
+    }
+  
+  return ret;
+  
+} /* end clock_events */
+
+
+/* Com 'clock_events' però sense generar mostres. Sols són events el
+   'frame sequencer' i el temporitzador del DMC, que són els que pot
+   observar el programa (comptadors de longitud, IRQ i DMA). Els
+   altres temporitzadors s'avancen igual perquè l'estat siga el
+   mateix que amb sò. */
+static NES_Bool
+clock_silent (
+              unsigned int *cc
+              )
+{
+  
+  unsigned int CC;
+  NES_Bool ret;
+  int n;
+  
+  
+  ret= NES_FALSE;
+  CC= *cc;
+  while ( CC )
+    {
+      n= CC > NES_APU_BUFFER_SIZE ? NES_APU_BUFFER_SIZE : (int) CC;
+      if ( _dmc.timer < n ) n= _dmc.timer;
+      if ( _fseq.ccperframe-_fseq.cc < n ) n= _fseq.ccperframe-_fseq.cc;
+      if ( --n > 0 )
+        {
+          _fseq.cc+= n;
+          sq_advance ( &_sq1, n );
+          sq_advance ( &_sq2, n );
+          trg_advance ( n );
+          noise_advance ( n );
+          _dmc.timer-= n;
+          ret|= _dmc.iflag;
+          CC-= n;
+        }
+      ret|= clock_channels ( cc, &CC );
+    }
+  
+  return ret;
+  
+} /* end clock_silent */
+
+
+
+/**********************/
+/* FUNCIONS PÚBLIQUES */
+/**********************/
+
+NES_Bool
+NES_apu_clock (
+               unsigned int *cc
+               )
+{
+  
+  NES_Bool ret;
+  
+  
+#ifndef NES_APU_ASYNC_CORE
+  if ( _async )
+    {
+      ret= clock_silent ( cc );
+      NES_apu_async_clock ( *cc );
+      LOG_CLOCK ( *cc );
+      return ret;
+    }
+#endif
+  if ( _silent ) ret= clock_silent ( cc );
+  else if ( _stems.mode != NES_APU_STEMS_OFF ) ret= clock_stems ( cc );
+  else if ( _engine == NES_APU_EVENT ) ret= clock_events ( cc );
+  else ret= clock_cycles ( cc );
+  LOG_CLOCK ( *cc );
+  
+  return ret;
+  
+} /* end NES_apu_clock */
+
+
+void
+NES_apu_conf_fseq (
+        	   NESu8 data
+        	   )
+{
+  
+  LOG_WRITE ( 0x4017, data );
+  _fseq.step= 0;
+  _fseq.clock= data&0x80 ?
+    fseq_clock_mode1 : fseq_clock_mode0;
+  _fseq.irq= data&0x40 ? NES_FALSE : NES_TRUE;
+  
+} /* end NES_apu_conf_fseq */
+
+
+void
+NES_apu_control (
+        	 NESu8 data
+        	 )
+{
+  
+  LOG_WRITE ( 0x4015, data );
+  if ( data&0x10 )
+    {
+      if ( _dmc.dma.remain == 0 )
+        {
+          DMC_RESTART;
+          if ( _dmc.buffer.empty )
+            {
+              dmc_dma_read ();
+              NES_dma_extra_cc+= 4;
+            }
+        }
+    }
+  else _dmc.dma.remain= 0;
+  if ( (data&0x08) == 0 ) _noise.length.count= 0;
+  if ( (data&0x04) == 0 ) _trg.length.count= 0;
+  if ( (data&0x02) == 0 ) _sq2.length.count= 0;
+  if ( (data&0x01) == 0 ) _sq1.length.count= 0;
+  
+} /* NES_apu_control */
+
+
+NESu8
+NES_apu_CSR (void)
+{
+  
+  NESu8 ret;
+  
+  
+  ret= 0x00;
+  if ( _dmc.iflag ) ret|= 0x80;
+  if ( _fseq.iflag ) ret|= 0x40;
+  if ( _dmc.dma.remain > 0 ) ret|= 0x10;
+  if ( _noise.length.count > 0 ) ret|= 0x08;
+  if ( _trg.length.count > 0 ) ret|= 0x04;
+  if ( _sq2.length.count > 0 ) ret|= 0x02;
+  if ( _sq1.length.count > 0 ) ret|= 0x01;
+  _fseq.iflag= NES_FALSE;
+  
+  return ret;
+  
+} /* NES_apu_CSR */
+
+
+void
+NES_apu_init (
+              const NES_TVMode  tvmode,
+              NES_PlayFrame    *play_frame,
+              void             *udata
+              )
+{
+  
+  ASYNC ( _async= NES_FALSE );
+  ASYNC ( _logging= NES_apu_log_init ( tvmode ) );
+  
+  /* Valors estimats empiracament per gent en foros. La idea és que
+     PAL~50Hz i NTSC~60Hz. */
+  _fseq.ccperframe= tvmode==NES_PAL ? 8313 : 7458;
+  _dmc.periods= &(_dmc_periods[tvmode][0]);
+  _noise.periods= &(_noise_periods[tvmode][0]);
+  _blip.ccpersec= tvmode==NES_PAL ?
+    NES_CPU_PAL_CYCLES_PER_SEC : NES_CPU_NTSC_CYCLES_PER_SEC;
+  NES_apu_configure ( _blip.rate, _blip.format, _blip.chunk,
+        	     _blip.buffer, _blip.play_chunk );
+  
+  _play_frame= play_frame;
+  _udata= udata;
+  
+  NES_apu_init_state ();
+  ASYNC ( _async= NES_apu_async_init ( tvmode, play_frame, udata ) );
+  
+} /* end NES_apu_init */
+
+
+void
+NES_apu_set_silent (
+        	    const NES_Bool val
+        	    )
+{
+  
+  _silent= val;
+  ASYNC ( NES_apu_async_set_silent ( val ) );
+  
+} /* end NES_apu_set_silent */
+
+
+#ifndef NES_APU_ASYNC_CORE
+void
+NES_apu_set_async (
+        	   const NES_Bool val
+        	   )
+{
+  
+  NES_apu_async_enable ( val );
+  if ( !val && _async )
+    {
+      NES_apu_async_stop ();
+      _async= NES_FALSE;
+    }
+  
+} /* end NES_apu_set_async */
+
+
+int
+NES_apu_set_log (
+        	 FILE *f
+        	 )
+{
+  
+  int ret;
+  
+  
+  ret= NES_apu_log_enable ( f );
+  if ( f == NULL ) _logging= NES_FALSE;
+  
+  return ret;
+  
+} /* end NES_apu_set_log */
+
+
+void
+NES_apu_set_replay (
+        	    NES_APUReplayRead *read
+        	    )
+{
+  _replay= read;
+} /* end NES_apu_set_replay */
+#endif
+
+
+void
+NES_apu_set_engine (
+        	    const NES_APUEngine engine
+        	    )
+{
+  
+  _engine= engine;
+  ASYNC ( NES_apu_async_set_engine ( engine ) );
+  
+} /* end NES_apu_set_engine */
+
+
+int
+NES_apu_configure (
+        	   const int            rate,
+        	   const NES_APUFormat  format,
+        	   const int            chunk,
+        	   void                *buffer,
+        	   NES_PlayChunk       *play_chunk
+        	   )
+{
+  
+  if ( rate != 0 )
+    {
+      if ( rate < NES_APU_MIN_RATE || rate > NES_APU_MAX_RATE ) return -1;
+      if ( play_chunk != NULL &&
+           (chunk < NES_APU_MIN_CHUNK || buffer == NULL ||
+            format < NES_APU_S16 || format > NES_APU_F32_STEREO) )
+        return -1;
+      if ( _blip.kernel[0][BLIP_TAPS/2] == 0.0 ) blip_init_kernel ();
+    }
+  _blip.rate= rate;
+  _blip.format= format;
+  _blip.play_chunk= play_chunk;
+  _blip.buffer= buffer;
+  _blip.chunk= play_chunk != NULL ? chunk : NES_APU_RATE_CHUNK;
+  if ( _blip.ccpersec != 0 && rate != 0 )
+    {
+      fir_init ();
+      update_ratio ();
+      /* Tall d'uns 37Hz, 1-2*pi*fc/rate és prou aproximació. */
+      _blip.hp_a= 1.0 - 2.0*M_PI*37.0/rate;
+    }
+  blip_reset ();
+  ASYNC ( NES_apu_async_configure ( rate, format, chunk,
+        			    buffer, play_chunk ) );
+  
+  return 0;
+  
+} /* end NES_apu_configure */
+
+
+int
+NES_apu_set_rate (
+        	  const int rate
+        	  )
+{
+  return NES_apu_configure ( rate, NES_APU_F32, 0, NULL, NULL );
+} /* end NES_apu_set_rate */
+
+
+int
+NES_apu_set_ratio (
+        	   const double ratio
+        	   )
+{
+  
+  if ( ratio < NES_APU_MIN_RATIO || ratio > NES_APU_MAX_RATIO ) return -1;
+  _ratio= ratio;
+  update_ratio ();
+  ASYNC ( NES_apu_async_set_ratio ( ratio ) );
+  
+  return 0;
+  
+} /* end NES_apu_set_ratio */
+
+
+double
+NES_apu_get_ratio (void)
+{
+  return _ratio;
+} /* end NES_apu_get_ratio */
+
+
+void
+NES_apu_set_stems (
+        	   const NES_APUStemsMode  mode,
+        	   NES_PlayStems          *play_stems
+        	   )
+{
+  
+  int i;
+  int levels[NES_APU_NCHANNELS];
+  
+  
+  _stems.mode= play_stems != NULL ? mode : NES_APU_STEMS_OFF;
+  _stems.play_stems= play_stems;
+  _stems.cc= 0;
+  _stems.n= 0;
+  for ( i= 0; i < NES_APU_NCHANNELS; ++i )
+    _stems.last[i]= -1;
+  
+  /* Perquè 'levels' continue alineat amb les mostres del frame, les
+     que ja s'han generat s'apunten amb el nivell actual. */
+  if ( _stems.mode == NES_APU_STEMS_LEVELS )
+    {
+      calc_levels ( levels );
+      for ( i= 0; i < NES_APU_NCHANNELS; ++i )
+        memset ( _stems.levels[i], levels[i], _nsamples );
+      _stems.n= _nsamples;
+    }
+  ASYNC ( NES_apu_async_set_stems ( mode, play_stems ) );
+  
+} /* end NES_apu_set_stems */
+
+
+void
+NES_apu_set_resampler (
+        	       const NES_Bool val
+        	       )
+{
+  
+  _fir.enabled= val;
+  blip_reset ();
+  ASYNC ( NES_apu_async_set_resampler ( val ) );
+  
+} /* end NES_apu_set_resampler */
+
+
+void
+NES_apu_init_state (void)
+{
+
+  int i;
+  
+  
+  for ( i= 0; i < NES_APU_BUFFER_SIZE; ++i )
+    _frame[i]= 0.0;
+  NES_apu_reset ();
+  ASYNC ( if ( _async ) NES_apu_async_init_state () );
+  
+} /* end NES_apu_init_state */
+
+
+void
+NES_apu_reset (void)
+{
+  
+  LOG_WRITE ( NES_APU_ASYNC_RESET, 0 );
+  blip_reset ();
+  fseq_reset ();
+  sq_reset ( &_sq1 );
+  sq_reset ( &_sq2 );
+  trg_reset ();
+  noise_reset ();
+  dmc_reset ();
+  
+} /* NES_apu_reset */
+
+
+void
+NES_apu_pulse1CR (
         	  NESu8 data
         	  )
 {
+  
+  LOG_WRITE ( 0x4000, data );
   pulseCR ( &_sq1, data );
+  
 } /* end NES_apu_pulse1CR */
 
 
@@ -1083,7 +2414,10 @@ NES_apu_pulse1RCR (
         	   NESu8 data
         	   )
 {
+  
+  LOG_WRITE ( 0x4001, data );
   pulseRCR ( &_sq1, data );
+  
 } /* end NES_apu_pulse1RCR */
 
 
@@ -1094,7 +2428,10 @@ NES_apu_pulse1FTR (
         	   NESu8 data
         	   )
 {
+  
+  LOG_WRITE ( 0x4002, data );
   pulseFTR ( &_sq1, data );
+  
 } /* end NES_apu_pulse1FTR */
 
 
@@ -1103,7 +2440,10 @@ NES_apu_pulse1CTR (
         	   NESu8 data
         	   )
 {
+  
+  LOG_WRITE ( 0x4003, data );
   pulseCTR ( &_sq1, data );
+  
 } /* end NES_apu_pulse1CTR */
 
 
@@ -1112,7 +2452,10 @@ NES_apu_pulse2CR (
         	  NESu8 data
         	  )
 {
+  
+  LOG_WRITE ( 0x4004, data );
   pulseCR ( &_sq2, data );
+  
 } /* end NES_apu_pulse2CR */
 
 
@@ -1121,7 +2464,10 @@ NES_apu_pulse2RCR (
         	   NESu8 data
         	   )
 {
+  
+  LOG_WRITE ( 0x4005, data );
   pulseRCR ( &_sq2, data );
+  
 } /* end NES_apu_pulse2RCR */
 
 
@@ -1130,7 +2476,10 @@ NES_apu_pulse2FTR (
         	   NESu8 data
         	   )
 {
+  
+  LOG_WRITE ( 0x4006, data );
   pulseFTR ( &_sq2, data );
+  
 } /* end NES_apu_pulse2FTR */
 
 
@@ -1139,7 +2488,10 @@ NES_apu_pulse2CTR (
         	   NESu8 data
         	   )
 {
+  
+  LOG_WRITE ( 0x4007, data );
   pulseCTR ( &_sq2, data );
+  
 } /* end NES_apu_pulse2CTR */
 
 
@@ -1152,6 +2504,7 @@ NES_apu_triangleCR1 (
   NESu8 cflag;
   
   
+  LOG_WRITE ( 0x4008, data );
   cflag= (data&0x80);
   _trg.linearctr.rvalue= data&0x7F;
   _trg.linearctr.controlf= (cflag!=0);
@@ -1166,6 +2519,7 @@ NES_apu_triangleFR1 (
         	     )
 {
   
+  LOG_WRITE ( 0x400A, data );
   _trg.period&= 0x700;
   _trg.period|= data;
   /*_trg.timer= _trg.period+1;*/
@@ -1179,6 +2533,7 @@ NES_apu_triangleFR2 (
         	     )
 {
   
+  LOG_WRITE ( 0x400B, data );
   LC_UPDATE_INDEX ( _trg.length, data>>3 );
   _trg.period&= 0xFF;
   _trg.period|= ((int) (data&0x7))<<8;
@@ -1197,6 +2552,7 @@ NES_apu_noiseCR (
   NESu8 cflag;
   
   
+  LOG_WRITE ( 0x400C, data );
   cflag= (data&0x20);
   envelope_conf ( &(_noise.envelope), cflag!=0,
         	  (data&0x10)!=0, data&0xF );
@@ -1211,6 +2567,7 @@ NES_apu_noiseFR1 (
         	  )
 {
   
+  LOG_WRITE ( 0x400E, data );
   _noise.index= data&0xF;
   _noise.mode0= ((data&0x80)==0);
   /*_noise.timer= _noise.periods[_noise.index];*/
@@ -1223,7 +2580,10 @@ NES_apu_noiseFR2 (
         	  NESu8 data
         	  )
 {
+  
+  LOG_WRITE ( 0x400F, data );
   LC_UPDATE_INDEX ( _noise.length, data>>3 );
+  
 } /* end NES_apu_noiseFR2 */
 
 
@@ -1233,6 +2593,7 @@ NES_apu_dmCR (
               )
 {
   
+  LOG_WRITE ( 0x4010, data );
   _dmc.ienabled= ((data&0x80)!=0);
   if ( !_dmc.ienabled ) _dmc.iflag= NES_FALSE;
   _dmc.dma.loop= ((data&0x40)!=0);
@@ -1247,7 +2608,10 @@ NES_apu_dmDAR (
                NESu8 data
                )
 {
+  
+  LOG_WRITE ( 0x4011, data );
   _dmc.counter_dac= data&0x7F;
+  
 } /* NES_apu_dmDAR */
 
 
@@ -1256,7 +2620,10 @@ NES_apu_dmAR (
               NESu8 data
               )
 {
+  
+  LOG_WRITE ( 0x4012, data );
   _dmc.dma.init_addr= data;
+  
 } /* end NES_apu_dmAR */
 
 
@@ -1265,7 +2632,10 @@ NES_apu_dmLR (
               NESu8 data
               )
 {
+  
+  LOG_WRITE ( 0x4013, data );
   _dmc.dma.length= data;
+  
 } /* end NES_apu_dmLR */
 
 
@@ -1280,6 +2650,7 @@ NES_apu_save_state (
   size_t ret;
   
   
+  ASYNC ( if ( _async ) return NES_apu_async_save_state ( f ) );
   SAVE ( _frame );
   SAVE ( _nsamples );
   
@@ -1325,10 +2696,15 @@ NES_apu_load_state (
         	    FILE *f
         	    )
 {
-
+  
+  /* No es pot carregar un estat mentre es registra la música. */
+  ASYNC ( CHECK ( !_logging ) );
+  ASYNC ( if ( _async && NES_apu_async_load_state ( f ) != 0 ) return -1 );
   LOAD ( _frame );
   LOAD ( _nsamples );
   CHECK ( _nsamples >= 0 && _nsamples < NES_APU_BUFFER_SIZE );
+  if ( _blip.rate ) blip_reset ();
+  else _frame_size= NES_APU_BUFFER_SIZE;
   LOAD ( _fseq );
   _fseq.clock= ((int64_t) _fseq.clock) ? fseq_clock_mode1 : fseq_clock_mode0;
   LOAD ( _sq1 );
@@ -0,0 +1,605 @@
+/*
+ * Copyright 2022 Adrià Giménez Pastor.
+ *
+ * This file is part of adriagipas/NES.
+ *
+ * adriagipas/NES is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * adriagipas/NES is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with adriagipas/NES.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ *  apu_async.c - Síntesi del sò en un fil a part. Compila una segona
+ *                còpia de 'apu.c' amb tots els noms públics canviats,
+ *                que és la que genera el sò a partir de les
+ *                escriptures que apunta la primera.
+ *
+ *  NOTA: Les marques de temps són cicles de l'APU des de
+ *  'NES_apu_async_init', incloent els cicles extra del DMA del
+ *  DMC. Per això la còpia no els torna a afegir. Una escriptura amb
+ *  marca T sols es processa quan el fil de la simulació ha publicat
+ *  un cicle major que T, així els bytes del DMC que haja pogut llegir
+ *  ja estan en la cua.
+ *
+ */
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+
+/* Còpia de l'APU. */
+#define NES_APU_ASYNC_CORE
+#define NES_apu_clock NES_apu_core_clock
+#define NES_apu_conf_fseq NES_apu_core_conf_fseq
+#define NES_apu_control NES_apu_core_control
+#define NES_apu_CSR NES_apu_core_CSR
+#define NES_apu_init NES_apu_core_init
+#define NES_apu_init_state NES_apu_core_init_state
+#define NES_apu_set_rate NES_apu_core_set_rate
+#define NES_apu_configure NES_apu_core_configure
+#define NES_apu_set_ratio NES_apu_core_set_ratio
+#define NES_apu_get_ratio NES_apu_core_get_ratio
+#define NES_apu_set_resampler NES_apu_core_set_resampler
+#define NES_apu_set_stems NES_apu_core_set_stems
+#define NES_apu_set_silent NES_apu_core_set_silent
+#define NES_apu_set_engine NES_apu_core_set_engine
+#define NES_apu_reset NES_apu_core_reset
+#define NES_apu_pulse1CR NES_apu_core_pulse1CR
+#define NES_apu_pulse1RCR NES_apu_core_pulse1RCR
+#define NES_apu_pulse1FTR NES_apu_core_pulse1FTR
+#define NES_apu_pulse1CTR NES_apu_core_pulse1CTR
+#define NES_apu_pulse2CR NES_apu_core_pulse2CR
+#define NES_apu_pulse2RCR NES_apu_core_pulse2RCR
+#define NES_apu_pulse2FTR NES_apu_core_pulse2FTR
+#define NES_apu_pulse2CTR NES_apu_core_pulse2CTR
+#define NES_apu_triangleCR1 NES_apu_core_triangleCR1
+#define NES_apu_triangleFR1 NES_apu_core_triangleFR1
+#define NES_apu_triangleFR2 NES_apu_core_triangleFR2
+#define NES_apu_noiseCR NES_apu_core_noiseCR
+#define NES_apu_noiseFR1 NES_apu_core_noiseFR1
+#define NES_apu_noiseFR2 NES_apu_core_noiseFR2
+#define NES_apu_dmCR NES_apu_core_dmCR
+#define NES_apu_dmDAR NES_apu_core_dmDAR
+#define NES_apu_dmAR NES_apu_core_dmAR
+#define NES_apu_dmLR NES_apu_core_dmLR
+#define NES_apu_save_state NES_apu_core_save_state
+#define NES_apu_load_state NES_apu_core_load_state
+#define NES_mem_read NES_apu_core_dmc_read
+#define NES_dma_extra_cc NES_apu_core_dma_extra_cc
+
+#include "apu.c"
+
+
+
+
+/**********/
+/* MACROS */
+/**********/
+
+/* Grandària de les cues, han de ser potències de 2. */
+#define LOG_SIZE 0x4000
+#define DMC_LOG_SIZE 0x1000
+
+/* Cada quants cicles es desperta el fil com a molt. */
+#define WAKE_CC 4096
+
+/* Cicles màxims per crida a la còpia. */
+#define MAX_CLOCK 0x100000
+
+
+
+
+/*********/
+/* TIPUS */
+/*********/
+
+typedef struct
+{
+  
+  NESu64 cc;
+  NESu16 addr;
+  NESu8  data;
+  
+} LogEntry;
+
+
+
+
+/*********/
+/* ESTAT */
+/*********/
+
+/* Escriptures en els registres. 'in' sols l'escriu el fil de la
+ * simulació i 'out' sols el fil del sò.
+ */
+static struct
+{
+  
+  LogEntry v[LOG_SIZE];
+  unsigned in;
+  unsigned out __attribute__ ((aligned (64)));
+  
+} _log;
+
+
+/* Bytes llegits pel DMC. */
+static struct
+{
+  
+  NESu8    v[DMC_LOG_SIZE];
+  unsigned in;
+  unsigned out __attribute__ ((aligned (64)));
+  
+} _dmc_log;
+
+
+/* Fil. */
+static struct
+{
+  
+  NES_Bool  enabled;        /* 'NES_apu_async_enable'. */
+  NES_Bool  running;
+  NES_Bool  stop;
+  pthread_t thread;
+  sem_t     wake;
+  NESu64    cc;             /* Cicles del fil de la simulació. */
+  NESu64    clk;            /* Últim valor publicat de 'cc'. */
+  NESu64    last_wake;
+  NESu64    core_cc;        /* Cicles de la còpia. */
+  
+} _thread;
+
+
+/* El té el fil mentre processa, i el fil de la simulació per a
+   tocar la còpia. */
+static pthread_mutex_t _lock= PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Per a 'NES_apu_control' de la còpia, no s'utilitza. */
+int NES_apu_core_dma_extra_cc;
+
+
+
+
+/*********************/
+/* FUNCIONS PRIVADES */
+/*********************/
+
+/* La crida la còpia quan el DMC llig un byte. */
+NESu8
+NES_apu_core_dmc_read (
+        	       NESu16 addr
+        	       )
+{
+  
+  unsigned out;
+  NESu8 ret;
+  
+  
+  out= _dmc_log.out;
+  if ( out == __atomic_load_n ( &_dmc_log.in, __ATOMIC_ACQUIRE ) )
+    return 0x00;
+  ret= _dmc_log.v[out&(DMC_LOG_SIZE-1)];
+  __atomic_store_n ( &_dmc_log.out, out+1, __ATOMIC_RELEASE );
+  
+  return ret;
+  
+} /* end NES_apu_core_dmc_read */
+
+
+/* Buida les cues, el que s'ha processat ja està en la còpia. S'ha
+   de tindre '_lock'. */
+static void
+drain (void)
+{
+  
+  __atomic_store_n ( &_log.out,
+        	     __atomic_load_n ( &_log.in, __ATOMIC_ACQUIRE ),
+        	     __ATOMIC_RELEASE );
+  __atomic_store_n ( &_dmc_log.out,
+        	     __atomic_load_n ( &_dmc_log.in, __ATOMIC_ACQUIRE ),
+        	     __ATOMIC_RELEASE );
+  _thread.core_cc= _thread.cc;
+  
+} /* end drain */
+
+
+/* Espera a que el fil faça lloc en una cua. */
+static void
+wait_space (void)
+{
+  
+  sem_post ( &_thread.wake );
+  sched_yield ();
+  
+} /* end wait_space */
+
+
+/* Avança la còpia fins al cicle CC. */
+static void
+core_advance (
+              const NESu64 cc
+              )
+{
+  
+  unsigned int n, aux;
+  
+  
+  while ( _thread.core_cc < cc )
+    {
+      n= cc-_thread.core_cc > MAX_CLOCK ?
+        MAX_CLOCK : (unsigned int) (cc-_thread.core_cc);
+      aux= n;
+      NES_apu_core_clock ( &aux );
+      _thread.core_cc+= n;
+    }
+  
+} /* end core_advance */
+
+
+static void
+core_write (
+            const NESu16 addr,
+            const NESu8  data
+            )
+{
+  
+  switch ( addr )
+    {
+    case 0x4000: NES_apu_core_pulse1CR ( data ); break;
+    case 0x4001: NES_apu_core_pulse1RCR ( data ); break;
+    case 0x4002: NES_apu_core_pulse1FTR ( data ); break;
+    case 0x4003: NES_apu_core_pulse1CTR ( data ); break;
+    case 0x4004: NES_apu_core_pulse2CR ( data ); break;
+    case 0x4005: NES_apu_core_pulse2RCR ( data ); break;
+    case 0x4006: NES_apu_core_pulse2FTR ( data ); break;
+    case 0x4007: NES_apu_core_pulse2CTR ( data ); break;
+    case 0x4008: NES_apu_core_triangleCR1 ( data ); break;
+    case 0x400A: NES_apu_core_triangleFR1 ( data ); break;
+    case 0x400B: NES_apu_core_triangleFR2 ( data ); break;
+    case 0x400C: NES_apu_core_noiseCR ( data ); break;
+    case 0x400E: NES_apu_core_noiseFR1 ( data ); break;
+    case 0x400F: NES_apu_core_noiseFR2 ( data ); break;
+    case 0x4010: NES_apu_core_dmCR ( data ); break;
+    case 0x4011: NES_apu_core_dmDAR ( data ); break;
+    case 0x4012: NES_apu_core_dmAR ( data ); break;
+    case 0x4013: NES_apu_core_dmLR ( data ); break;
+    case 0x4015: NES_apu_core_control ( data ); break;
+    case 0x4017: NES_apu_core_conf_fseq ( data ); break;
+    case NES_APU_ASYNC_RESET: NES_apu_core_reset (); break;
+    default: break;
+    }
+  
+} /* end core_write */
+
+
+/* Processa tot el que ha publicat el fil de la simulació. Amb ALL
+   també les escriptures de l'últim cicle publicat, sols es pot fer
+   des del fil de la simulació. S'ha de tindre '_lock'. */
+static void
+render (
+        const NES_Bool all
+        )
+{
+  
+  NESu64 clk;
+  unsigned in, out;
+  const LogEntry *e;
+  
+  
+  clk= __atomic_load_n ( &_thread.clk, __ATOMIC_ACQUIRE );
+  in= __atomic_load_n ( &_log.in, __ATOMIC_ACQUIRE );
+  for ( out= _log.out; out != in; ++out )
+    {
+      e= &(_log.v[out&(LOG_SIZE-1)]);
+      if ( e->cc >= clk && !all ) break;
+      core_advance ( e->cc );
+      core_write ( e->addr, e->data );
+      __atomic_store_n ( &_log.out, out+1, __ATOMIC_RELEASE );
+    }
+  core_advance ( clk );
+  
+} /* end render */
+
+
+static void *
+thread_main (
+             void *arg
+             )
+{
+  
+  while ( !__atomic_load_n ( &_thread.stop, __ATOMIC_ACQUIRE ) )
+    {
+      sem_wait ( &_thread.wake );
+      pthread_mutex_lock ( &_lock );
+      render ( NES_FALSE );
+      pthread_mutex_unlock ( &_lock );
+    }
+  
+  return NULL;
+  
+} /* end thread_main */
+
+
+static void
+stop_thread (void)
+{
+  
+  if ( !_thread.running ) return;
+  __atomic_store_n ( &_thread.stop, NES_TRUE, __ATOMIC_RELEASE );
+  sem_post ( &_thread.wake );
+  pthread_join ( _thread.thread, NULL );
+  sem_destroy ( &_thread.wake );
+  _thread.running= NES_FALSE;
+  
+  /* El fil pot haver eixit sense processar l'últim que s'ha
+     publicat. */
+  pthread_mutex_lock ( &_lock );
+  render ( NES_TRUE );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end stop_thread */
+
+
+
+
+/**********************/
+/* FUNCIONS PÚBLIQUES */
+/**********************/
+
+void
+NES_apu_async_enable (
+        	      const NES_Bool val
+        	      )
+{
+  _thread.enabled= val;
+} /* end NES_apu_async_enable */
+
+
+void
+NES_apu_async_stop (void)
+{
+  stop_thread ();
+} /* end NES_apu_async_stop */
+
+
+NES_Bool
+NES_apu_async_init (
+        	    const NES_TVMode  tvmode,
+        	    NES_PlayFrame    *play_frame,
+        	    void             *udata
+        	    )
+{
+  
+  stop_thread ();
+  if ( !_thread.enabled ) return NES_FALSE;
+  
+  _log.in= _log.out= 0;
+  _dmc_log.in= _dmc_log.out= 0;
+  _thread.cc= _thread.clk= _thread.last_wake= _thread.core_cc= 0;
+  NES_apu_core_init ( tvmode, play_frame, udata );
+  
+  if ( sem_init ( &_thread.wake, 0, 0 ) != 0 ) return NES_FALSE;
+  _thread.stop= NES_FALSE;
+  if ( pthread_create ( &_thread.thread, NULL, thread_main, NULL ) != 0 )
+    {
+      sem_destroy ( &_thread.wake );
+      return NES_FALSE;
+    }
+  _thread.running= NES_TRUE;
+  
+  return NES_TRUE;
+  
+} /* end NES_apu_async_init */
+
+
+void
+NES_apu_async_init_state (void)
+{
+  
+  pthread_mutex_lock ( &_lock );
+  render ( NES_TRUE );
+  drain ();
+  NES_apu_core_init_state ();
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_init_state */
+
+
+/* Desa l'estat de la còpia, que és igual que el de l'APU principal
+   però amb les mostres. */
+int
+NES_apu_async_save_state (
+        		  FILE *f
+        		  )
+{
+  
+  int ret;
+  
+  
+  pthread_mutex_lock ( &_lock );
+  render ( NES_TRUE );
+  ret= NES_apu_core_save_state ( f );
+  pthread_mutex_unlock ( &_lock );
+  
+  return ret;
+  
+} /* end NES_apu_async_save_state */
+
+
+/* Carrega la còpia des de la posició actual i torna a deixar F en
+   eixa posició per a l'APU principal. */
+int
+NES_apu_async_load_state (
+        		  FILE *f
+        		  )
+{
+  
+  long pos;
+  int ret;
+  
+  
+  pos= ftell ( f );
+  if ( pos == -1 ) return -1;
+  pthread_mutex_lock ( &_lock );
+  render ( NES_TRUE );
+  drain ();
+  ret= NES_apu_core_load_state ( f );
+  pthread_mutex_unlock ( &_lock );
+  if ( ret != 0 || fseek ( f, pos, SEEK_SET ) != 0 ) return -1;
+  
+  return 0;
+  
+} /* end NES_apu_async_load_state */
+
+
+void
+NES_apu_async_clock (
+        	     const unsigned int cc
+        	     )
+{
+  
+  _thread.cc+= cc;
+  __atomic_store_n ( &_thread.clk, _thread.cc, __ATOMIC_RELEASE );
+  if ( _thread.cc-_thread.last_wake >= WAKE_CC )
+    {
+      _thread.last_wake= _thread.cc;
+      sem_post ( &_thread.wake );
+    }
+  
+} /* end NES_apu_async_clock */
+
+
+void
+NES_apu_async_write (
+        	     const NESu16 addr,
+        	     const NESu8  data
+        	     )
+{
+  
+  unsigned in;
+  LogEntry *e;
+  
+  
+  in= _log.in;
+  while ( in-__atomic_load_n ( &_log.out, __ATOMIC_ACQUIRE ) == LOG_SIZE )
+    wait_space ();
+  e= &(_log.v[in&(LOG_SIZE-1)]);
+  e->cc= _thread.cc;
+  e->addr= addr;
+  e->data= data;
+  __atomic_store_n ( &_log.in, in+1, __ATOMIC_RELEASE );
+  
+} /* end NES_apu_async_write */
+
+
+void
+NES_apu_async_dmc (
+        	   const NESu8 data
+        	   )
+{
+  
+  unsigned in;
+  
+  
+  in= _dmc_log.in;
+  while ( in-__atomic_load_n ( &_dmc_log.out, __ATOMIC_ACQUIRE ) ==
+          DMC_LOG_SIZE )
+    wait_space ();
+  _dmc_log.v[in&(DMC_LOG_SIZE-1)]= data;
+  __atomic_store_n ( &_dmc_log.in, in+1, __ATOMIC_RELEASE );
+  
+} /* end NES_apu_async_dmc */
+
+
+void
+NES_apu_async_configure (
+        		 const int            rate,
+        		 const NES_APUFormat  format,
+        		 const int            chunk,
+        		 void                *buffer,
+        		 NES_PlayChunk       *play_chunk
+        		 )
+{
+  
+  pthread_mutex_lock ( &_lock );
+  NES_apu_core_configure ( rate, format, chunk, buffer, play_chunk );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_configure */
+
+
+void
+NES_apu_async_set_ratio (
+        		 const double ratio
+        		 )
+{
+  
+  pthread_mutex_lock ( &_lock );
+  NES_apu_core_set_ratio ( ratio );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_set_ratio */
+
+
+void
+NES_apu_async_set_resampler (
+        		     const NES_Bool val
+        		     )
+{
+  
+  pthread_mutex_lock ( &_lock );
+  NES_apu_core_set_resampler ( val );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_set_resampler */
+
+
+void
+NES_apu_async_set_stems (
+        		 const NES_APUStemsMode  mode,
+        		 NES_PlayStems          *play_stems
+        		 )
+{
+  
+  pthread_mutex_lock ( &_lock );
+  NES_apu_core_set_stems ( mode, play_stems );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_set_stems */
+
+
+void
+NES_apu_async_set_silent (
+        		  const NES_Bool val
+        		  )
+{
+  
+  pthread_mutex_lock ( &_lock );
+  NES_apu_core_set_silent ( val );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_set_silent */
+
+
+void
+NES_apu_async_set_engine (
+        		  const NES_APUEngine engine
+        		  )
+{
+  
+  pthread_mutex_lock ( &_lock );
+  NES_apu_core_set_engine ( engine );
+  pthread_mutex_unlock ( &_lock );
+  
+} /* end NES_apu_async_set_engine */
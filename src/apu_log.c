@@ -0,0 +1,571 @@
+/*
+ * Copyright 2022 Adrià Giménez Pastor.
+ *
+ * This file is part of adriagipas/NES.
+ *
+ * adriagipas/NES is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * adriagipas/NES is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with adriagipas/NES.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ *  apu_log.c - Registre de la música a nivell de registres i
+ *              reproducció.
+ *
+ *  Format: una capçalera de 8 bytes ("NESAPU", versió i mode de
+ *  televisió) i una seqüència d'ordres d'un byte:
+ *
+ *    00-17 DD   Escriu DD en $4000+ordre.
+ *    18         'NES_apu_reset'.
+ *    19 N.. DD  Byte DD llegit pel DMC després de N lectures que no
+ *               s'apunten (N amb 7 bits per byte, el de menys pes
+ *               primer, i el bit 7 a 1 si en queden).
+ *    1A LL HH   Espera HHLL cicles.
+ *    1B 4 bytes Espera (32 bits, 'little endian').
+ *    1C         Final.
+ *    20-FF      Espera ordre-1F cicles.
+ *
+ *  Les escriptures en registres que sols es guarden ($4008, $400A,
+ *  $400E, $4012 i $4013) no s'apunten si repeteixen l'últim valor,
+ *  molts programes de música els escriuen tots en cada frame. $4002
+ *  i $4006 no, perquè el 'sweep' canvia el període que fixen.
+ *
+ *  Els bytes del DMC no tenen marca de temps, es consumeixen en ordre
+ *  quan el DMC els demana, i per això es poden llegir per davant de
+ *  les ordres (per exemple, $4015 llig un byte just després de
+ *  l'escriptura). Tant el registre com la reproducció recorden
+ *  l'últim byte de cada adreça, i sols s'apunten els que canvien
+ *  (la primera volta que sona una mostra, o si el 'mapper' canvia
+ *  de banc). Com l'APU de la reproducció llig les mateixes adreces
+ *  en el mateix ordre, la resta es trauen d'eixa memòria.
+ *
+ *  NOTA: Les esperes són cicles de l'APU, incloent els cicles extra
+ *  del DMA del DMC, i sols s'escriuen davant d'una escriptura.
+ *
+ */
+
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "NES.h"
+
+
+
+
+/**********/
+/* MACROS */
+/**********/
+
+#define VERSION 1
+#define HEADER_SIZE 8
+
+#define CMD_RESET 0x18
+#define CMD_DMC 0x19
+#define CMD_WAIT16 0x1A
+#define CMD_WAIT32 0x1B
+#define CMD_END 0x1C
+#define CMD_WAIT 0x20
+
+#define MAX_WAIT (0x100-CMD_WAIT)
+
+/* Adreces que pot llegir el DMC ($8000-$FFFF). */
+#define DMC_CACHE_SIZE 0x8000
+
+/* Cicles màxims per crida a 'NES_apu_clock'. */
+#define MAX_CLOCK 0x100000
+
+
+
+
+/*********/
+/* ESTAT */
+/*********/
+
+/* Registre. */
+static struct
+{
+  
+  FILE     *next;         /* Per a la següent 'NES_apu_log_init'. */
+  FILE     *f;            /* NULL si no s'està registrant. */
+  NES_Bool  error;
+  NESu64    cc;           /* Cicles des de l'inici. */
+  NESu64    last;         /* Cicle de l'última ordre. */
+  int       regs[0x18];   /* Últim valor, -1 si no es sap. */
+  NESs16    dmc[DMC_CACHE_SIZE]; /* Últim byte, -1 si no es sap. */
+  NESu32    hits;         /* Lectures del DMC sense apuntar. */
+  
+} _rec;
+
+
+/* Reproducció. */
+static struct
+{
+  
+  const NESu8 *data;
+  size_t       nbytes;
+  size_t       dmc;       /* On es busca el següent byte del DMC. */
+  NES_Bool     have;      /* S'ha trobat, sols falta llegir-lo. */
+  NESu32       hits;      /* Lectures de la memòria abans d'ell. */
+  NESu8        byte;
+  NESs16       cache[DMC_CACHE_SIZE];
+  
+} _play;
+
+
+
+
+/*********************/
+/* FUNCIONS PRIVADES */
+/*********************/
+
+static void
+put (
+     const int byte
+     )
+{
+  if ( fputc ( byte, _rec.f ) == EOF ) _rec.error= NES_TRUE;
+} /* end put */
+
+
+static void
+forget_regs (void)
+{
+  
+  int i;
+  
+  
+  for ( i= 0; i < 0x18; ++i )
+    _rec.regs[i]= -1;
+  
+} /* end forget_regs */
+
+
+static void
+clear_cache (
+             NESs16 cache[DMC_CACHE_SIZE]
+             )
+{
+  
+  int i;
+  
+  
+  for ( i= 0; i < DMC_CACHE_SIZE; ++i )
+    cache[i]= -1;
+  
+} /* end clear_cache */
+
+
+/* Cert si escriure DATA en el registre REG no canvia res. */
+static NES_Bool
+redundant_write (
+        	 const int   reg,
+        	 const NESu8 data
+        	 )
+{
+  
+  switch ( reg )
+    {
+    case 0x08: case 0x0A: case 0x0E: case 0x12: case 0x13:
+      if ( _rec.regs[reg] == data ) return NES_TRUE;
+      _rec.regs[reg]= data;
+      return NES_FALSE;
+    default: return NES_FALSE;
+    }
+  
+} /* end redundant_write */
+
+
+/* Escriu l'espera fins al cicle actual. */
+static void
+put_wait (void)
+{
+  
+  NESu64 n;
+  NESu32 aux;
+  
+  
+  for ( n= _rec.cc-_rec.last; n > 0; n-= aux )
+    {
+      if ( n <= MAX_WAIT )
+        {
+          aux= (NESu32) n;
+          put ( CMD_WAIT+aux-1 );
+        }
+      else if ( n <= 0xFFFF )
+        {
+          aux= (NESu32) n;
+          put ( CMD_WAIT16 );
+          put ( aux&0xFF );
+          put ( aux>>8 );
+        }
+      else
+        {
+          aux= n > 0xFFFFFFFF ? 0xFFFFFFFF : (NESu32) n;
+          put ( CMD_WAIT32 );
+          put ( aux&0xFF );
+          put ( (aux>>8)&0xFF );
+          put ( (aux>>16)&0xFF );
+          put ( aux>>24 );
+        }
+    }
+  _rec.last= _rec.cc;
+  
+} /* end put_wait */
+
+
+/* Acaba el registre actual. */
+static int
+close_log (void)
+{
+  
+  int ret;
+  
+  
+  if ( _rec.f == NULL ) return 0;
+  put_wait ();
+  put ( CMD_END );
+  if ( fflush ( _rec.f ) != 0 ) _rec.error= NES_TRUE;
+  ret= _rec.error ? -1 : 0;
+  _rec.f= NULL;
+  
+  return ret;
+  
+} /* end close_log */
+
+
+/* Llig el comptador que comença en POS. Torna els bytes que ocupa,
+   0 si està tallat o no cap en 32 bits. */
+static size_t
+read_count (
+            size_t  pos,
+            NESu32 *count
+            )
+{
+  
+  size_t n;
+  
+  
+  *count= 0;
+  for ( n= 0; n < 5 && pos < _play.nbytes; ++n, ++pos )
+    {
+      *count|= ((NESu32) (_play.data[pos]&0x7F))<<(7*n);
+      if ( (_play.data[pos]&0x80) == 0 ) return n+1;
+    }
+  
+  return 0;
+  
+} /* end read_count */
+
+
+/* Grandària de l'ordre que comença en POS, 0 si està tallada. */
+static size_t
+cmd_size (
+          const size_t pos
+          )
+{
+  
+  NESu8 cmd;
+  NESu32 aux;
+  size_t ret;
+  
+  
+  cmd= _play.data[pos];
+  if ( cmd < CMD_RESET ) ret= 2;
+  else if ( cmd == CMD_DMC )
+    {
+      ret= read_count ( pos+1, &aux );
+      if ( ret == 0 ) return 0;
+      ret+= 2;
+    }
+  else if ( cmd == CMD_WAIT16 ) ret= 3;
+  else if ( cmd == CMD_WAIT32 ) ret= 5;
+  else ret= 1;
+  
+  return pos+ret <= _play.nbytes ? ret : 0;
+  
+} /* end cmd_size */
+
+
+/* Busca el següent byte apuntat del DMC. */
+static void
+next_dmc (void)
+{
+  
+  size_t n;
+  
+  
+  for ( ; _play.dmc < _play.nbytes; _play.dmc+= n )
+    {
+      if ( (n= cmd_size ( _play.dmc )) == 0 ||
+           _play.data[_play.dmc] == CMD_END )
+        break;
+      if ( _play.data[_play.dmc] == CMD_DMC )
+        {
+          read_count ( _play.dmc+1, &_play.hits );
+          _play.byte= _play.data[_play.dmc+n-1];
+          _play.have= NES_TRUE;
+          _play.dmc+= n;
+          return;
+        }
+    }
+  _play.dmc= _play.nbytes;
+  
+} /* end next_dmc */
+
+
+/* El byte que llig el DMC en ADDR. Després de l'últim apuntat tot
+   ve de la memòria. */
+static NESu8
+replay_read (
+             const NESu16 addr
+             )
+{
+  
+  NESs16 *p;
+  
+  
+  p= &(_play.cache[addr&(DMC_CACHE_SIZE-1)]);
+  if ( !_play.have ) next_dmc ();
+  if ( _play.have )
+    {
+      if ( _play.hits == 0 )
+        {
+          _play.have= NES_FALSE;
+          *p= _play.byte;
+        }
+      else --_play.hits;
+    }
+  
+  return *p < 0 ? 0x00 : (NESu8) *p;
+  
+} /* end replay_read */
+
+
+/* Avança l'APU fins a TARGET. */
+static void
+advance (
+         NESu64       *pos,
+         const NESu64  target
+         )
+{
+  
+  unsigned int n;
+  
+  
+  while ( *pos < target )
+    {
+      n= target-*pos > MAX_CLOCK ?
+        MAX_CLOCK : (unsigned int) (target-*pos);
+      NES_apu_clock ( &n );
+      *pos+= n;
+    }
+  
+} /* end advance */
+
+
+static void
+replay_write (
+              const NESu16 addr,
+              const NESu8  data
+              )
+{
+  
+  switch ( addr )
+    {
+    case 0x4000: NES_apu_pulse1CR ( data ); break;
+    case 0x4001: NES_apu_pulse1RCR ( data ); break;
+    case 0x4002: NES_apu_pulse1FTR ( data ); break;
+    case 0x4003: NES_apu_pulse1CTR ( data ); break;
+    case 0x4004: NES_apu_pulse2CR ( data ); break;
+    case 0x4005: NES_apu_pulse2RCR ( data ); break;
+    case 0x4006: NES_apu_pulse2FTR ( data ); break;
+    case 0x4007: NES_apu_pulse2CTR ( data ); break;
+    case 0x4008: NES_apu_triangleCR1 ( data ); break;
+    case 0x400A: NES_apu_triangleFR1 ( data ); break;
+    case 0x400B: NES_apu_triangleFR2 ( data ); break;
+    case 0x400C: NES_apu_noiseCR ( data ); break;
+    case 0x400E: NES_apu_noiseFR1 ( data ); break;
+    case 0x400F: NES_apu_noiseFR2 ( data ); break;
+    case 0x4010: NES_apu_dmCR ( data ); break;
+    case 0x4011: NES_apu_dmDAR ( data ); break;
+    case 0x4012: NES_apu_dmAR ( data ); break;
+    case 0x4013: NES_apu_dmLR ( data ); break;
+    case 0x4015: NES_apu_control ( data ); break;
+    case 0x4017: NES_apu_conf_fseq ( data ); break;
+    default: break;
+    }
+  
+} /* end replay_write */
+
+
+
+
+/**********************/
+/* FUNCIONS PÚBLIQUES */
+/**********************/
+
+int
+NES_apu_log_enable (
+        	    FILE *f
+        	    )
+{
+  
+  _rec.next= f;
+  
+  return f == NULL ? close_log () : 0;
+  
+} /* end NES_apu_log_enable */
+
+
+NES_Bool
+NES_apu_log_init (
+        	  const NES_TVMode tvmode
+        	  )
+{
+  
+  if ( _rec.next == NULL ) return NES_FALSE;
+  if ( _rec.f != _rec.next )
+    {
+      close_log ();
+      _rec.f= _rec.next;
+      _rec.error= NES_FALSE;
+      _rec.hits= 0;
+      clear_cache ( _rec.dmc );
+      if ( fwrite ( "NESAPU", 6, 1, _rec.f ) != 1 ) _rec.error= NES_TRUE;
+      put ( VERSION );
+      put ( tvmode );
+    }
+  _rec.cc= _rec.last= 0;
+  forget_regs ();
+  
+  return NES_TRUE;
+  
+} /* end NES_apu_log_init */
+
+
+void
+NES_apu_log_clock (
+        	   const unsigned int cc
+        	   )
+{
+  _rec.cc+= cc;
+} /* end NES_apu_log_clock */
+
+
+void
+NES_apu_log_write (
+        	   const NESu16 addr,
+        	   const NESu8  data
+        	   )
+{
+  
+  if ( addr == NES_APU_ASYNC_RESET )
+    {
+      put_wait ();
+      put ( CMD_RESET );
+      forget_regs ();
+    }
+  else if ( !redundant_write ( addr-0x4000, data ) )
+    {
+      put_wait ();
+      put ( addr-0x4000 );
+      put ( data );
+    }
+  
+} /* end NES_apu_log_write */
+
+
+void
+NES_apu_log_dmc (
+        	 const NESu16 addr,
+        	 const NESu8  data
+        	 )
+{
+  
+  NESs16 *p;
+  NESu32 n;
+  
+  
+  p= &(_rec.dmc[addr&(DMC_CACHE_SIZE-1)]);
+  if ( *p == data && _rec.hits != 0xFFFFFFFF ) { ++_rec.hits; return; }
+  *p= data;
+  put ( CMD_DMC );
+  for ( n= _rec.hits; n >= 0x80; n>>= 7 )
+    put ( (n&0x7F)|0x80 );
+  put ( n );
+  put ( data );
+  _rec.hits= 0;
+  
+} /* end NES_apu_log_dmc */
+
+
+int
+NES_apu_log_play (
+        	  const NESu8   *data,
+        	  const size_t   nbytes,
+        	  NES_PlayFrame *play_frame,
+        	  void          *udata
+        	  )
+{
+  
+  size_t p, n;
+  NESu64 pos, target;
+  NESu8 cmd;
+  int ret;
+  
+  
+  if ( nbytes < HEADER_SIZE || memcmp ( data, "NESAPU", 6 ) != 0 ||
+       data[6] != VERSION || (data[7] != NES_PAL && data[7] != NES_NTSC) )
+    return -1;
+  
+  _play.data= data;
+  _play.nbytes= nbytes;
+  _play.dmc= HEADER_SIZE;
+  _play.have= NES_FALSE;
+  clear_cache ( _play.cache );
+  NES_apu_init ( (NES_TVMode) data[7], play_frame, udata );
+  NES_apu_set_replay ( replay_read );
+  
+  ret= -1;
+  pos= target= 0;
+  for ( p= HEADER_SIZE; p < nbytes; p+= n )
+    {
+      if ( (n= cmd_size ( p )) == 0 ) break;
+      cmd= data[p];
+      if ( cmd >= CMD_WAIT ) target+= cmd-CMD_WAIT+1;
+      else if ( cmd == CMD_WAIT16 )
+        target+= data[p+1] | (data[p+2]<<8);
+      else if ( cmd == CMD_WAIT32 )
+        target+= data[p+1] | (data[p+2]<<8) | (data[p+3]<<16) |
+          ((NESu32) data[p+4]<<24);
+      else if ( cmd == CMD_END ) { ret= 0; break; }
+      else if ( cmd == CMD_RESET )
+        {
+          advance ( &pos, target );
+          NES_apu_reset ();
+        }
+      else if ( cmd < CMD_RESET )
+        {
+          advance ( &pos, target );
+          replay_write ( 0x4000+cmd, data[p+1] );
+        }
+      else if ( cmd != CMD_DMC ) break;
+    }
+  advance ( &pos, target );
+  NES_apu_set_replay ( NULL );
+  _play.data= NULL;
+  
+  return ret;
+  
+} /* end NES_apu_log_play */
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2022 Adrià Giménez Pastor.
+ *
+ * This file is part of adriagipas/NES.
+ *
+ * adriagipas/NES is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * adriagipas/NES is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with adriagipas/NES.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ *  audio.c - Implementació del mòdul AUDIO.
+ *
+ *  NOTA: 'in' i 'out' no es redueixen mai, la posició en el vector és
+ *  el valor mòdul 'size'. Cada banda llig el comptador de l'altra
+ *  amb 'acquire' i publica el seu amb 'release', així les mostres ja
+ *  estan escrites quan l'altra banda veu el comptador nou.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "NES.h"
+
+
+
+
+/**********/
+/* MACROS */
+/**********/
+
+#define LOAD_ACQ(VAR) __atomic_load_n ( &(VAR), __ATOMIC_ACQUIRE )
+#define STORE_REL(VAR,VAL) __atomic_store_n ( &(VAR), (VAL), __ATOMIC_RELEASE )
+
+/* Pes de cada mostreig en la mitjana de l'ocupació. */
+#define RATE_SMOOTH (1.0/8.0)
+
+/* Canvis de la relació més menuts que açò no s'apliquen. */
+#define RATE_STEP 1e-5
+
+#define RATE_MAX_DELTA 0.05
+
+
+
+
+/*********************/
+/* FUNCIONS PRIVADES */
+/*********************/
+
+/* Avança 'in' N mostres i desperta el consumidor si es passa la
+   marca alta. FILL són les mostres que hi havia abans. */
+static void
+commit_write (
+              NES_AudioRing      *ring,
+              const unsigned int  fill,
+              const unsigned int  n
+              )
+{
+  
+  STORE_REL ( ring->in, ring->in+n );
+  if ( fill < ring->high && fill+n >= ring->high &&
+       ring->wake_consumer != NULL )
+    ring->wake_consumer ( ring->udata );
+  
+} /* end commit_write */
+
+
+/* Mostres que caben. Apunta les que no. */
+static unsigned int
+reserve_write (
+               NES_AudioRing *ring,
+               const int      n,
+               unsigned int  *fill
+               )
+{
+  
+  unsigned int room;
+  
+  
+  *fill= ring->in - LOAD_ACQ ( ring->out );
+  room= ring->size - *fill;
+  if ( (unsigned int) n <= room ) return n;
+  ring->overruns+= n-room;
+  
+  return room;
+  
+} /* end reserve_write */
+
+
+
+
+/**********************/
+/* FUNCIONS PÚBLIQUES */
+/**********************/
+
+int
+NES_audio_ring_init (
+        	     NES_AudioRing     *ring,
+        	     const int          size,
+        	     const int          low,
+        	     const int          high,
+        	     NES_AudioRingWake *wake_producer,
+        	     NES_AudioRingWake *wake_consumer,
+        	     void              *udata
+        	     )
+{
+  
+  unsigned int n;
+  
+  
+  if ( size <= 0 || low < 0 || low >= high || high > size ) return -1;
+  for ( n= 1; n < (unsigned int) size; n<<= 1 );
+  ring->v= (NESs16 *) malloc ( sizeof(NESs16)*n );
+  if ( ring->v == NULL ) return -1;
+  ring->size= n;
+  ring->low= low;
+  ring->high= high;
+  ring->wake_producer= wake_producer;
+  ring->wake_consumer= wake_consumer;
+  ring->udata= udata;
+  ring->target= 0.0;
+  ring->max_delta= 0.0;
+  NES_audio_ring_clear ( ring );
+  
+  return 0;
+  
+} /* end NES_audio_ring_init */
+
+
+void
+NES_audio_ring_free (
+        	     NES_AudioRing *ring
+        	     )
+{
+  
+  free ( ring->v );
+  ring->v= NULL;
+  
+} /* end NES_audio_ring_free */
+
+
+void
+NES_audio_ring_clear (
+        	      NES_AudioRing *ring
+        	      )
+{
+  
+  ring->in= ring->out= 0;
+  ring->overruns= ring->underruns= 0;
+  ring->last= 0;
+  ring->avg= ring->target;
+  ring->adjustments= 0;
+  ring->min_fill= ring->size;
+  ring->max_fill= 0;
+  if ( ring->max_delta > 0.0 && ring->ratio != 1.0 )
+    NES_apu_set_ratio ( 1.0 );
+  ring->ratio= 1.0;
+  
+} /* end NES_audio_ring_clear */
+
+
+int
+NES_audio_ring_fill (
+        	     const NES_AudioRing *ring
+        	     )
+{
+  return (int) (LOAD_ACQ ( ring->in ) - LOAD_ACQ ( ring->out ));
+} /* end NES_audio_ring_fill */
+
+
+int
+NES_audio_ring_write (
+        	      NES_AudioRing *ring,
+        	      const NESs16  *v,
+        	      const int      n
+        	      )
+{
+  
+  unsigned int fill, m, pos, first;
+  
+  
+  m= reserve_write ( ring, n, &fill );
+  pos= ring->in&(ring->size-1);
+  first= ring->size-pos;
+  if ( first > m ) first= m;
+  memcpy ( ring->v+pos, v, sizeof(NESs16)*first );
+  memcpy ( ring->v, v+first, sizeof(NESs16)*(m-first) );
+  commit_write ( ring, fill, m );
+  
+  return m;
+  
+} /* end NES_audio_ring_write */
+
+
+int
+NES_audio_ring_write_double (
+        		     NES_AudioRing *ring,
+        		     const double  *v,
+        		     const int      n
+        		     )
+{
+  
+  unsigned int fill, m, i, mask, in;
+  double y;
+  
+  
+  m= reserve_write ( ring, n, &fill );
+  mask= ring->size-1;
+  in= ring->in;
+  for ( i= 0; i < m; ++i )
+    {
+      y= v[i];
+      if ( y > 1.0 ) y= 1.0;
+      else if ( y < -1.0 ) y= -1.0;
+      ring->v[(in+i)&mask]= (NESs16) (y*32767.0);
+    }
+  commit_write ( ring, fill, m );
+  
+  return m;
+  
+} /* end NES_audio_ring_write_double */
+
+
+int
+NES_audio_ring_read (
+        	     NES_AudioRing *ring,
+        	     NESs16        *dst,
+        	     const int      n
+        	     )
+{
+  
+  unsigned int fill, m, pos, first, i;
+  
+  
+  fill= LOAD_ACQ ( ring->in ) - ring->out;
+  m= (unsigned int) n < fill ? (unsigned int) n : fill;
+  pos= ring->out&(ring->size-1);
+  first= ring->size-pos;
+  if ( first > m ) first= m;
+  memcpy ( dst, ring->v+pos, sizeof(NESs16)*first );
+  memcpy ( dst+first, ring->v, sizeof(NESs16)*(m-first) );
+  if ( m > 0 ) ring->last= dst[m-1];
+  STORE_REL ( ring->out, ring->out+m );
+  if ( m < (unsigned int) n )
+    {
+      __atomic_fetch_add ( &ring->underruns, n-m, __ATOMIC_RELAXED );
+      for ( i= m; i < (unsigned int) n; ++i )
+        dst[i]= ring->last;
+    }
+  if ( fill > ring->low && fill-m <= ring->low &&
+       ring->wake_producer != NULL )
+    ring->wake_producer ( ring->udata );
+  
+  return m;
+  
+} /* end NES_audio_ring_read */
+
+
+int
+NES_audio_ring_set_rate_control (
+        			 NES_AudioRing *ring,
+        			 const int      target,
+        			 const double   max_delta
+        			 )
+{
+  
+  if ( max_delta < 0.0 || max_delta > RATE_MAX_DELTA ||
+       target <= 0 || (unsigned int) target > ring->size )
+    return -1;
+  if ( max_delta == 0.0 && ring->ratio != 1.0 )
+    {
+      NES_apu_set_ratio ( 1.0 );
+      ring->ratio= 1.0;
+    }
+  ring->target= (double) target;
+  ring->max_delta= max_delta;
+  ring->avg= ring->target;
+  
+  return 0;
+  
+} /* end NES_audio_ring_set_rate_control */
+
+
+double
+NES_audio_ring_rate_control (
+        		     NES_AudioRing *ring
+        		     )
+{
+  
+  unsigned int fill;
+  double ratio, d;
+  
+  
+  fill= ring->in - LOAD_ACQ ( ring->out );
+  if ( fill < ring->min_fill ) ring->min_fill= fill;
+  if ( fill > ring->max_fill ) ring->max_fill= fill;
+  if ( ring->max_delta == 0.0 ) return ring->ratio;
+  
+  /* Proporcional a la distància de la mitjana a l'objectiu: amb la
+     cua buida es generen un MAX_DELTA més de mostres, amb el doble de
+     l'objectiu un MAX_DELTA menys. */
+  ring->avg+= (fill-ring->avg)*RATE_SMOOTH;
+  d= (ring->target-ring->avg)/ring->target;
+  if ( d > 1.0 ) d= 1.0;
+  else if ( d < -1.0 ) d= -1.0;
+  ratio= 1.0 + ring->max_delta*d;
+  if ( ratio-ring->ratio > RATE_STEP || ring->ratio-ratio > RATE_STEP )
+    {
+      NES_apu_set_ratio ( ratio );
+      ring->ratio= ratio;
+      ++ring->adjustments;
+    }
+  
+  return ring->ratio;
+  
+} /* end NES_audio_ring_rate_control */
+
+
+void
+NES_audio_ring_get_stats (
+        		  NES_AudioRing      *ring,
+        		  NES_AudioRingStats *stats,
+        		  const NES_Bool      reset
+        		  )
+{
+  
+  stats->fill= NES_audio_ring_fill ( ring );
+  stats->min_fill= ring->min_fill > ring->max_fill ?
+    stats->fill : (int) ring->min_fill;
+  stats->max_fill= ring->min_fill > ring->max_fill ?
+    stats->fill : (int) ring->max_fill;
+  stats->overruns= ring->overruns;
+  stats->underruns= __atomic_load_n ( &ring->underruns, __ATOMIC_RELAXED );
+  stats->ratio= ring->ratio;
+  stats->adjustments= ring->adjustments;
+  if ( reset )
+    {
+      ring->min_fill= ring->size;
+      ring->max_fill= 0;
+    }
+  
+} /* end NES_audio_ring_get_stats */
@@ -517,6 +517,98 @@ CAT(NAME,CAT(_,ADDR)) (void)         \
 #include "op.h"
 #undef OP
 
+/* Reconeix i executa de colp els bucles que copien dades a la VRAM:
+ *
+ *   loop: LDA (zp),Y    |  LDA abs,X  |  LDA abs,Y
+ *         STA $2007     |  STA $2007  |  STA $2007
+ *         INY           |  INX        |  INY
+ *         BNE loop      |  BNE loop   |  BNE loop
+ *
+ * S'executen les iteracions que caben abans que la PPU necessite
+ * posar-se al dia (NES_ppu_idle_cc), deixant marge per als cicles
+ * que pot robar el DMA del DMC, i sols si les lectures no tenen
+ * efectes laterals i les IRQ estan inhibides (sempre dins del
+ * NMI). Els cicles, els registres i els flags queden igual que si
+ * s'hagueren executat instrucció a instrucció. Torna NES_FALSE si no
+ * s'ha executat cap iteració. Es crida amb el PC apuntant al primer
+ * byte després del 'opcode' de LDA.
+ */
+static NES_Bool
+vram_upload (void)
+{
+
+  static const NESu8 indy[]= { 0x8D, 0x07, 0x20, 0xC8, 0xD0, 0xF8 };
+  static const NESu8 absx[]= { 0x8D, 0x07, 0x20, 0xE8, 0xD0, 0xF7 };
+  static const NESu8 absy[]= { 0x8D, 0x07, 0x20, 0xC8, 0xD0, 0xF7 };
+  
+  const NESu8 *pattern;
+  NESu8 data[256], aux, lo, hi, *index;
+  NESu16 start, next, base;
+  int i, len, n, cc, lda_cc, it_cc, bne_cc, idle;
+  
+  
+  /* Reconeix el bucle. */
+  if ( !ISINT ) return NES_FALSE;
+  switch ( _opcode )
+    {
+    case 0xB1: pattern= indy; len= 1; index= &_regs.Y; lda_cc= 5; break;
+    case 0xBD: pattern= absx; len= 2; index= &_regs.X; lda_cc= 4; break;
+    case 0xB9: pattern= absy; len= 2; index= &_regs.Y; lda_cc= 4; break;
+    default: return NES_FALSE;
+    }
+  for ( i= 0; i < 6; ++i )
+    if ( !NES_mem_peek ( _regs.PC+len+i, &aux ) || aux != pattern[i] )
+      return NES_FALSE;
+  
+  /* Adreça base. */
+  if ( !NES_mem_peek ( _regs.PC, &lo ) ) return NES_FALSE;
+  if ( len == 1 )
+    {
+      if ( !NES_mem_peek ( lo, &aux ) ||
+           !NES_mem_peek ( (lo+1)&0xFF, &hi ) )
+        return NES_FALSE;
+      lo= aux;
+    }
+  else if ( !NES_mem_peek ( _regs.PC+1, &hi ) ) return NES_FALSE;
+  base= (((NESu16) hi)<<8) | lo;
+  
+  /* Llig les dades de les iteracions que caben senceres en la
+     finestra. */
+  start= _regs.PC-1;
+  next= _regs.PC+len+6;
+  bne_cc= ((next&0xFF00) != (start&0xFF00)) ? 4 : 3;
+  idle= NES_ppu_idle_cc ();
+  idle-= idle/64 + 4;
+  cc= n= 0;
+  i= *index;
+  do
+    {
+      it_cc= lda_cc + (lo+i > 0xFF) + 4/*STA*/ + 2/*INY/INX*/ +
+        (i != 0xFF ? bne_cc : 2);
+      if ( cc+it_cc > idle ||
+           !NES_mem_peek ( (NESu16) (base+i), &data[n] ) )
+        break;
+      ++n;
+      i= (i+1)&0xFF;
+      cc+= it_cc;
+    }
+  while ( i != 0 );
+  if ( n == 0 ) return NES_FALSE;
+  
+  /* Executa. */
+  NES_ppu_write_block ( data, n );
+  _regs.A= data[n-1];
+  *index= (NESu8) i;
+  _regs.P&= 0x7D;
+  SET_NZ_FROM ( *index );
+  _regs.PC= (i == 0) ? next : start;
+  _vars.cc= cc;
+  
+  return NES_TRUE;
+  
+} /* end vram_upload */
+
+
 static void
 unk (void)
 {
@@ -634,7 +726,9 @@ NES_cpu_run (void)
 {
   
   _opcode= NES_mem_read ( _regs.PC++ );
-  _insts[_opcode] ();
+  if ( (_opcode != 0xB1 && _opcode != 0xBD && _opcode != 0xB9) ||
+       !vram_upload () )
+    _insts[_opcode] ();
   _vars.cc+= _extra_cc; _extra_cc= 0;
   
   return _vars.cc;
@@ -28,7 +28,6 @@
 #include <string.h>
 
 #include "NES.h"
-#include "mappers/mmc3.h"
 
 
 
@@ -50,7 +49,6 @@ static NES_CheckSignals *_check;
 static NES_CPUInst *_cpu_inst;
 static unsigned int _cc1cs;
 static void *_udata;
-static NES_Bool _mmc3_irq;
 static NES_Bool _reset;
 static NES_Warning *_warning;
 
@@ -105,7 +103,8 @@ NES_init (
         	 frontend->trace!=NULL?
         	 frontend->trace->mem_access:NULL,
         	 udata );
-  NES_ppu_init ( tvmode, rom->mapper, frontend->update_screen, udata );
+  NES_ppu_init ( tvmode, rom->mapper, rom->ppu_engine,
+        	 frontend->update_screen, udata );
   NES_apu_init ( tvmode, frontend->play_frame, udata );
   NES_joypads_init ( frontend->cpb1, frontend->cpb2, udata );
   NES_cpu_init ( frontend->warning, udata );
@@ -122,8 +121,6 @@ NES_init (
     NES_CPU_NTSC_CYCLES_PER_SEC;
   _cc1cs/= 100;
   
-  _mmc3_irq= rom->mapper==NES_MMC3;
-  
   reset ();
   
   return NES_NOERROR;
@@ -151,9 +148,7 @@ NES_iter (
   cc+= NES_dma_extra_cc;
   if ( NES_apu_clock ( (unsigned int *) &cc ) )
     irq= NES_TRUE;
-  NES_ppu_clock ( cc );
-  if ( _mmc3_irq && NES_mapper_mmc3_check_irq () )
-    irq= NES_TRUE;
+  if ( NES_ppu_clock ( cc ) ) irq= NES_TRUE;
   if ( irq ) NES_cpu_IRQ ();
   CC+= cc;
   
@@ -232,9 +227,7 @@ NES_loop (void)
       CC+= NES_dma_extra_cc;
       if ( NES_apu_clock ( (unsigned int *) &CC ) )
         irq= NES_TRUE;
-      NES_ppu_clock ( CC );
-      if ( _mmc3_irq && NES_mapper_mmc3_check_irq () )
-        irq= NES_TRUE;
+      if ( NES_ppu_clock ( CC ) ) irq= NES_TRUE;
       if ( irq ) NES_cpu_IRQ ();
       ncycles_clock+= CC;
       
@@ -294,9 +287,7 @@ NES_trace (void)
   CC+= NES_dma_extra_cc;
   if ( NES_apu_clock ( (unsigned int *) &CC ) )
     irq= NES_TRUE;
-  NES_ppu_clock ( CC );
-  if ( _mmc3_irq && NES_mapper_mmc3_check_irq () )
-    irq= NES_TRUE;
+  if ( NES_ppu_clock ( CC ) ) irq= NES_TRUE;
   if ( irq ) NES_cpu_IRQ ();
   NES_mem_set_mode_trace ( NES_FALSE );
   NES_mapper_set_mode_trace ( NES_FALSE );
@@ -97,6 +97,7 @@ config_single_screen (
 
 
   NES_ppu_sync ();
+  NES_ppu_vram_changed ();
   mem= area ? &(_vram_nt[0x400]) : _vram_nt;
   _nt[0]= _nt[1]= _nt[2]= _nt[3]= mem;
   
@@ -63,6 +63,7 @@
                                                       \
                                                       \
   NES_ppu_sync ();        			      \
+  NES_ppu_vram_changed ();        		      \
   byte= NROM_READ ## SIZE ( addr );                   \
   if ( byte != data ) BUS_CONFLICT ( addr );          \
   ibank= data&0x3;        			      \
@@ -177,6 +178,7 @@ reset (void)
 {
   
   NES_ppu_sync ();
+  NES_ppu_vram_changed ();
   _vrom= (const NESu8 *) _rom->chrs[0];
   
 } /* end reset */
@@ -107,6 +107,26 @@ static NES_Bool _trace_enabled;
 /* FUNCIONS PRIVADES */
 /*********************/
 
+/* Canvia el mapeig de les nametables. Sols avisa a la PPU si canvia
+   alguna. */
+static void
+config_nt (
+           NESu8 *nt0,
+           NESu8 *nt1,
+           NESu8 *nt2,
+           NESu8 *nt3
+           )
+{
+  
+  if ( _nt[0] != nt0 || _nt[1] != nt1 || _nt[2] != nt2 || _nt[3] != nt3 )
+    {
+      NES_ppu_vram_changed ();
+      _nt[0]= nt0; _nt[1]= nt1; _nt[2]= nt2; _nt[3]= nt3;
+    }
+  
+} /* end config_nt */
+
+
 static void
 config_single_screen (
                       const int area
@@ -118,11 +138,29 @@ config_single_screen (
 
   NES_ppu_sync ();
   mem= area ? &(_vram_nt[0x400]) : _vram_nt;
-  _nt[0]= _nt[1]= _nt[2]= _nt[3]= mem;
+  config_nt ( mem, mem, mem, mem );
   
 } /* end config_single_screen */
 
 
+/* Canvia els bancs de CHR ROM. Sols avisa a la PPU si canvia algun. */
+static void
+config_chr (
+            const NESu8 *bank0,
+            const NESu8 *bank1
+            )
+{
+  
+  if ( _state.chr_bank[0] != bank0 || _state.chr_bank[1] != bank1 )
+    {
+      NES_ppu_vram_changed ();
+      _state.chr_bank[0]= bank0;
+      _state.chr_bank[1]= bank1;
+    }
+  
+} /* end config_chr */
+
+
 static NESu8
 mmc1_read (
            const NESu16 addr
@@ -189,12 +227,12 @@ mmc1_write (
             case 0: config_single_screen ( 0 ); break;
             case 1: config_single_screen ( 1 ); break;
             case 2: /* VERTICAL */
-              _nt[0]= _nt[2]= &(_vram_nt[0]);
-              _nt[1]= _nt[3]= &(_vram_nt[0x400]);
+              config_nt ( &(_vram_nt[0]), &(_vram_nt[0x400]),
+        		  &(_vram_nt[0]), &(_vram_nt[0x400]) );
               break;
             case 3: /* HORIZONTAL */
-              _nt[0]= _nt[1]= &(_vram_nt[0]);
-              _nt[2]= _nt[3]= &(_vram_nt[0x400]);
+              config_nt ( &(_vram_nt[0]), &(_vram_nt[0]),
+        		  &(_vram_nt[0x400]), &(_vram_nt[0x400]) );
               break;
             }
           _state.prg_bank_mode= (reg&0xC)>>2;
@@ -220,16 +258,10 @@ mmc1_write (
             {
               MMC1_CHECK_CHR_ACCESS ( i );
               if ( _state.chr_bank_mode == 0 )
-                {
-                  _state.chr_bank[0]= _rom->chrs[i];
-                  _state.chr_bank[1]= _rom->chrs[i]+4096;
-                }
+                config_chr ( _rom->chrs[i], _rom->chrs[i]+4096 );
               else
-                {
-                  _state.chr_bank[0]= _rom->chrs[i];
-                  if ( reg&0x1 )
-                    _state.chr_bank[0]+= 4096;
-                }
+                config_chr ( _rom->chrs[i] + ((reg&0x1) ? 4096 : 0),
+        		     _state.chr_bank[1] );
             }
         }
       
@@ -241,9 +273,8 @@ mmc1_write (
             {
               i= reg>>1;
               MMC1_CHECK_CHR_ACCESS ( i );
-              _state.chr_bank[1]= _rom->chrs[i];
-              if ( reg&0x1 )
-                _state.chr_bank[1]+= 4096;
+              config_chr ( _state.chr_bank[0],
+        		   _rom->chrs[i] + ((reg&0x1) ? 4096 : 0) );
             }
         }
       
@@ -316,6 +347,7 @@ reset (void)
 {
 
   NES_ppu_sync ();
+  NES_ppu_vram_changed ();
   
   _state.prg_bank[0]= _rom->prgs[0];
   _state.prg_bank[1]= _rom->prgs[_rom->nprg-1];
@@ -158,6 +158,7 @@ mmc2_write (
   if ( addr < 0x2000 ) return;
 
   NES_ppu_sync ();
+  NES_ppu_vram_changed ();
   
   /* PRG ROM bank select ($A000-$AFFF) */
   if ( addr < 0x3000 )
@@ -275,6 +276,7 @@ reset (void)
 {
 
   NES_ppu_sync ();
+  NES_ppu_vram_changed ();
   
   _state.prg_bank[0]= GET_PRG_BANK ( 0 );
   _state.prg_bank[1]= GET_PRG_BANK ( (_rom->nprg*2)-3 );
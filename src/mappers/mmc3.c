@@ -131,13 +131,18 @@ config_mirroring (
         	  )
 {
 
+  /* Les nametables 1 i 2 són les que canvien entre modes. */
   if ( is_horizontal )
     {
+      if ( _nt[1] != &(_vram_nt[0]) || _nt[2] != &(_vram_nt[0x400]) )
+        NES_ppu_vram_changed ();
       _nt[0]= _nt[1]= &(_vram_nt[0]);
       _nt[2]= _nt[3]= &(_vram_nt[0x400]);
     }
   else
     {
+      if ( _nt[1] != &(_vram_nt[0x400]) || _nt[2] != &(_vram_nt[0]) )
+        NES_ppu_vram_changed ();
       _nt[0]= _nt[2]= &(_vram_nt[0]);
       _nt[1]= _nt[3]= &(_vram_nt[0x400]);
     }
@@ -169,16 +174,21 @@ update_mmap_prg (void)
 } /* end update_mmap_prg */
 
 
+/* Sols avisa a la PPU si canvia algun banc. */
 static void
 update_mmap_chr (void)
 {
 
+  const NESu8 *old[8];
+  
+  
   MMC3_CHECK_CHR_ACCESS ( _state.regs[0]|0x01 );
   MMC3_CHECK_CHR_ACCESS ( _state.regs[1]|0x01 );
   MMC3_CHECK_CHR_ACCESS ( _state.regs[2] );
   MMC3_CHECK_CHR_ACCESS ( _state.regs[3] );
   MMC3_CHECK_CHR_ACCESS ( _state.regs[4] );
   MMC3_CHECK_CHR_ACCESS ( _state.regs[5] );
+  memcpy ( old, _state.chr_bank, sizeof(old) );
   if ( _state.chr_bank_mode == 0 )
     {
       _state.chr_bank[0]= _rom->chrs[0] + (_state.regs[0]&0xFE)*1024;
@@ -201,6 +211,8 @@ update_mmap_chr (void)
       _state.chr_bank[6]= _rom->chrs[0] + (_state.regs[1]&0xFE)*1024;
       _state.chr_bank[7]= _rom->chrs[0] + (_state.regs[1]|0x01)*1024;
     }
+  if ( memcmp ( old, _state.chr_bank, sizeof(old) ) != 0 )
+    NES_ppu_vram_changed ();
   
 } /* end update_mmap_chr */
 
@@ -312,6 +324,7 @@ mmc3_write (
         }
       
     }
+  if ( addr >= 0x4000 ) NES_ppu_irq_changed ();
   
 } /* end mmc3_write */
 
@@ -357,6 +370,7 @@ reset (void)
 {
 
   NES_ppu_sync ();
+  NES_ppu_vram_changed ();
   
   /* ROM. */
   _state.prg_bank_mode= 0;
@@ -385,6 +399,7 @@ reset (void)
   _state.irq_enabled= NES_FALSE;
   _state.irq_reload= NES_FALSE;
   _state.irq_active= NES_FALSE;
+  NES_ppu_irq_changed ();
   
 } /* end reset */
 
@@ -627,6 +642,19 @@ NES_mapper_mmc3_clock_counter (void)
 } /* end NES_mapper_mmc3_clock_counter */
 
 
+int
+NES_mapper_mmc3_clocks_to_irq (void)
+{
+
+  if ( !_state.irq_enabled ) return -1;
+  if ( _state.irq_reload || _state.irq_counter == 0 )
+    return _state.irq_latch == 0 ? 1 : _state.irq_latch+1;
+  
+  return _state.irq_counter;
+  
+} /* end NES_mapper_mmc3_clocks_to_irq */
+
+
 NES_Error
 NES_mapper_mmc3_init (
         	      const NES_Rom     *rom,
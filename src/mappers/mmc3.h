@@ -32,6 +32,11 @@ NES_mapper_mmc3_check_irq (void);
 void
 NES_mapper_mmc3_clock_counter (void);
 
+/* Torna quants flancs de A12 falten perquè s'active la IRQ, o -1 si
+   està desactivada. */
+int
+NES_mapper_mmc3_clocks_to_irq (void);
+
 NES_Error
 NES_mapper_mmc3_init (
         	      const NES_Rom     *rom,
@@ -355,6 +355,53 @@ NES_mem_write (
 } /* end NES_mem_write */
 
 
+NES_Bool
+NES_mem_read_page (
+        	   const NESu8 page,
+        	   NESu8       dst[256]
+        	   )
+{
+
+  NESu16 addr;
+  int i;
+  
+  
+  if ( _mem_read != mem_read ) return NES_FALSE;
+  addr= ((NESu16) page)<<8;
+  if ( addr < 0x2000 )
+    memcpy ( dst, &(_ram[addr&0x7FF]), 256 );
+  else if ( addr < 0x6000 || (addr < 0x8000 && _prgram == NULL) )
+    return NES_FALSE;
+  else if ( addr < 0x8000 )
+    memcpy ( dst, &(_prgram[addr&0x1FFF]), 256 );
+  else
+    for ( addr&= 0x7FFF, i= 0; i < 256; ++i )
+      dst[i]= NES_mapper_read ( addr+i );
+  
+  return NES_TRUE;
+  
+} /* end NES_mem_read_page */
+
+
+NES_Bool
+NES_mem_peek (
+              const NESu16  addr,
+              NESu8        *data
+              )
+{
+  
+  if ( _mem_read != mem_read ) return NES_FALSE;
+  if ( addr < 0x2000 ) *data= _ram[addr&0x7FF];
+  else if ( addr < 0x6000 || (addr < 0x8000 && _prgram == NULL) )
+    return NES_FALSE;
+  else if ( addr < 0x8000 ) *data= _prgram[addr&0x1FFF];
+  else *data= NES_mapper_read ( addr&0x7FFF );
+  
+  return NES_TRUE;
+  
+} /* end NES_mem_peek */
+
+
 void
 NES_mem_set_mode_trace (
         		const NES_Bool val
@@ -0,0 +1,814 @@
+/*
+ * Copyright 2022 Adrià Giménez Pastor.
+ *
+ * This file is part of adriagipas/NES.
+ *
+ * adriagipas/NES is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * adriagipas/NES is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with adriagipas/NES.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ *  post.c - Implementació del mòdul POST.
+ *
+ *  En x86 els nuclis amb AVX2 es compilen sempre (amb l'atribut
+ *  'target') i es trien en temps d'execució si la CPU els suporta:
+ *  l'escalat per repetició (x2 i x4), el Scale2x i el Scale3x
+ *  processen 8 píxels de colp i el NTSC descodifica 8 columnes de
+ *  colp. La versió genèrica dona el mateix resultat.
+ *
+ */
+
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
+#include "NES.h"
+
+
+
+
+/**********/
+/* MACROS */
+/**********/
+
+#ifdef USE_AVX2
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#define HAS_AVX2 __builtin_cpu_supports ( "avx2" )
+#endif
+
+/* Mostres de la senyal per píxel i per cicle de la subportadora. */
+#define NTSC_SPP 8
+#define NTSC_SPC 12
+
+/* Mostres de la senyal d'una línia, amb mig cicle de negre a cada
+   costat. */
+#define NTSC_LEN (256*NTSC_SPP+NTSC_SPC)
+
+/* Atenuació de l'èmfasi. */
+#define NTSC_ATT 0.746f
+
+/* Nivells de negre i blanc. */
+#define NTSC_BLACK 0.518f
+#define NTSC_WHITE 1.962f
+
+
+
+
+/*********/
+/* TIPUS */
+/*********/
+
+/* Senyal d'una línia (Y) i senyal multiplicada pel cos (I) i pel sin
+   (Q) de la fase. La mostra N es guarda en [N%4][N/4], així les
+   mostres que llig cada tap de 8 columnes seguides estan juntes. */
+typedef struct
+{
+
+  float y[4][NTSC_LEN/4];
+  float i[4][NTSC_LEN/4];
+  float q[4][NTSC_LEN/4];
+
+} NTSCSignal;
+
+
+
+
+/*********/
+/* ESTAT */
+/*********/
+
+/* Voltatges de la senyal segons la lluminositat (bits 4-5 del
+   color). */
+static const float _ntsc_lo[4]= { 0.350f, 0.518f, 0.962f, 1.550f };
+static const float _ntsc_hi[4]= { 1.094f, 1.506f, 1.962f, 1.962f };
+
+/* cos i sin de cada fase de la subportadora (amb un ajust del to),
+   dividits entre NTSC_SPC. */
+static const float _ntsc_cos[NTSC_SPC]=
+  {
+    -0.037833f, -0.069889f, -0.083219f, -0.074251f, -0.045387f, -0.004361f,
+    0.037833f, 0.069889f, 0.083219f, 0.074251f, 0.045387f, 0.004361f
+  };
+static const float _ntsc_sin[NTSC_SPC]=
+  {
+    0.074251f, 0.045387f, 0.004361f, -0.037833f, -0.069889f, -0.083219f,
+    -0.074251f, -0.045387f, -0.004361f, 0.037833f, 0.069889f, 0.083219f
+  };
+
+/* Senyal de cada color en cada fase, i multiplicada pel cos i el sin
+   de la fase. Les fases estan repetides dues vegades per a llegir
+   les 8 mostres d'un píxel sense fer el mòdul. Es calculen la primera
+   vegada que es crida a 'NES_post_ntsc'. */
+static float _ntsc_y[NES_PALETTE_SIZE][2*NTSC_SPC];
+static float _ntsc_i[NES_PALETTE_SIZE][2*NTSC_SPC];
+static float _ntsc_q[NES_PALETTE_SIZE][2*NTSC_SPC];
+static pthread_once_t _ntsc_once= PTHREAD_ONCE_INIT;
+
+
+
+
+/*********************/
+/* FUNCIONS PRIVADES */
+/*********************/
+
+/* Repeteix FACTOR vegades cada píxel de SRC en DST. */
+static void
+nearest_line (
+              const int *src,
+              const int  factor,
+              int       *dst
+              )
+{
+
+  int x, k, v;
+
+
+  for ( x= 0; x < 256; ++x )
+    {
+      v= src[x];
+      for ( k= 0; k < factor; ++k )
+        *(dst++)= v;
+    }
+
+} /* end nearest_line */
+
+
+#ifdef USE_AVX2
+static void TARGET_AVX2
+nearest_line_avx2 (
+        	   const int *src,
+        	   const int  factor,
+        	   int       *dst
+        	   )
+{
+
+  int x;
+  __m256i a, i0, i1, i2, i3;
+
+
+  switch ( factor )
+    {
+    case 2:
+      i0= _mm256_setr_epi32 ( 0, 0, 1, 1, 2, 2, 3, 3 );
+      i1= _mm256_setr_epi32 ( 4, 4, 5, 5, 6, 6, 7, 7 );
+      for ( x= 0; x < 256; x+= 8, src+= 8, dst+= 16 )
+        {
+          a= _mm256_loadu_si256 ( (const __m256i *) src );
+          _mm256_storeu_si256 ( (__m256i *) dst,
+        			_mm256_permutevar8x32_epi32 ( a, i0 ) );
+          _mm256_storeu_si256 ( (__m256i *) (dst+8),
+        			_mm256_permutevar8x32_epi32 ( a, i1 ) );
+        }
+      break;
+    case 4:
+      i0= _mm256_setr_epi32 ( 0, 0, 0, 0, 1, 1, 1, 1 );
+      i1= _mm256_setr_epi32 ( 2, 2, 2, 2, 3, 3, 3, 3 );
+      i2= _mm256_setr_epi32 ( 4, 4, 4, 4, 5, 5, 5, 5 );
+      i3= _mm256_setr_epi32 ( 6, 6, 6, 6, 7, 7, 7, 7 );
+      for ( x= 0; x < 256; x+= 8, src+= 8, dst+= 32 )
+        {
+          a= _mm256_loadu_si256 ( (const __m256i *) src );
+          _mm256_storeu_si256 ( (__m256i *) dst,
+        			_mm256_permutevar8x32_epi32 ( a, i0 ) );
+          _mm256_storeu_si256 ( (__m256i *) (dst+8),
+        			_mm256_permutevar8x32_epi32 ( a, i1 ) );
+          _mm256_storeu_si256 ( (__m256i *) (dst+16),
+        			_mm256_permutevar8x32_epi32 ( a, i2 ) );
+          _mm256_storeu_si256 ( (__m256i *) (dst+24),
+        			_mm256_permutevar8x32_epi32 ( a, i3 ) );
+        }
+      break;
+    default:
+      nearest_line ( src, factor, dst );
+    }
+
+} /* end nearest_line_avx2 */
+#endif
+
+
+/* Scale2x del píxel X de la línia E, amb B la línia de dalt i H la de
+   baix. D0 i D1 són les dues línies de l'eixida. */
+static void
+scale2x_pixel (
+               const int *B,
+               const int *E,
+               const int *H,
+               const int  x,
+               int       *d0,
+               int       *d1
+               )
+{
+
+  int b, d, e, f, h;
+
+
+  b= B[x]; e= E[x]; h= H[x];
+  d= x > 0 ? E[x-1] : e;
+  f= x < 255 ? E[x+1] : e;
+  if ( b != h && d != f )
+    {
+      d0[2*x]= d == b ? d : e;
+      d0[2*x+1]= b == f ? f : e;
+      d1[2*x]= d == h ? d : e;
+      d1[2*x+1]= h == f ? f : e;
+    }
+  else
+    {
+      d0[2*x]= d0[2*x+1]= e;
+      d1[2*x]= d1[2*x+1]= e;
+    }
+
+} /* end scale2x_pixel */
+
+
+static void
+scale2x_line (
+              const int *B,
+              const int *E,
+              const int *H,
+              int       *d0,
+              int       *d1
+              )
+{
+
+  int x;
+
+
+  for ( x= 0; x < 256; ++x )
+    scale2x_pixel ( B, E, H, x, d0, d1 );
+
+} /* end scale2x_line */
+
+
+#ifdef USE_AVX2
+static void TARGET_AVX2
+scale2x_line_avx2 (
+        	   const int *B,
+        	   const int *E,
+        	   const int *H,
+        	   int       *d0,
+        	   int       *d1
+        	   )
+{
+
+  int x;
+  __m256i vb, vd, ve, vf, vh, c0, c1, c2, c3, lo, hi, ones;
+
+
+  /* Els píxels 1-248 de 8 en 8, la resta amb la versió genèrica. */
+  scale2x_pixel ( B, E, H, 0, d0, d1 );
+  ones= _mm256_set1_epi32 ( -1 );
+  for ( x= 1; x+8 <= 255; x+= 8 )
+    {
+      vb= _mm256_loadu_si256 ( (const __m256i *) (B+x) );
+      vh= _mm256_loadu_si256 ( (const __m256i *) (H+x) );
+      ve= _mm256_loadu_si256 ( (const __m256i *) (E+x) );
+      vd= _mm256_loadu_si256 ( (const __m256i *) (E+x-1) );
+      vf= _mm256_loadu_si256 ( (const __m256i *) (E+x+1) );
+      /* c0: B!=H && D!=F. */
+      c0= _mm256_andnot_si256 ( _mm256_or_si256 ( _mm256_cmpeq_epi32 ( vb, vh ),
+        					  _mm256_cmpeq_epi32 ( vd, vf ) ),
+        			ones );
+      c1= _mm256_and_si256 ( c0, _mm256_cmpeq_epi32 ( vd, vb ) );
+      c2= _mm256_and_si256 ( c0, _mm256_cmpeq_epi32 ( vb, vf ) );
+      c3= _mm256_and_si256 ( c0, _mm256_cmpeq_epi32 ( vd, vh ) );
+      c0= _mm256_and_si256 ( c0, _mm256_cmpeq_epi32 ( vh, vf ) );
+      /* Línia 0: E0 i E1 intercalats. */
+      lo= _mm256_blendv_epi8 ( ve, vd, c1 );
+      hi= _mm256_blendv_epi8 ( ve, vf, c2 );
+      c1= _mm256_unpacklo_epi32 ( lo, hi );
+      c2= _mm256_unpackhi_epi32 ( lo, hi );
+      _mm256_storeu_si256 ( (__m256i *) (d0+2*x),
+        		    _mm256_permute2x128_si256 ( c1, c2, 0x20 ) );
+      _mm256_storeu_si256 ( (__m256i *) (d0+2*x+8),
+        		    _mm256_permute2x128_si256 ( c1, c2, 0x31 ) );
+      /* Línia 1: E2 i E3 intercalats. */
+      lo= _mm256_blendv_epi8 ( ve, vd, c3 );
+      hi= _mm256_blendv_epi8 ( ve, vf, c0 );
+      c1= _mm256_unpacklo_epi32 ( lo, hi );
+      c2= _mm256_unpackhi_epi32 ( lo, hi );
+      _mm256_storeu_si256 ( (__m256i *) (d1+2*x),
+        		    _mm256_permute2x128_si256 ( c1, c2, 0x20 ) );
+      _mm256_storeu_si256 ( (__m256i *) (d1+2*x+8),
+        		    _mm256_permute2x128_si256 ( c1, c2, 0x31 ) );
+    }
+  for ( ; x < 256; ++x )
+    scale2x_pixel ( B, E, H, x, d0, d1 );
+
+} /* end scale2x_line_avx2 */
+#endif
+
+
+/* Scale3x del píxel X de la línia E, amb B la línia de dalt i H la de
+   baix. D0, D1 i D2 són les tres línies de l'eixida. */
+static void
+scale3x_pixel (
+               const int *B,
+               const int *E,
+               const int *H,
+               const int  x,
+               int       *d0,
+               int       *d1,
+               int       *d2
+               )
+{
+
+  int a, b, c, d, e, f, g, h, i;
+
+
+  b= B[x]; e= E[x]; h= H[x];
+  if ( x > 0 ) { a= B[x-1]; d= E[x-1]; g= H[x-1]; }
+  else { a= b; d= e; g= h; }
+  if ( x < 255 ) { c= B[x+1]; f= E[x+1]; i= H[x+1]; }
+  else { c= b; f= e; i= h; }
+  d0+= 3*x; d1+= 3*x; d2+= 3*x;
+  if ( b != h && d != f )
+    {
+      d0[0]= d == b ? d : e;
+      d0[1]= (d == b && e != c) || (b == f && e != a) ? b : e;
+      d0[2]= b == f ? f : e;
+      d1[0]= (d == b && e != g) || (d == h && e != a) ? d : e;
+      d1[1]= e;
+      d1[2]= (b == f && e != i) || (h == f && e != c) ? f : e;
+      d2[0]= d == h ? d : e;
+      d2[1]= (d == h && e != i) || (h == f && e != g) ? h : e;
+      d2[2]= h == f ? f : e;
+    }
+  else
+    {
+      d0[0]= d0[1]= d0[2]= e;
+      d1[0]= d1[1]= d1[2]= e;
+      d2[0]= d2[1]= d2[2]= e;
+    }
+
+} /* end scale3x_pixel */
+
+
+static void
+scale3x_line (
+              const int *B,
+              const int *E,
+              const int *H,
+              int       *d0,
+              int       *d1,
+              int       *d2
+              )
+{
+
+  int x;
+
+
+  for ( x= 0; x < 256; ++x )
+    scale3x_pixel ( B, E, H, x, d0, d1, d2 );
+
+} /* end scale3x_line */
+
+
+#ifdef USE_AVX2
+/* Intercala els píxels de S0, S1 i S2 (S0[0] S1[0] S2[0] S0[1] ...) en
+   DST. */
+static void TARGET_AVX2
+store3_avx2 (
+             const __m256i  s0,
+             const __m256i  s1,
+             const __m256i  s2,
+             int           *dst
+             )
+{
+
+  __m256i v;
+
+
+  v= _mm256_blend_epi32 (
+         _mm256_permutevar8x32_epi32 (
+             s0, _mm256_setr_epi32 ( 0, 0, 0, 1, 0, 0, 2, 0 ) ),
+         _mm256_permutevar8x32_epi32 (
+             s1, _mm256_setr_epi32 ( 0, 0, 0, 0, 1, 0, 0, 2 ) ),
+         0x92 );
+  v= _mm256_blend_epi32 (
+         v,
+         _mm256_permutevar8x32_epi32 (
+             s2, _mm256_setr_epi32 ( 0, 0, 0, 0, 0, 1, 0, 0 ) ),
+         0x24 );
+  _mm256_storeu_si256 ( (__m256i *) dst, v );
+  v= _mm256_blend_epi32 (
+         _mm256_permutevar8x32_epi32 (
+             s0, _mm256_setr_epi32 ( 0, 3, 0, 0, 4, 0, 0, 5 ) ),
+         _mm256_permutevar8x32_epi32 (
+             s1, _mm256_setr_epi32 ( 0, 0, 3, 0, 0, 4, 0, 0 ) ),
+         0x24 );
+  v= _mm256_blend_epi32 (
+         v,
+         _mm256_permutevar8x32_epi32 (
+             s2, _mm256_setr_epi32 ( 2, 0, 0, 3, 0, 0, 4, 0 ) ),
+         0x49 );
+  _mm256_storeu_si256 ( (__m256i *) (dst+8), v );
+  v= _mm256_blend_epi32 (
+         _mm256_permutevar8x32_epi32 (
+             s0, _mm256_setr_epi32 ( 0, 0, 6, 0, 0, 7, 0, 0 ) ),
+         _mm256_permutevar8x32_epi32 (
+             s1, _mm256_setr_epi32 ( 5, 0, 0, 6, 0, 0, 7, 0 ) ),
+         0x49 );
+  v= _mm256_blend_epi32 (
+         v,
+         _mm256_permutevar8x32_epi32 (
+             s2, _mm256_setr_epi32 ( 0, 5, 0, 0, 6, 0, 0, 7 ) ),
+         0x92 );
+  _mm256_storeu_si256 ( (__m256i *) (dst+16), v );
+
+} /* end store3_avx2 */
+
+
+static void TARGET_AVX2
+scale3x_line_avx2 (
+        	   const int *B,
+        	   const int *E,
+        	   const int *H,
+        	   int       *d0,
+        	   int       *d1,
+        	   int       *d2
+        	   )
+{
+
+  int x;
+  __m256i va, vb, vc, vd, ve, vf, vg, vh, vi, db, bf, dh, hf, c, t;
+
+
+  /* Els píxels 1-248 de 8 en 8, la resta amb la versió genèrica. */
+  scale3x_pixel ( B, E, H, 0, d0, d1, d2 );
+  for ( x= 1; x+8 <= 255; x+= 8 )
+    {
+      va= _mm256_loadu_si256 ( (const __m256i *) (B+x-1) );
+      vb= _mm256_loadu_si256 ( (const __m256i *) (B+x) );
+      vc= _mm256_loadu_si256 ( (const __m256i *) (B+x+1) );
+      vd= _mm256_loadu_si256 ( (const __m256i *) (E+x-1) );
+      ve= _mm256_loadu_si256 ( (const __m256i *) (E+x) );
+      vf= _mm256_loadu_si256 ( (const __m256i *) (E+x+1) );
+      vg= _mm256_loadu_si256 ( (const __m256i *) (H+x-1) );
+      vh= _mm256_loadu_si256 ( (const __m256i *) (H+x) );
+      vi= _mm256_loadu_si256 ( (const __m256i *) (H+x+1) );
+      /* c: B!=H && D!=F. Les igualtats ja inclouen c. */
+      c= _mm256_andnot_si256 ( _mm256_or_si256 ( _mm256_cmpeq_epi32 ( vb, vh ),
+        					 _mm256_cmpeq_epi32 ( vd, vf ) ),
+        		       _mm256_set1_epi32 ( -1 ) );
+      db= _mm256_and_si256 ( c, _mm256_cmpeq_epi32 ( vd, vb ) );
+      bf= _mm256_and_si256 ( c, _mm256_cmpeq_epi32 ( vb, vf ) );
+      dh= _mm256_and_si256 ( c, _mm256_cmpeq_epi32 ( vd, vh ) );
+      hf= _mm256_and_si256 ( c, _mm256_cmpeq_epi32 ( vh, vf ) );
+      /* Línia 0. */
+      t= _mm256_or_si256 (
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, vc ), db ),
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, va ), bf ) );
+      store3_avx2 ( _mm256_blendv_epi8 ( ve, vd, db ),
+        	    _mm256_blendv_epi8 ( ve, vb, t ),
+        	    _mm256_blendv_epi8 ( ve, vf, bf ),
+        	    d0+3*x );
+      /* Línia 1. */
+      t= _mm256_or_si256 (
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, vg ), db ),
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, va ), dh ) );
+      c= _mm256_or_si256 (
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, vi ), bf ),
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, vc ), hf ) );
+      store3_avx2 ( _mm256_blendv_epi8 ( ve, vd, t ),
+        	    ve,
+        	    _mm256_blendv_epi8 ( ve, vf, c ),
+        	    d1+3*x );
+      /* Línia 2. */
+      t= _mm256_or_si256 (
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, vi ), dh ),
+             _mm256_andnot_si256 ( _mm256_cmpeq_epi32 ( ve, vg ), hf ) );
+      store3_avx2 ( _mm256_blendv_epi8 ( ve, vd, dh ),
+        	    _mm256_blendv_epi8 ( ve, vh, t ),
+        	    _mm256_blendv_epi8 ( ve, vf, hf ),
+        	    d2+3*x );
+    }
+  for ( ; x < 256; ++x )
+    scale3x_pixel ( B, E, H, x, d0, d1, d2 );
+
+} /* end scale3x_line_avx2 */
+#endif
+
+
+/* Senyal normalitzada ([0,1] entre negre i blanc) que genera la PPU
+   per al color P en la fase PH de la subportadora. */
+static float
+ntsc_level (
+            const int p,
+            const int ph
+            )
+{
+
+  int color, level, emph;
+  float lo, hi, v;
+
+
+  color= p&0x0F;
+  level= color > 13 ? 1 : (p>>4)&0x3;
+  emph= (p>>6)&0x7;
+  lo= _ntsc_lo[level];
+  hi= _ntsc_hi[level];
+  if ( color == 0 ) lo= hi;
+  else if ( color > 12 ) hi= lo;
+  v= ((color+ph)%NTSC_SPC < 6) ? hi : lo;
+  if ( color < 0x0E &&
+       (((emph&0x1) && ph%NTSC_SPC < 6) ||
+        ((emph&0x2) && (ph+4)%NTSC_SPC < 6) ||
+        ((emph&0x4) && (ph+8)%NTSC_SPC < 6)) )
+    v*= NTSC_ATT;
+
+  return (v-NTSC_BLACK)/(NTSC_WHITE-NTSC_BLACK);
+
+} /* end ntsc_level */
+
+
+static void
+ntsc_init_tables (void)
+{
+
+  int p, ph;
+  float v;
+
+
+  for ( p= 0; p < NES_PALETTE_SIZE; ++p )
+    for ( ph= 0; ph < 2*NTSC_SPC; ++ph )
+      {
+        v= ntsc_level ( p, ph%NTSC_SPC );
+        _ntsc_y[p][ph]= v;
+        _ntsc_i[p][ph]= v*_ntsc_cos[ph%NTSC_SPC];
+        _ntsc_q[p][ph]= v*_ntsc_sin[ph%NTSC_SPC];
+      }
+
+} /* end ntsc_init_tables */
+
+
+/* Genera la senyal de la línia SRC, que comença en la fase OFF. */
+static void
+ntsc_signal (
+             const int   *src,
+             const int    off,
+             NTSCSignal  *sig
+             )
+{
+
+  int x, k, n, ph, p;
+
+
+  for ( k= 0; k < NTSC_SPC/2; ++k )
+    {
+      n= k;
+      sig->y[n&3][n>>2]= sig->i[n&3][n>>2]= sig->q[n&3][n>>2]= 0.0f;
+      n= NTSC_LEN-1-k;
+      sig->y[n&3][n>>2]= sig->i[n&3][n>>2]= sig->q[n&3][n>>2]= 0.0f;
+    }
+  for ( x= 0, ph= off; x < 256; ++x )
+    {
+      p= src[x];
+      for ( k= 0; k < NTSC_SPP; ++k )
+        {
+          n= NTSC_SPC/2 + x*NTSC_SPP + k;
+          sig->y[n&3][n>>2]= _ntsc_y[p][ph+k];
+          sig->i[n&3][n>>2]= _ntsc_i[p][ph+k];
+          sig->q[n&3][n>>2]= _ntsc_q[p][ph+k];
+        }
+      ph+= NTSC_SPP;
+      if ( ph >= NTSC_SPC ) ph-= NTSC_SPC;
+    }
+
+} /* end ntsc_signal */
+
+
+static NESu8
+ntsc_clamp (
+            const float v
+            )
+{
+
+  if ( v <= 0.0f ) return 0;
+  if ( v >= 1.0f ) return 255;
+  return (NESu8) (v*255.0f+0.5f);
+
+} /* end ntsc_clamp */
+
+
+/* Descodifica un cicle al voltant del centre de cada mig píxel. El tap
+   K de la columna X és la mostra X*4+2+K. */
+static void
+ntsc_decode (
+             const NTSCSignal *sig,
+             NES_Color        *dst
+             )
+{
+
+  float y, i, q;
+  int x, k, j;
+
+
+  for ( x= 0; x < NES_POST_NTSC_COLS; ++x )
+    {
+      y= i= q= 0.0f;
+      for ( k= 0; k < NTSC_SPC; ++k )
+        {
+          j= x + ((k+NTSC_SPP/4)>>2);
+          y+= sig->y[(k+NTSC_SPP/4)&3][j];
+          i+= sig->i[(k+NTSC_SPP/4)&3][j];
+          q+= sig->q[(k+NTSC_SPP/4)&3][j];
+        }
+      y/= NTSC_SPC;
+      dst[x].r= ntsc_clamp ( y + 0.946882f*i + 0.623557f*q );
+      dst[x].g= ntsc_clamp ( y - 0.274788f*i - 0.635691f*q );
+      dst[x].b= ntsc_clamp ( y - 1.108545f*i + 1.709007f*q );
+    }
+
+} /* end ntsc_decode */
+
+
+#ifdef USE_AVX2
+/* Com 'ntsc_clamp' per a 8 valors. */
+static __m256i TARGET_AVX2
+ntsc_clamp_avx2 (
+        	 const __m256 v
+        	 )
+{
+
+  __m256 t;
+
+
+  t= _mm256_min_ps ( _mm256_max_ps ( v, _mm256_setzero_ps () ),
+        	     _mm256_set1_ps ( 1.0f ) );
+  t= _mm256_add_ps ( _mm256_mul_ps ( t, _mm256_set1_ps ( 255.0f ) ),
+        	     _mm256_set1_ps ( 0.5f ) );
+
+  return _mm256_cvttps_epi32 ( t );
+
+} /* end ntsc_clamp_avx2 */
+
+
+/* Com 'ntsc_decode' però 8 columnes de colp, sumant els taps en el
+   mateix ordre. */
+static void TARGET_AVX2
+ntsc_decode_avx2 (
+        	  const NTSCSignal *sig,
+        	  NES_Color        *dst
+        	  )
+{
+
+  __m256 y, i, q, v;
+  int x, k, j, r, n;
+  int rgb[3][8];
+
+
+  for ( x= 0; x < NES_POST_NTSC_COLS; x+= 8 )
+    {
+      y= i= q= _mm256_setzero_ps ();
+      for ( k= 0; k < NTSC_SPC; ++k )
+        {
+          j= x + ((k+NTSC_SPP/4)>>2);
+          r= (k+NTSC_SPP/4)&3;
+          y= _mm256_add_ps ( y, _mm256_loadu_ps ( &(sig->y[r][j]) ) );
+          i= _mm256_add_ps ( i, _mm256_loadu_ps ( &(sig->i[r][j]) ) );
+          q= _mm256_add_ps ( q, _mm256_loadu_ps ( &(sig->q[r][j]) ) );
+        }
+      y= _mm256_div_ps ( y, _mm256_set1_ps ( (float) NTSC_SPC ) );
+      v= _mm256_add_ps ( y, _mm256_mul_ps ( _mm256_set1_ps ( 0.946882f ), i ) );
+      v= _mm256_add_ps ( v, _mm256_mul_ps ( _mm256_set1_ps ( 0.623557f ), q ) );
+      _mm256_storeu_si256 ( (__m256i *) rgb[0], ntsc_clamp_avx2 ( v ) );
+      v= _mm256_sub_ps ( y, _mm256_mul_ps ( _mm256_set1_ps ( 0.274788f ), i ) );
+      v= _mm256_sub_ps ( v, _mm256_mul_ps ( _mm256_set1_ps ( 0.635691f ), q ) );
+      _mm256_storeu_si256 ( (__m256i *) rgb[1], ntsc_clamp_avx2 ( v ) );
+      v= _mm256_sub_ps ( y, _mm256_mul_ps ( _mm256_set1_ps ( 1.108545f ), i ) );
+      v= _mm256_add_ps ( v, _mm256_mul_ps ( _mm256_set1_ps ( 1.709007f ), q ) );
+      _mm256_storeu_si256 ( (__m256i *) rgb[2], ntsc_clamp_avx2 ( v ) );
+      for ( n= 0; n < 8; ++n )
+        {
+          dst[x+n].r= (NESu8) rgb[0][n];
+          dst[x+n].g= (NESu8) rgb[1][n];
+          dst[x+n].b= (NESu8) rgb[2][n];
+        }
+    }
+
+} /* end ntsc_decode_avx2 */
+#endif
+
+
+
+
+/**********************/
+/* FUNCIONS PÚBLIQUES */
+/**********************/
+
+void
+NES_post_nearest (
+        	  const int  fb[61440],
+        	  const int  begin,
+        	  const int  end,
+        	  const int  factor,
+        	  int       *dst
+        	  )
+{
+
+  int y, k, cols;
+  int *p;
+  void (*line) (const int *,const int,int *);
+
+
+  line= nearest_line;
+#ifdef USE_AVX2
+  if ( HAS_AVX2 ) line= nearest_line_avx2;
+#endif
+  cols= 256*factor;
+  for ( y= begin; y < end; ++y )
+    {
+      p= dst + y*factor*cols;
+      line ( &(fb[y<<8]), factor, p );
+      for ( k= 1; k < factor; ++k )
+        memcpy ( p+k*cols, p, sizeof(int)*cols );
+    }
+
+} /* end NES_post_nearest */
+
+
+void
+NES_post_scalex (
+        	 const int  fb[61440],
+        	 const int  begin,
+        	 const int  end,
+        	 const int  factor,
+        	 int       *dst
+        	 )
+{
+
+  int y, cols;
+  const int *B, *E, *H;
+  int *p;
+  void (*line2) (const int *,const int *,const int *,int *,int *);
+  void (*line3) (const int *,const int *,const int *,int *,int *,int *);
+
+
+  line2= scale2x_line;
+  line3= scale3x_line;
+#ifdef USE_AVX2
+  if ( HAS_AVX2 )
+    {
+      line2= scale2x_line_avx2;
+      line3= scale3x_line_avx2;
+    }
+#endif
+  cols= 256*factor;
+  for ( y= begin; y < end; ++y )
+    {
+      E= &(fb[y<<8]);
+      B= y > 0 ? E-256 : E;
+      H= y < 239 ? E+256 : E;
+      p= dst + y*factor*cols;
+      if ( factor == 3 ) line3 ( B, E, H, p, p+cols, p+2*cols );
+      else               line2 ( B, E, H, p, p+cols );
+    }
+
+} /* end NES_post_scalex */
+
+
+void
+NES_post_ntsc (
+               const int  fb[61440],
+               const int  begin,
+               const int  end,
+               const int  phase,
+               NES_Color *dst
+               )
+{
+
+  int y;
+  NTSCSignal sig;
+  void (*decode) (const NTSCSignal *,NES_Color *);
+
+
+  pthread_once ( &_ntsc_once, ntsc_init_tables );
+  decode= ntsc_decode;
+#ifdef USE_AVX2
+  if ( HAS_AVX2 ) decode= ntsc_decode_avx2;
+#endif
+
+  /* Cada línia dura 341*8 mostres, que són 4 fases més que un número
+     sencer de cicles de la subportadora. */
+  for ( y= begin; y < end; ++y )
+    {
+      ntsc_signal ( &(fb[y<<8]), ((phase+y)*4)%NTSC_SPC, &sig );
+      decode ( &sig, &(dst[y*NES_POST_NTSC_COLS]) );
+    }
+
+} /* end NES_post_ntsc */
@@ -21,15 +21,22 @@
  *          unitat mínima de renderitzat és la línia, es a dir quan es
  *          tenen els cicles necessaris per a una línia es renderitza
  *          de colp. Per tant els canvis a meitat de línia no es tenen
- *          en compter.
+ *          en compter. Per als títols que ho necessiten hi ha un
+ *          segon motor que executa la PPU cicle a cicle.
  *
  */
 
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
 #include "NES.h"
 #include "mappers/mmc2.h"
 #include "mappers/mmc3.h"
@@ -41,6 +48,11 @@
 /* MACROS */
 /**********/
 
+#ifdef USE_AVX2
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#define HAS_AVX2 __builtin_cpu_supports ( "avx2" )
+#endif
+
 #define SAVE(VAR)                                               \
   if ( fwrite ( &(VAR), sizeof(VAR), 1, f ) != 1 ) return -1
 
@@ -65,12 +77,14 @@
 #define CHECK_S0C (_status&0x40)
 
 
-#define CLOCK              \
-  clock ()
+#define CLOCK                                                   \
+  do {                                                          \
+    if ( _timing.ccs >= _timing.ccs_to_sync ) clock ();         \
+  } while(0)
 
 
-#define COLOR_PF(COLOR) ((_palettes[(COLOR)]&_aux.pbitmap)|_aux.emph)
-#define COLOR_OBJ(COLOR) ((_palettes[0x10|(COLOR)]&_aux.pbitmap)|_aux.emph)
+#define LCOLOR_PF(COLOR) ((pal[(COLOR)]&pbitmap)|emph)
+#define LCOLOR_OBJ(COLOR) ((pal[0x10|(COLOR)]&pbitmap)|emph)
 
 
 #define READ_NT_PF_COUNTERS(NT,COUNTS)        			\
@@ -121,6 +135,40 @@
 
 #define MIN(A,B) (((A)<(B))?(A):(B))
 
+/* Cicles que A12 ha d'estar a 0 perquè el MMC3 compte una pujada. */
+#define DOT_A12_DELAY 10
+
+/* Màxim número de flancs de A12 que compten en una línia. */
+#define MMC3_MAX_DOTS 10
+
+/* Cicles de UCP que dura el DMA de la memòria d'objectes: 256
+   lectures i 256 escriptures més un cicle d'espera. Falta un altre
+   cicle d'espera si comença en un cicle imparell, però no es porta
+   compte de la paritat dels cicles. */
+#define DMA_CC 513
+
+/* Constants del hash. Les línies es processen en 8 carrils
+   independents de 32 bits, que el compilador pot vectoritzar. */
+#define HASH_LANES 8
+#define HASH_MUL32 0x9E3779B1U
+#define HASH_SEED 0xCBF29CE484222325ULL
+#define HASH_MUL64 0x100000001B3ULL
+
+/* Cert si la línia Y del 'frame buffer' apareix en l'observació. */
+#define OBS_SAMPLED(Y) (_obs.first[(Y)+1] != _obs.first[(Y)])
+
+/* Valor de '_mmc3.ccs_to_end' quan no s'espera cap IRQ. */
+#define MMC3_NO_IRQ INT_MAX
+
+#define PFCACHE_KEY                                     \
+  (_regs.FH |                                           \
+   (_counters.HT<<3) |                                  \
+   (_counters.H<<8) |                                   \
+   ((_regs.S>>12)<<9) |                                 \
+   ((_aux.pf_clipping?1:0)<<10) |                       \
+   ((_render.atr[0]>>2)<<11) |                          \
+   ((_render.atr[1]>>2)<<13))
+
 #define MMC2_SAVE_STATE(IND)        				\
   do {        							\
     if ( _mmc2.enabled )        				\
@@ -222,7 +270,6 @@ static struct
   NES_Bool  size16;         /* Els objectes en STM són d'altura 16. */
   NESu8     stm[32];        /* 'Sprite Temporary Memory'. */
   NESu8     pf[256];        /* 'Playfield'. */
-  int       map[16];        /* Mapeja els atributs. */
   NESu8     obj[256];       /* Línia dels objectes. */
   NESu8     objpri[256];    /* Prioritat dels objectes. */
   int       s0c_pos[8];     /* Posicions de la línia on hi han píxels
@@ -262,6 +309,9 @@ static struct
   int ccperline_s1;    /* Cicles totals necessaris per al pas 1. */
   int twoCC;          /* Dos cicles de UCP en cicles de rellotge. */
   int cputocc;        /* Passa de cicles de UCP a ppu. */
+  int ccs_to_sync;    /* Mentre 'ccs' no arribe a aquest valor,
+        		 'clock' no canvia res i els accessos als
+        		 registres no necessiten cridar-lo. */
   
 } _timing;
 
@@ -290,18 +340,39 @@ static struct
  *
  * LA MEUA APROXIMACIÓ:
  *
- *  - Ignorar la configuració de les pattern tables i sprites.
- *  - Cridar al rellotge al final de la secció 1 de cada línia (approx
- *    cicle 256)
- *  - Creuar els dits.
+ *  - En el motor per línies, quan s'avaluen els sprites d'una línia
+ *    (cicle 256) o al començar la línia 'pre-render', es calcula a
+ *    partir de les 'pattern tables' del fons i dels sprites (i del
+ *    tile de cada sprite en 8x16) en quins cicles de la línia hi haurà
+ *    un flanc de pujada de A12 que el MMC3 comptarà, seguint l'ordre
+ *    de lectures del 2C02 i el filtre de DOT_A12_DELAY cicles. El
+ *    comptador es rellotja en eixos cicles.
+ *  - També es compten els flancs que provoquen $2006 i $2007.
+ *  - Amb el número de flancs que falten per a la IRQ es calcula quan
+ *    s'activarà ('ccs_to_end'), i la PPU sols s'actualitza abans si
+ *    ho demana la UCP. Cada vegada que canvia la configuració de la
+ *    PPU o el MMC3 es torna a calcular. En 8x16 els flancs depenen
+ *    dels sprites de cada línia i no es calcula més enllà de la
+ *    pròxima línia.
+ *  - El motor cicle a cicle detecta els flancs en les lectures que fa
+ *    i s'actualitza sempre.
  *
  */
 static struct
 {
 
-  int      ccs_to_first_clock;
-  int      ccs_to_end;
+  int      ccs_to_end;     /* Cicles, des del principi de la línia
+        		      actual, fins que s'activa la IRQ. */
   NES_Bool enabled;
+  NES_Bool irq;            /* Estat de la línia IRQ del MMC3. */
+  NES_Bool predicted;      /* 'dots' correspon a la línia actual. */
+  int      dots[MMC3_MAX_DOTS]; /* Cicles de la línia actual amb un
+        			   flanc que compta. */
+  int      ndots;
+  int      next;           /* Següent flanc de 'dots'. */
+  int      nslots;         /* Sprites avaluats per a la línia actual. */
+  NESu8    tiles[8];       /* Tiles dels sprites avaluats (8x16). */
+  NES_Bool a12;            /* Últim valor de A12 en el bus. */
   
 } _mmc3;
 
@@ -313,6 +384,209 @@ static struct
   
 } _mmc2;
 
+/* Descart de frames. En un frame descartat no es generen els píxels,
+ * però es fa tot allò que el programa pot observar: la col·lisió del
+ * sprite 0, el desbordament de sprites, les lectures de VRAM que
+ * canvien l'estat del mapper (MMC2) i el rellotge del MMC3.
+ */
+static struct
+{
+
+  int      nframes;      /* Frames a descartar per cada frame
+        		    renderitzat. */
+  int      counter;      /* Frames descartats des de l'últim
+        		    renderitzat. */
+  NES_Bool on_demand;    /* Sols es renderitzen els frames
+        		    demanats. */
+  NES_Bool requested;    /* S'ha demanat renderitzar el pròxim
+        		    frame. */
+  NES_Bool render;       /* El frame actual es renderitza. */
+  
+} _fskip;
+
+/* Renderitzat ajornat. Es guarden les línies llegides en un frame i,
+ * al acabar, es passen al 'frontend' per a que les dibuixe quan
+ * vullga (per exemple en altres fils) amb 'NES_ppu_render_lines'. Hi
+ * han dos frames per a poder dibuixar un mentre s'omple l'altre.
+ */
+static struct
+{
+  
+  NES_PPUFrameReady *frame_ready;
+  void              *udata;
+  NES_PPUFrame       frames[2];
+  int                current;
+  
+} _deferred;
+
+/* Seguiment dels canvis en el 'frame buffer'. */
+static struct
+{
+  
+  NES_Bool      enabled;
+  NES_PPUDamage info;
+  int           last_y;      /* Última línia que ha canviat. */
+  
+} _damage;
+
+/* Finestra visible. Són les files i columnes que es retallen de cada
+ * costat. Fora de la finestra no es combinen els píxels (el 'frame
+ * buffer' conserva el que tenia), però es fa tot allò que el programa
+ * pot observar, igual que en els frames descartats.
+ */
+static struct
+{
+  
+  int top,bottom;
+  int left,right;
+  
+} _window;
+
+/* Hash del 'frame buffer'. */
+static struct
+{
+  
+  NES_Bool enabled;
+  NESu64   lines[240];
+  NESu64   current;        /* Hash parcial del frame actual. */
+  NESu64   frame;          /* Hash de l'últim frame. */
+  
+} _hash;
+
+/* Estat semàntic del frame. Es genera en 'cur' i es copia en 'out'
+ * al acabar el frame. De cada sprite es guarda com estava la primera
+ * vegada que ha aparegut.
+ */
+static struct
+{
+  
+  NES_Bool       enabled;
+  NES_PPUTileMap cur;
+  NES_PPUTileMap out;
+  NESu8          seen[64];
+  NESu8          oam[64][4];
+  
+} _tmap;
+
+/* Observació reduïda. Les files de l'observació associades a la línia
+ * Y de la imatge són [first[Y],first[Y+1][.
+ */
+static struct
+{
+  
+  int              width,height;     /* 0 desactivada. */
+  NES_PPUObsFormat format;
+  NES_Bool         only;             /* Sols es combinen les línies
+        				que apareixen. */
+  int              cols[256];        /* Columna de la imatge de cada
+        				columna de l'observació. */
+  int              first[241];
+  int              grey[NES_PALETTE_SIZE];
+  NESu32           rgb[NES_PALETTE_SIZE]; /* R | G<<8 | B<<16. */
+  NES_Bool         avx2;             /* Es mostreja amb AVX2. */
+  NESu8            data[256*240*3];
+  
+} _obs;
+
+/* Vistes de depuració. Es guarda el tile i la paleta que s'ha dibuixat
+ * en cada cel·la de les taules de noms, i la memòria d'objectes i les
+ * paletes amb què s'han dibuixat els sprites, per a saber què cal
+ * tornar a dibuixar. Com el 'mirroring' el controla el mapper, una
+ * escriptura en una taula de noms marca la mateixa cel·la en les
+ * quatre.
+ */
+static struct
+{
+  
+  NES_Bool     enabled;
+  NES_Bool     all;               /* Cal dibuixar-ho tot. */
+  NESu8        pt_dirty[512];     /* Tiles modificats. */
+  NESu8        nt_dirty[960];     /* Cel·les modificades. */
+  NESu8        nt_tile[4][960];
+  NESu8        nt_pal[4][960];
+  NESu8        palettes[32];
+  NESu8        obj_ram[256];
+  NESu16       S;
+  int          obj_pt;
+  NES_Bool     obj_size16;
+  int          pt_palette;
+  NES_PPUViews views;
+  
+} _views;
+
+/* Cache de línies del fons. Una línia del fons sols depén dels
+ * comptadors i registres al començar, del 'clipping' i del contingut
+ * de la VRAM. Cada vegada que canvia el contingut visible de la VRAM
+ * s'incrementa la versió, i totes les entrades amb una versió
+ * anterior deixen de ser vàlides. Cada entrada correspon a una
+ * combinació de V, VT i FV, la resta de valors formen la clau. No
+ * s'utilitza amb el MMC2 perquè llegir els patrons canvia els bancs.
+ */
+typedef struct
+{
+  
+  NESu32   version;         /* 0 vol dir entrada buida. */
+  NESu32   key;
+  NESu32   regs;            /* p0 i p1 al començar. */
+  NESu8    tiles[32][3];
+  NES_Bool has_pf;          /* 'pf' està calculat. */
+  NESu8    pf[256];
+  
+} pfcache_entry_t;
+
+static struct
+{
+  
+  NESu32           version;
+  pfcache_entry_t  entries[512];
+  pfcache_entry_t *entry;     /* Entrada de la línia actual, NULL si
+        			 no s'utilitza. */
+  
+} _pfcache;
+
+/* Línia que s'està renderitzant. */
+static NES_PPULine _line;
+
+/* Motor utilitzat. */
+static NES_PPUEngine _engine;
+
+/* Estat del motor cicle a cicle. Comparteix la resta de l'estat
+ * ('_regs', '_counters', '_aux', ...) amb el motor per línies.
+ * Segueix la numeració habitual de les línies: 0-239 visibles, 240
+ * 'post-render', el VBlank comença en la 241 i l'última és la
+ * 'pre-render'.
+ */
+static struct
+{
+  
+  int      line;           /* Línia actual. */
+  int      dot;            /* Següent cicle de la línia (0-340). */
+  int      prerender;      /* Número de la línia 'pre-render'. */
+  NESu8    nt,at;          /* Últim tile llegit del fons. */
+  NESu8    pl,ph;
+  NESu16   bg_lo,bg_hi;    /* Registres de desplaçament del fons. */
+  NESu16   at_lo,at_hi;    /* Registres de desplaçament dels
+        		      atributs. */
+  NESu8    soam[32];       /* 'Secondary OAM'. */
+  int      nspr;           /* Sprites de la pròxima línia (o de
+        		      l'actual abans del cicle 257). */
+  NES_Bool s0_line;        /* El sprite 0 està entre ells. */
+  NESu8    spr_x[8];       /* Sprites llegits, en ordre de */
+  NESu8    spr_attr[8];    /* prioritat i amb el 'flip' */
+  NESu8    spr_lo[8];      /* horitzontal ja aplicat. */
+  NESu8    spr_hi[8];
+  NESu32   count;          /* Cicles executats. */
+  NES_Bool a12;            /* Últim valor de A12 en el bus. */
+  NESu32   a12_fall;       /* Cicle en què A12 va passar a 0. */
+  int      dmg_first;      /* Primera i última columna que han */
+  int      dmg_last;       /* canviat en la línia actual. */
+  
+} _dot;
+
+/* Mapeja els atributs. */
+static const int _atr_map[16]=
+  {0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1};
+
 /* Memòria. */
 static NESu8 _palettes[32];
 static NESu8 _obj_ram[256];
@@ -420,10 +694,6 @@ init_render (void)
   _render.size16= NES_FALSE;
   memset ( &(_render.stm[0]), 0, 32 );
   memset ( &(_render.pf[0]), 0, 256 );
-  for ( i= 0; i < 8; ++i )
-    _render.map[i]= 0;
-  for ( ; i < 16; ++i )
-    _render.map[i]= 1;
   memset ( _render.obj, 0, 256 );
   memset ( _render.objpri, BACK, 256 );
   memset ( _render.s0c_pos, 0, sizeof(int)*8 );
@@ -432,6 +702,9 @@ init_render (void)
   _render.current_pos= 0;
   _render.NMI_occurred= NES_TRUE;
   _render.sline_step= 0;
+  _fskip.render= NES_TRUE;
+  _fskip.counter= _fskip.nframes;
+  _fskip.requested= NES_FALSE;
   
 } /* end init_render */
 
@@ -460,6 +733,7 @@ init_timing (void)
   _timing.ccs_to_end= _timing.ccperframe;
   _timing.ccperline_s0= 240*_timing.pputocc;
   _timing.ccperline_s1= 256*_timing.pputocc;
+  _timing.ccs_to_sync= 0;
   
 } /* end init_timing */
 
@@ -578,6 +852,90 @@ init_pf (void)
 } /* end init_pf */
 
 
+/* Apunta el sprite P, avaluat en la línia actual. */
+static void
+tmap_obj (
+          const NESu8 *p
+          )
+{
+  
+  int i;
+  
+  
+  i= (p-&(_obj_ram[0]))>>2;
+  if ( _tmap.seen[i] ) return;
+  _tmap.seen[i]= 1;
+  memcpy ( _tmap.oam[i], p, 4 );
+  
+} /* end tmap_obj */
+
+
+/* Apunta els tiles de la fila R. Es crida al principi de la línia del
+   centre de la fila, quan els comptadors ja han avançat els dos tiles
+   que es lligen al final de la línia anterior. Sols llig les taules de
+   noms, que no tenen efectes laterals en cap mapper. */
+static void
+tmap_row (
+          const int r
+          )
+{
+  
+  int c, ht, h, shift;
+  NESu16 nt;
+  NESu8 atr;
+  
+  
+  _tmap.cur.pt[r]= (_regs.S != 0);
+  _tmap.cur.pf[r]= _aux.enable_pf;
+  for ( c= 0; c < 32; ++c )
+    {
+      /* Tile que es veu en el píxel 8c+4. */
+      ht= (int) _counters.HT + c + ((4+_regs.FH)>>3) - 2;
+      h= _counters.H;
+      if ( ht < 0 ) { ht+= 32; h^= 0x1; }
+      else if ( ht >= 32 ) { ht-= 32; h^= 0x1; }
+      nt= 0x2000 | (((_counters.V<<1)|h)<<10);
+      _tmap.cur.tiles[r][c]=
+        NES_mapper_vram_read ( nt|(_counters.VT<<5)|ht );
+      atr= NES_mapper_vram_read ( nt|0x3C0|((_counters.VT&0x1C)<<1)|(ht>>2) );
+      shift= ((_counters.VT&0x2)|((ht&0x2)>>1))<<1;
+      _tmap.cur.palettes[r][c]= (atr>>shift)&0x3;
+    }
+  
+} /* end tmap_row */
+
+
+/* Tanca el frame actual. */
+static void
+tmap_end_frame (void)
+{
+  
+  NES_PPUTileMapObj *o;
+  const NESu8 *p;
+  int i;
+  
+  
+  _tmap.cur.size16= _aux.obj_size16;
+  _tmap.cur.obj_pt= (_aux.obj_pt != 0);
+  _tmap.cur.nobjs= 0;
+  for ( i= 0; i < 64; ++i )
+    if ( _tmap.seen[i] )
+      {
+        p= _tmap.oam[i];
+        o= &(_tmap.cur.objs[_tmap.cur.nobjs++]);
+        o->index= (NESu8) i;
+        o->y= p[0];
+        o->tile= p[1];
+        o->palette= p[2]&0x3;
+        o->flags= p[2]&0xE0;
+        o->x= p[3];
+      }
+  memcpy ( &_tmap.out, &_tmap.cur, sizeof(_tmap.out) );
+  memset ( _tmap.seen, 0, sizeof(_tmap.seen) );
+  
+} /* end tmap_end_frame */
+
+
 /* 'In-range object evaluation' de la pròxima línia. Es suposa que
  * '_render.scounter' és 0.
  */
@@ -598,11 +956,19 @@ render_obj_ioe (
   p= &(_obj_ram[0]);
   end= p + 256;
   diff= CALC_DIFF;
-  if ( (_render.s0c_flag= (diff < diff2)) ) { INSERT_STM; }
+  if ( (_render.s0c_flag= (diff < diff2)) )
+    {
+      INSERT_STM;
+      if ( _tmap.enabled ) tmap_obj ( p );
+    }
   for ( p+= 4; _render.scounter < 8 && p != end; p+= 4 )
     {
       diff= CALC_DIFF;
-      if ( diff < diff2 ) { INSERT_STM; }
+      if ( diff < diff2 )
+        {
+          INSERT_STM;
+          if ( _tmap.enabled ) tmap_obj ( p );
+        }
     }
   if ( _render.scounter == 8 ) _status|= 0x20;
   
@@ -667,27 +1033,26 @@ render_obj_s0c (void)
 } /* end render_obj_s0c */
 
 
+/* Llig els patrons dels sprites de la línia actual (els que estan en
+   la STM) i els guarda en L. Deixa el comptador de sprites a 0. */
 static void
-render_obj (void)
+fetch_obj (
+           NES_PPULine *l
+           )
 {
   
-  NESu8 *p, b0, b1, colorh, pri, colorl;
-  int pt, aux, x, end, i;
-  NESu8 b1s[8],b0s[8];
-
+  NESu8 *p;
+  int pt, aux, i;
   
-  if ( !_aux.enable_obj ) return;
   
-  /* Renderitza línia actual. */
   MMC2_SAVE_STATE ( 0 );
-
+  
   /* NOTA!!! L'ordre de lectura de VRAM és important per al mapper
      MMC2. Aparentment (no estic 100% ssegur) el primer en llegir-se
-     és sempre el sprite 0. Però com per a renderitzar gaste
-     l'algorisme del pintor, el que faig es guardar-me abans en uns
-     buffer els bytes de VRAM necessaris. */
+     és sempre el sprite 0. Per això es llegeixen en l'ordre de la
+     STM, encara que després es dibuixen a l'inrevés. */
   p= &(_render.stm[0]);
-  for ( i= 0; i < _render.scounter; ++i )
+  for ( i= 0; i < _render.scounter; ++i, p+= 4 )
     {
       if ( _render.size16 )
         {
@@ -699,46 +1064,59 @@ render_obj (void)
           pt= _aux.obj_pt;
           aux= (*p<<4) | p[3];
         }
-      b0s[i]= NES_mapper_vram_read ( pt|aux );
-      b1s[i]= NES_mapper_vram_read ( pt|aux|0x8 );
-      p+= 4;
+      l->objs[i][0]= p[1];
+      l->objs[i][1]= p[2];
+      l->objs[i][2]= NES_mapper_vram_read ( pt|aux );
+      l->objs[i][3]= NES_mapper_vram_read ( pt|aux|0x8 );
+    }
+  l->nobjs= _render.scounter;
+  _render.scounter= 0;
+  MMC2_SAVE_STATE ( 1 );
+  
+  _render.s0c_N= 0;
+  if ( !CHECK_S0C && _render.s0c_flag )
+    {
+      MMC2_LOAD_STATE ( 0 ); /* <-- Com si estaguerem al principi */
+      render_obj_s0c ();
+      MMC2_LOAD_STATE ( 1 ); /* <-- Tornem a l'estat que toca. */
     }
+  
+} /* end fetch_obj */
 
-  /* Dibuixa. */
-  memset ( &(_render.obj[0]), 0, 256 );
-  p= &(_render.stm[0])+(_render.scounter<<2);
-  while ( _render.scounter != 0 )
+
+/* Dibuixa els sprites d'una línia. Sols depén de L. */
+static void
+expand_obj (
+            const NES_PPULine *l,
+            NESu8              obj[256],
+            NESu8              objpri[256]
+            )
+{
+  
+  const NESu8 *p;
+  NESu8 b0, b1, colorh, pri, colorl;
+  int x, end, i;
+  
+  
+  /* Algorisme del pintor, del últim al primer. */
+  memset ( obj, 0, 256 );
+  for ( i= l->nobjs-1; i >= 0; --i )
     {
-      p-= 4;
-      --_render.scounter;
-      /*
-      if ( _render.size16 )
-        {
-          pt= (*p&0x1)!=0 ? 0x1000 : 0x0000;
-          aux= ((*p&0xfe)<<4) | ((p[3]&0x8)<<1) | (p[3]&0x7);
-        }
-      else
-        {
-          pt= _aux.obj_pt;
-          aux= (*p<<4) | p[3];
-        }
-      b0= NES_mapper_vram_read ( pt|aux );
-      b1= NES_mapper_vram_read ( pt|aux|0x8 );
-      */
-      b0= b0s[_render.scounter];
-      b1= b1s[_render.scounter];
-      x= p[1];
+      p= l->objs[i];
+      x= p[0];
+      b0= p[2];
+      b1= p[3];
       end= MIN(256,x+8);
-      colorh= (p[2]&0x3)<<2;
-      pri= p[2]&0x20;
-      if ( p[2]&0x40 )
+      colorh= (p[1]&0x3)<<2;
+      pri= p[1]&0x20;
+      if ( p[1]&0x40 )
         for ( ; x < end; ++x )
           {
             colorl= ((b1&0x1)<<1)|(b0&0x1);
             if ( colorl != 0 )
               {
-                _render.obj[x]= colorh | colorl;
-                _render.objpri[x]= pri;
+                obj[x]= colorh | colorl;
+                objpri[x]= pri;
               }
             b1>>= 1; b0>>= 1;
           }
@@ -748,27 +1126,17 @@ render_obj (void)
             colorl= ((b1&0x80)>>6)|((b0&0x80)>>7);
             if ( colorl != 0 )
               {
-                _render.obj[x]= colorh | colorl;
-                _render.objpri[x]= pri;
+                obj[x]= colorh | colorl;
+                objpri[x]= pri;
               }
             b1<<= 1; b0<<= 1;
           }
     }
-  MMC2_SAVE_STATE ( 1 );
-  
-  _render.s0c_N= 0;
-  if ( !CHECK_S0C && _render.s0c_flag )
-    {
-      MMC2_LOAD_STATE ( 0 ); /* <-- Com si estaguerem al principi */
-      render_obj_s0c ();
-      MMC2_LOAD_STATE ( 1 ); /* <-- Tornem a l'estat que toca. */
-    }
-  else _render.s0c_N= 0;
   
-  if ( _aux.obj_clipping )
-    memset ( &(_render.obj[0]), 0, 8 );
+  if ( l->flags&NES_PPU_LINE_OBJ_CLIPPING )
+    memset ( obj, 0, 8 );
   
-} /* end render_obj */
+} /* end expand_obj */
 
 
 static void
@@ -784,39 +1152,49 @@ render_obj_dummy (
 } /* end render_obj_dummy */
 
 
+/* Versió de 'fetch_obj' per als frames descartats. Sols calcula les
+   posicions on es pot produir la col·lisió del sprite 0. */
 static void
-render_pf (void)
+render_obj_skip (void)
 {
   
-  NESu16 mask, NT;
-  NESu8 *p, PAR;
-  unsigned desp;
-  int i, j, k;
+  if ( !_aux.enable_obj ) return;
+  _render.scounter= 0;
+  _render.s0c_N= 0;
+  if ( !CHECK_S0C && _render.s0c_flag )
+    render_obj_s0c ();
   
+} /* end render_obj_skip */
+
+
+/* Llig de la VRAM els 32 tiles del fons de la línia actual i els
+   guarda en L, junt amb l'estat dels registres de patrons. Deixa els
+   comptadors i els registres igual que si s'haguera dibuixat. */
+static void
+fetch_pf (
+          NES_PPULine *l
+          )
+{
   
-  if ( !_aux.enable_pf ) return;
+  NESu16 NT;
+  NESu8 PAR;
+  int i;
   
-  mask= 0x8000>>_regs.FH;
-  p= &(_render.pf[0]);
-  desp= 15-_regs.FH;
+  
+  l->FH= _regs.FH;
+  l->p0= _render.p0;
+  l->p1= _render.p1;
+  l->atr[0]= _render.atr[0];
+  l->atr[1]= _render.atr[1];
   for ( i= 0; i < 32; ++i )
     {
       
-      /* Dibuixa tile. */
-      for ( j= 0, k= _regs.FH; j < 8;
-            ++j, ++k, ++p, _render.p0<<= 1, _render.p1<<= 1 )
-        *p=
-          ((_render.p0&mask)>>desp) |
-          (((_render.p1&mask)>>desp)<<1) |
-          _render.atr[_render.map[k]];
-      
       /* Llig memòria. */
       NT= CALC_NT ( _counters );
       PAR= READ_NT_PF ( NT );
-      _render.atr[0]= _render.atr[1];
-      _render.atr[1]= GET_ATR ( NT );
-      _render.p0|= GET_P0 ( PAR );
-      _render.p1|= GET_P1 ( PAR );
+      l->tiles[i][2]= GET_ATR ( NT );
+      l->tiles[i][0]= GET_P0 ( PAR );
+      l->tiles[i][1]= GET_P1 ( PAR );
       
       /* Actualitza comptadors. */
       if ( ++_counters.HT == 32 )
@@ -827,10 +1205,139 @@ render_pf (void)
       
     }
   
-  if ( _aux.pf_clipping )
-    memset ( &(_render.pf[0]), 0, 8 );
+  /* En els registres queden els dos últims tiles. */
+  _render.p0= (((NESu16) l->tiles[30][0])<<8) | l->tiles[31][0];
+  _render.p1= (((NESu16) l->tiles[30][1])<<8) | l->tiles[31][1];
+  _render.atr[0]= l->tiles[30][2];
+  _render.atr[1]= l->tiles[31][2];
+  
+} /* end fetch_pf */
+
+
+static void
+pfcache_invalidate (void)
+{
+  
+  if ( ++_pfcache.version == 0 )
+    {
+      memset ( _pfcache.entries, 0, sizeof(_pfcache.entries) );
+      _pfcache.version= 1;
+    }
+  
+} /* end pfcache_invalidate */
+
+
+/* Igual que 'fetch_pf' però si la línia està en la cache no llig la
+   VRAM. */
+static void
+fetch_pf_cached (
+        	 NES_PPULine *l
+        	 )
+{
+  
+  pfcache_entry_t *e;
+  NESu32 key, regs;
+  
+  
+  if ( _mmc2.enabled )
+    {
+      _pfcache.entry= NULL;
+      fetch_pf ( l );
+      return;
+    }
+  
+  e= &(_pfcache.entries[(_counters.V<<8)|(_counters.VT<<3)|_counters.FV]);
+  key= PFCACHE_KEY;
+  regs= (((NESu32) _render.p0)<<16) | _render.p1;
+  _pfcache.entry= e;
+  if ( e->version == _pfcache.version && e->key == key && e->regs == regs )
+    {
+      l->FH= _regs.FH;
+      l->p0= _render.p0;
+      l->p1= _render.p1;
+      l->atr[0]= _render.atr[0];
+      l->atr[1]= _render.atr[1];
+      memcpy ( l->tiles, e->tiles, sizeof(l->tiles) );
+      _counters.H^= 0x1; /* 32 tiles. */
+      _render.p0= (((NESu16) l->tiles[30][0])<<8) | l->tiles[31][0];
+      _render.p1= (((NESu16) l->tiles[30][1])<<8) | l->tiles[31][1];
+      _render.atr[0]= l->tiles[30][2];
+      _render.atr[1]= l->tiles[31][2];
+    }
+  else
+    {
+      fetch_pf ( l );
+      e->version= _pfcache.version;
+      e->key= key;
+      e->regs= regs;
+      memcpy ( e->tiles, l->tiles, sizeof(e->tiles) );
+      e->has_pf= NES_FALSE;
+    }
+  
+} /* end fetch_pf_cached */
+
+
+/* Dibuixa el fons d'una línia. Sols depén de L. */
+static void
+expand_pf (
+           const NES_PPULine *l,
+           NESu8              pf[256]
+           )
+{
+  
+  NESu16 mask, p0, p1;
+  NESu8 *p, atr[2];
+  unsigned desp;
+  int i, j, k;
+  
+  
+  mask= 0x8000>>l->FH;
+  desp= 15-l->FH;
+  p0= l->p0; p1= l->p1;
+  atr[0]= l->atr[0]; atr[1]= l->atr[1];
+  p= &(pf[0]);
+  for ( i= 0; i < 32; ++i )
+    {
+      for ( j= 0, k= l->FH; j < 8; ++j, ++k, ++p, p0<<= 1, p1<<= 1 )
+        *p=
+          ((p0&mask)>>desp) |
+          (((p1&mask)>>desp)<<1) |
+          atr[_atr_map[k]];
+      atr[0]= atr[1];
+      atr[1]= l->tiles[i][2];
+      p0|= l->tiles[i][0];
+      p1|= l->tiles[i][1];
+    }
+  
+  if ( l->flags&NES_PPU_LINE_PF_CLIPPING )
+    memset ( pf, 0, 8 );
+  
+} /* end expand_pf */
+
+
+/* Igual que 'expand_pf' però per a la línia actual, fent ús de la
+   cache. */
+static void
+expand_pf_cached (
+        	  const NES_PPULine *l,
+        	  NESu8              pf[256]
+        	  )
+{
+  
+  pfcache_entry_t *e;
+  
+  
+  e= _pfcache.entry;
+  if ( e == NULL ) expand_pf ( l, pf );
+  else if ( e->has_pf ) memcpy ( pf, e->pf, 256 );
+  else
+    {
+      expand_pf ( l, pf );
+      memcpy ( e->pf, pf, 256 );
+      e->has_pf= NES_TRUE;
+    }
   
-} /* end render_pf */
+} /* end expand_pf_cached */
 
 
 /* Renderitza una línia per a la comprobació de la col·lissió amb el
@@ -920,80 +1427,778 @@ render_pf_dummy (void)
 } /* end render_pf_dummy */
 
 
+/* Versió de 'fetch_pf' per als frames descartats. Deixa els
+   comptadors i els registres interns igual que 'fetch_pf', però sols
+   llig els dos últims tiles, que són els que queden en els
+   registres. */
 static void
-render_line (void)
+render_pf_skip (void)
 {
   
+  NESu16 NT;
+  NESu8 PAR;
   int i;
-  NESu8 color_pf, color_obj, color;
   
   
-  if ( _aux.enable_pf )
+  if ( !_aux.enable_pf ) return;
+  _counters.HT+= 30;
+  if ( _counters.HT >= 32 )
+    {
+      _counters.HT-= 32;
+      _counters.H^= 0x1;
+    }
+  for ( i= 0; i < 2; ++i )
+    {
+      NT= CALC_NT ( _counters );
+      PAR= READ_NT_PF ( NT );
+      _render.atr[0]= _render.atr[1];
+      _render.atr[1]= GET_ATR ( NT );
+      _render.p0= (_render.p0<<8) | GET_P0 ( PAR );
+      _render.p1= (_render.p1<<8) | GET_P1 ( PAR );
+      if ( ++_counters.HT == 32 )
+        {
+          _counters.HT= 0;
+          _counters.H^= 0x1;
+        }
+    }
+  
+} /* end render_pf_skip */
+
+
+/* Combina el fons i els sprites dels píxels [BEGIN,END[ d'una línia
+   i escriu els colors en DST. Sols depén dels arguments. */
+static void
+compose_line (
+              const NES_PPULine *l,
+              const NESu8        pf[256],
+              const NESu8        obj[256],
+              const NESu8        objpri[256],
+              const int          begin,
+              const int          end,
+              int               *dst
+              )
+{
+  
+  int i, emph;
+  NESu8 color_pf, color_obj, color, pbitmap;
+  const NESu8 *pal;
+  
+  
+  pal= l->palettes;
+  pbitmap= l->pbitmap;
+  emph= l->emph;
+  if ( l->flags&NES_PPU_LINE_PF )
     {
-      if ( _aux.enable_obj )
+      if ( l->flags&NES_PPU_LINE_OBJ )
         {
-          for ( i= 0; i < 256; ++i, ++_render.p )
+          for ( i= begin; i < end; ++i )
             {
-              color_pf= _render.pf[i];
+              color_pf= pf[i];
               if ( (color_pf&0x3) == 0 ) color_pf= 0;
-              color_obj= _render.obj[i];
-              *_render.p=
-                ((_render.objpri[i]==0 || color_pf==0) && color_obj!=0) ?
-                COLOR_OBJ ( color_obj ) :
-                COLOR_PF ( color_pf );
+              color_obj= obj[i];
+              dst[i]=
+                ((objpri[i]==0 || color_pf==0) && color_obj!=0) ?
+                LCOLOR_OBJ ( color_obj ) :
+                LCOLOR_PF ( color_pf );
             }
         }
       else
         {
-          for ( i= 0; i < 256; ++i, ++_render.p )
+          for ( i= begin; i < end; ++i )
             {
-              color= _render.pf[i];
-              *_render.p= COLOR_PF ( color&0x3?color:0 );
+              color= pf[i];
+              dst[i]= LCOLOR_PF ( color&0x3?color:0 );
             }
         }
     }
   else
     {
-      if ( _aux.enable_obj )
+      if ( l->flags&NES_PPU_LINE_OBJ )
         {
-          for ( i= 0; i < 256; ++i, ++_render.p )
+          for ( i= begin; i < end; ++i )
             {
-              color= _render.obj[i];
-              *_render.p= (color == 0) ?
-                COLOR_PF ( 0 ) :
-                COLOR_OBJ ( color );
+              color= obj[i];
+              dst[i]= (color == 0) ?
+                LCOLOR_PF ( 0 ) :
+                LCOLOR_OBJ ( color );
             }
         }
       else
         {
-          for ( i= 0; i < 256; ++i, ++_render.p )
-            *_render.p= COLOR_PF ( 0 );
+          for ( i= begin; i < end; ++i )
+            dst[i]= LCOLOR_PF ( 0 );
         }
     }
   
-} /* end render_line */
+} /* end compose_line */
 
 
+/* Llig tot allò que afecta als píxels de la línia actual. */
 static void
-scanline_s0 (void)
+fetch_line (
+            NES_PPULine *l
+            )
 {
   
-  render_pf ();
-  render_obj ();
-  render_line ();
+  memcpy ( l->palettes, _palettes, sizeof(_palettes) );
+  l->pbitmap= _aux.pbitmap;
+  l->emph= (NESu8) _aux.emph;
+  l->flags=
+    (_aux.enable_pf ? NES_PPU_LINE_PF : 0) |
+    (_aux.enable_obj ? NES_PPU_LINE_OBJ : 0) |
+    (_aux.pf_clipping ? NES_PPU_LINE_PF_CLIPPING : 0) |
+    (_aux.obj_clipping ? NES_PPU_LINE_OBJ_CLIPPING : 0);
+  l->nobjs= 0;
+  if ( _aux.enable_pf ) fetch_pf_cached ( l );
+  if ( _aux.enable_obj ) fetch_obj ( l );
   
-} /* end scanline_s0 */
+} /* end fetch_line */
 
 
+/* Dibuixa una línia ja llegida. */
 static void
-scanline_s1 (void)
+draw_line (
+           const NES_PPULine *l,
+           NESu8              pf[256],
+           NESu8              obj[256],
+           NESu8              objpri[256],
+           int               *dst
+           )
 {
   
-  render_obj_ioe ( _render.sline );
-  if ( _aux.enable_pf && _aux.enable_obj )
+  if ( l->flags&NES_PPU_LINE_PF ) expand_pf ( l, pf );
+  if ( l->flags&NES_PPU_LINE_OBJ ) expand_obj ( l, obj, objpri );
+  compose_line ( l, pf, obj, objpri, 0, 256, dst );
+  
+} /* end draw_line */
+
+
+/* Dibuixa en DST les columnes de la finestra de la línia actual. */
+static void
+draw_current_line (
+        	   int *dst
+        	   )
+{
+  
+  if ( _line.flags&NES_PPU_LINE_PF ) expand_pf_cached ( &_line, _render.pf );
+  if ( _line.flags&NES_PPU_LINE_OBJ )
+    expand_obj ( &_line, _render.obj, _render.objpri );
+  compose_line ( &_line, _render.pf, _render.obj, _render.objpri,
+        	 _window.left, 256-_window.right, dst );
+  
+} /* end draw_current_line */
+
+
+/* Llig la línia actual però no la dibuixa. Sols es dibuixa el fons si
+   fa falta per a la col·lisió del sprite 0. */
+static void
+fetch_line_nodraw (
+        	   NES_PPULine *l
+        	   )
+{
+  
+  fetch_line ( l );
+  if ( (l->flags&NES_PPU_LINE_PF) && (l->flags&NES_PPU_LINE_OBJ) &&
+       _render.s0c_N > 0 )
+    expand_pf_cached ( l, _render.pf );
+  _render.p+= 256;
+  
+} /* end fetch_line_nodraw */
+
+
+/* Barreja final de 64 bits (splitmix64). */
+static NESu64
+hash_mix (
+          NESu64 h
+          )
+{
+  
+  h^= h>>30; h*= 0xBF58476D1CE4E5B9ULL;
+  h^= h>>27; h*= 0x94D049BB133111EBULL;
+  h^= h>>31;
+  
+  return h;
+  
+} /* end hash_mix */
+
+
+/* Calcula el hash de la línia Y del 'frame buffer' i l'acumula en el
+   del frame. */
+static void
+hash_line (
+           const int y
+           )
+{
+  
+  NESu32 acc[HASH_LANES];
+  const int *p;
+  NESu64 h;
+  int i, k;
+  
+  
+  p= &(_render.fb[y<<8]);
+  for ( k= 0; k < HASH_LANES; ++k )
+    acc[k]= (NESu32) (HASH_SEED>>(k<<2));
+  for ( i= 0; i < 256; i+= HASH_LANES )
+    for ( k= 0; k < HASH_LANES; ++k )
+      {
+        acc[k]= (acc[k]^(NESu32) p[i+k])*HASH_MUL32;
+        acc[k]^= acc[k]>>15;
+      }
+  h= HASH_SEED;
+  for ( k= 0; k < HASH_LANES; ++k )
+    h= (h^acc[k])*HASH_MUL64;
+  h= hash_mix ( h );
+  _hash.lines[y]= h;
+  _hash.current= (_hash.current^h)*HASH_MUL64;
+  
+} /* end hash_line */
+
+
+/* Calcula quines files i columnes de la imatge es mostregen dins de
+   la finestra visible. */
+static void
+obs_map (void)
+{
+  
+  int i, y, rows, cols, top;
+  
+  
+  top= _window.top;
+  rows= 240-_window.top-_window.bottom;
+  cols= 256-_window.left-_window.right;
+  for ( i= 0; i < _obs.width; ++i )
+    _obs.cols[i]= _window.left + ((2*i+1)*cols)/(2*_obs.width);
+  for ( y= 0, i= 0; y <= 240; ++y )
+    {
+      _obs.first[y]= i;
+      while ( i < _obs.height &&
+              top + ((2*i+1)*rows)/(2*_obs.height) == y )
+        ++i;
+    }
+  
+} /* end obs_map */
+
+
+#ifdef USE_AVX2
+/* Mostreja SRC en DST de 8 en 8 columnes amb dos 'gathers' (l'índex
+   de color i el color). Torna el número de columnes fetes. */
+static int TARGET_AVX2
+obs_sample_avx2 (
+        	 const int *src,
+        	 NESu8     *dst
+        	 )
+{
+  
+  int i;
+  __m256i v, sel, shuf;
+  NESu8 tmp[32];
+  
+  
+  if ( _obs.format == NES_PPU_OBS_GREY )
+    {
+      sel= _mm256_setr_epi32 ( 0, 4, 0, 0, 0, 0, 0, 0 );
+      for ( i= 0; i+8 <= _obs.width; i+= 8 )
+        {
+          v= _mm256_loadu_si256 ( (const __m256i *) &(_obs.cols[i]) );
+          v= _mm256_i32gather_epi32 ( src, v, 4 );
+          v= _mm256_i32gather_epi32 ( _obs.grey, v, 4 );
+          v= _mm256_packus_epi32 ( v, v );
+          v= _mm256_packus_epi16 ( v, v );
+          v= _mm256_permutevar8x32_epi32 ( v, sel );
+          _mm_storel_epi64 ( (__m128i *) &(dst[i]),
+        		     _mm256_castsi256_si128 ( v ) );
+        }
+    }
+  else
+    {
+      /* Cada meitat deixa els seus 4 píxels en 12 bytes seguits. */
+      shuf= _mm256_setr_epi8 ( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+        		       -1, -1, -1, -1,
+        		       0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+        		       -1, -1, -1, -1 );
+      for ( i= 0; i+8 <= _obs.width; i+= 8 )
+        {
+          v= _mm256_loadu_si256 ( (const __m256i *) &(_obs.cols[i]) );
+          v= _mm256_i32gather_epi32 ( src, v, 4 );
+          v= _mm256_i32gather_epi32 ( (const int *) _obs.rgb, v, 4 );
+          v= _mm256_shuffle_epi8 ( v, shuf );
+          _mm256_storeu_si256 ( (__m256i *) tmp, v );
+          memcpy ( &(dst[3*i]), tmp, 12 );
+          memcpy ( &(dst[3*i+12]), tmp+16, 12 );
+        }
+    }
+  
+  return i;
+  
+} /* end obs_sample_avx2 */
+#endif
+
+
+/* Mostreja la línia Y del 'frame buffer' en les files de
+   l'observació que li corresponen. */
+static void
+obs_line (
+          const int y
+          )
+{
+  
+  const int *src;
+  NESu8 *dst;
+  int i, j, n, c;
+  
+  
+  if ( !OBS_SAMPLED ( y ) ) return;
+  src= &(_render.fb[y<<8]);
+  n= _obs.format == NES_PPU_OBS_GREY ? _obs.width : 3*_obs.width;
+  dst= &(_obs.data[_obs.first[y]*n]);
+  i= 0;
+#ifdef USE_AVX2
+  if ( _obs.avx2 ) i= obs_sample_avx2 ( src, dst );
+#endif
+  if ( _obs.format == NES_PPU_OBS_GREY )
+    for ( ; i < _obs.width; ++i )
+      dst[i]= (NESu8) _obs.grey[src[_obs.cols[i]]];
+  else
+    for ( ; i < _obs.width; ++i )
+      {
+        c= src[_obs.cols[i]];
+        dst[3*i]= NES_ppu_palette[c].r;
+        dst[3*i+1]= NES_ppu_palette[c].g;
+        dst[3*i+2]= NES_ppu_palette[c].b;
+      }
+  for ( j= _obs.first[y]+1; j < _obs.first[y+1]; ++j )
+    memcpy ( dst+(j-_obs.first[y])*n, dst, n );
+  
+} /* end obs_line */
+
+
+/* Afegeix als canvis del frame els píxels [X0,X1] de la línia Y. */
+static void
+damage_add (
+            const int y,
+            const int x0,
+            const int x1
+            )
+{
+  
+  NES_PPURect *r;
+  int aux;
+  
+  
+  _damage.info.lines[y>>5]|= 1U<<(y&0x1F);
+  
+  /* Si és la continuació de l'últim rectangle, o ja no queden, es fa
+     créixer l'últim. */
+  if ( _damage.info.nrects > 0 &&
+       (_damage.last_y == y-1 ||
+        _damage.info.nrects == NES_PPU_MAX_DAMAGE_RECTS) )
+    {
+      r= &(_damage.info.rects[_damage.info.nrects-1]);
+      if ( x0 < r->x ) { r->width+= r->x-x0; r->x= x0; }
+      aux= x1-r->x+1;
+      if ( aux > r->width ) r->width= aux;
+      r->height= y-r->y+1;
+    }
+  else
+    {
+      r= &(_damage.info.rects[_damage.info.nrects++]);
+      r->x= x0; r->y= y;
+      r->width= x1-x0+1;
+      r->height= 1;
+    }
+  _damage.last_y= y;
+  
+} /* end damage_add */
+
+
+/* Dibuixa la línia actual comparant-la amb el que hi havia en el
+   'frame buffer'. */
+static void
+draw_line_damage (void)
+{
+  
+  int line[256], first, last, end;
+  
+  
+  draw_current_line ( line );
+  end= 256-_window.right;
+  for ( first= _window.left;
+        first < end && line[first] == _render.p[first];
+        ++first );
+  if ( first == end ) return;
+  for ( last= end-1; line[last] == _render.p[last]; --last );
+  memcpy ( _render.p+first, line+first, sizeof(int)*(last-first+1) );
+  damage_add ( _render.sline-1, first, last );
+  
+} /* end draw_line_damage */
+
+
+/* Calcula a partir de quants cicles pendents 'clock' farà alguna
+   cosa: el següent pas de la línia actual, el següent flanc de A12
+   del MMC3 o, si pot haver col·lisió del sprite 0, qualsevol
+   cicle. Fins eixe moment l'estat que modifiquen els registres no es
+   llig, i és igual aplicar les escriptures abans que després de
+   posar al dia la PPU. */
+static void
+update_sync (void)
+{
+  
+  int sync;
+  
+  
+  if ( _engine == NES_PPU_DOT )
+    {
+      _timing.ccs_to_sync= _timing.pputocc;
+      return;
+    }
+  if ( _render.sline == -1 ) sync= _timing.ccpervblank;
+  else if ( _render.sline == 0 )
+    sync=
+      _timing.oddframe && _timing.isNTSC ?
+      _timing.ccperline-_timing.pputocc :
+      _timing.ccperline;
+  else if ( _render.sline == 241 || _render.sline_step == 2 )
+    sync= _timing.ccperline;
+  else if ( _render.s0c_flag && !CHECK_S0C && _render.current_pos < 256 )
+    sync= 0;
+  else if ( _render.sline_step == 0 ) sync= _timing.ccperline_s0;
+  else sync= _timing.ccperline_s1;
+  if ( _mmc3.enabled && _mmc3.next < _mmc3.ndots )
+    sync= MIN ( sync, (_mmc3.dots[_mmc3.next]+1)*_timing.pputocc );
+  _timing.ccs_to_sync= sync;
+  
+} /* end update_sync */
+
+
+/* Simula les lectures de patrons de la PPU en una línia (cicles
+   1-336) i apunta en DOTS els cicles on hi ha un flanc de pujada de
+   A12 que compta el MMC3. A12 i FALL són el valor de A12 al principi
+   de la línia i el cicle (relatiu a la línia) on va baixar per última
+   vegada. NSLOTS és el número d'sprites de '_mmc3.tiles', sols
+   s'utilitza en 8x16. Torna el número de flancs. Igual que el motor
+   cicle a cicle, no es tenen en compte les lectures dels cicles
+   337-340, per tant al final de la línia A12 té el valor de
+   '_regs.S'. */
+static int
+mmc3_predict (
+              int            dots[MMC3_MAX_DOTS],
+              const int      nslots,
+              NES_Bool       a12,
+              int            fall
+              )
+{
+  
+  int dot, slot, n;
+  NES_Bool lvl;
+  
+  
+  n= 0;
+  for ( dot= 1; dot < 337; dot+= 2 )
+    {
+      
+      /* Sprites: dos lectures de la 'name table' i dos de patrons. */
+      if ( dot >= 257 && dot < 321 )
+        {
+          slot= (dot-257)>>3;
+          if ( ((dot-257)&7) < 4 ) lvl= NES_FALSE;
+          else if ( !_aux.obj_size16 ) lvl= (_aux.obj_pt != 0);
+          else lvl= slot < nslots ? (_mmc3.tiles[slot]&0x1) : NES_TRUE;
+        }
+      
+      /* Fons: 'name table', atributs i dos de patrons. */
+      else lvl= (((dot-1)&7) >= 4) && _regs.S != 0;
+      
+      if ( lvl && !a12 )
+        {
+          if ( dot-fall >= DOT_A12_DELAY && n < MMC3_MAX_DOTS )
+            dots[n++]= dot;
+        }
+      else if ( !lvl && a12 ) fall= dot;
+      a12= lvl;
+      
+    }
+  
+  return n;
+  
+} /* end mmc3_predict */
+
+
+/* Calcula quan s'activarà la IRQ del MMC3. */
+static void
+mmc3_update_deadline (void)
+{
+  
+  int n, k, kpre, line, cc, dots[MMC3_MAX_DOTS], dotspre[MMC3_MAX_DOTS];
+  
+  
+  _mmc3.irq= NES_mapper_mmc3_check_irq ();
+  if ( _engine == NES_PPU_DOT )
+    {
+      _mmc3.ccs_to_end= 0;
+      return;
+    }
+  _mmc3.ccs_to_end= MMC3_NO_IRQ;
+  n= NES_mapper_mmc3_clocks_to_irq ();
+  if ( _mmc3.irq || n <= 0 ) return;
+  
+  /* Flancs pendents de la línia actual. */
+  if ( _mmc3.predicted )
+    {
+      if ( _mmc3.ndots-_mmc3.next >= n )
+        {
+          _mmc3.ccs_to_end= (_mmc3.dots[_mmc3.next+n-1]+1)*_timing.pputocc;
+          return;
+        }
+      n-= _mmc3.ndots-_mmc3.next;
+    }
+  if ( !(_aux.enable_pf || _aux.enable_obj) ) return;
+  
+  /* Primera línia sense calcular i cicles fins al seu principi. */
+  if ( _render.sline == -1 )
+    { line= 0; cc= _timing.ccpervblank; }
+  else if ( _render.sline == 241 )
+    { line= 0; cc= _timing.ccperline + _timing.ccpervblank; }
+  else if ( _render.sline == 0 )
+    {
+      line= 1;
+      cc= _timing.oddframe && _timing.isNTSC ?
+        _timing.ccperline-_timing.pputocc : _timing.ccperline;
+    }
+  else if ( !_mmc3.predicted ) { line= _render.sline; cc= 0; }
+  else if ( _render.sline == 240 )
+    { line= 0; cc= 2*_timing.ccperline + _timing.ccpervblank; }
+  else { line= _render.sline+1; cc= _timing.ccperline; }
+  
+  /* En 8x16 els flancs depenen dels sprites de cada línia, es torna a
+     calcular quan s'avaluen. */
+  if ( _aux.obj_size16 )
+    {
+      _mmc3.ccs_to_end= line == 0 ? cc : cc+_timing.ccperline_s1;
+      return;
+    }
+  
+  /* Línies futures. Per a la línia 'pre-render' es suposa la duració
+     més curta. */
+  k= mmc3_predict ( dots, 0, _regs.S != 0, -DOT_A12_DELAY );
+  kpre= mmc3_predict ( dotspre, 0, _mmc3.a12, -DOT_A12_DELAY );
+  if ( k == 0 && kpre == 0 ) return;
+  for (;;)
+    if ( line == 0 )
+      {
+        if ( kpre >= n )
+          {
+            _mmc3.ccs_to_end= cc + (dotspre[n-1]+1)*_timing.pputocc;
+            return;
+          }
+        n-= kpre;
+        line= 1;
+        cc+= _timing.isNTSC ?
+          _timing.ccperline-_timing.pputocc : _timing.ccperline;
+      }
+    else if ( k >= n )
+      {
+        _mmc3.ccs_to_end= cc + (dots[n-1]+1)*_timing.pputocc;
+        return;
+      }
+    else
+      {
+        if ( k == 0 )
+          {
+            cc+= (240-line)*_timing.ccperline;
+            line= 240;
+          }
+        else n-= k;
+        if ( line == 240 )
+          {
+            line= 0;
+            cc+= 2*_timing.ccperline + _timing.ccpervblank;
+          }
+        else
+          {
+            ++line;
+            cc+= _timing.ccperline;
+          }
+      }
+  
+} /* end mmc3_update_deadline */
+
+
+/* Calcula els flancs de A12 de la línia actual amb els sprites de
+   '_mmc3.tiles'. */
+static void
+mmc3_predict_line (void)
+{
+  
+  _mmc3.predicted= NES_TRUE;
+  _mmc3.next= 0;
+  if ( !(_aux.enable_pf || _aux.enable_obj) ) _mmc3.ndots= 0;
+  else if ( _render.sline == 0 )
+    _mmc3.ndots= mmc3_predict ( _mmc3.dots, _mmc3.nslots,
+        			_mmc3.a12, -DOT_A12_DELAY );
+  else _mmc3.ndots= mmc3_predict ( _mmc3.dots, _mmc3.nslots,
+        			   _regs.S != 0, -DOT_A12_DELAY );
+  mmc3_update_deadline ();
+  update_sync ();
+  
+} /* end mmc3_predict_line */
+
+
+/* Apunta en '_mmc3.tiles' els sprites que s'han avaluat en la línia
+   actual. Com aquest motor va una línia avançat respecte al maquinari
+   i la línia 'pre-render' no avalua sprites, en la línia 240 (que en
+   el maquinari no llig sprites) s'utilitzen els de la línia 0. */
+static void
+mmc3_set_tiles (void)
+{
+  
+  const NESu8 *p, *end;
+  int i, diff, sline;
+  
+  
+  if ( _render.sline != 240 )
+    {
+      _mmc3.nslots= _render.scounter;
+      for ( i= 0; i < _mmc3.nslots; ++i )
+        _mmc3.tiles[i]= _render.stm[i<<2];
+      return;
+    }
+  sline= 0;
+  _mmc3.nslots= 0;
+  end= &(_obj_ram[256]);
+  for ( p= &(_obj_ram[0]); _mmc3.nslots < 8 && p != end; p+= 4 )
+    {
+      diff= CALC_DIFF;
+      if ( diff < 16 ) _mmc3.tiles[_mmc3.nslots++]= p[1];
+    }
+  
+} /* end mmc3_set_tiles */
+
+
+/* Torna a calcular els flancs que queden en la línia actual després
+   d'un canvi de configuració. */
+static void
+mmc3_repredict_line (void)
+{
+  
+  if ( _engine != NES_PPU_LINE ) return;
+  if ( !_mmc3.predicted )
+    {
+      mmc3_update_deadline ();
+      return;
+    }
+  mmc3_predict_line ();
+  while ( _mmc3.next < _mmc3.ndots &&
+          _timing.ccs >= (_mmc3.dots[_mmc3.next]+1)*_timing.pputocc )
+    ++_mmc3.next;
+  mmc3_update_deadline ();
+  
+} /* end mmc3_repredict_line */
+
+
+/* Rellotja el comptador del MMC3 amb els flancs de la línia actual
+   que ja han passat. Torna cert si no en queda cap. */
+static NES_Bool
+mmc3_clock_rises (void)
+{
+  
+  int old;
+  
+  
+  old= _mmc3.next;
+  while ( _mmc3.next < _mmc3.ndots &&
+          _timing.ccs >= (_mmc3.dots[_mmc3.next]+1)*_timing.pputocc )
+    {
+      NES_mapper_mmc3_clock_counter ();
+      ++_mmc3.next;
+    }
+  if ( _mmc3.next != old ) mmc3_update_deadline ();
+  
+  return _mmc3.next == _mmc3.ndots;
+  
+} /* end mmc3_clock_rises */
+
+
+/* Al acabar una línia de CC cicles. */
+static void
+mmc3_end_line (
+               const int cc
+               )
+{
+  
+  if ( _mmc3.ccs_to_end != MMC3_NO_IRQ )
+    _mmc3.ccs_to_end-= cc;
+  if ( _mmc3.predicted && (_aux.enable_pf || _aux.enable_obj) )
+    _mmc3.a12= (_regs.S != 0);
+  _mmc3.predicted= NES_FALSE;
+  _mmc3.ndots= _mmc3.next= 0;
+  
+} /* end mmc3_end_line */
+
+
+/* En els frames descartats no es dibuixa la línia. Amb el MMC2 cal
+   llegir la VRAM en el mateix ordre que quan es renderitza. Sense
+   MMC2 sols es llig la línia quan fa falta per a la col·lisió del
+   sprite 0. */
+static void
+scanline_s0_skip (void)
+{
+  
+  if ( _mmc2.enabled ||
+       (_aux.enable_obj && _render.s0c_flag && !CHECK_S0C) )
+    fetch_line_nodraw ( &_line );
+  else
+    {
+      render_pf_skip ();
+      render_obj_skip ();
+      _render.p+= 256;
+    }
+  
+} /* end scanline_s0_skip */
+
+
+static void
+scanline_s0 (void)
+{
+  
+  if ( _tmap.enabled && ((_render.sline-1)&0x7) == 4 )
+    tmap_row ( (_render.sline-1)>>3 );
+  if ( !_fskip.render ) scanline_s0_skip ();
+  else if ( _deferred.frame_ready != NULL )
+    fetch_line_nodraw ( &(_deferred.frames[_deferred.current].
+        		  lines[_render.sline-1]) );
+  else if ( _render.sline <= _window.top ||
+            _render.sline > 240-_window.bottom ||
+            (_obs.only && !OBS_SAMPLED ( _render.sline-1 )) )
+    scanline_s0_skip ();
+  else
+    {
+      fetch_line ( &_line );
+      if ( _damage.enabled ) draw_line_damage ();
+      else draw_current_line ( _render.p );
+      _render.p+= 256;
+    }
+  if ( _fskip.render && _deferred.frame_ready == NULL )
+    {
+      if ( _hash.enabled ) hash_line ( _render.sline-1 );
+      if ( _obs.width != 0 ) obs_line ( _render.sline-1 );
+    }
+  
+} /* end scanline_s0 */
+
+
+static void
+scanline_s1 (void)
+{
+  
+  render_obj_ioe ( _render.sline );
+  if ( _aux.enable_pf && _aux.enable_obj )
     s0c_test ();
-  if ( _mmc3.enabled && (_aux.enable_pf || _aux.enable_obj) )
-    NES_mapper_mmc3_clock_counter ();
+  if ( _mmc3.enabled )
+    {
+      mmc3_set_tiles ();
+      mmc3_predict_line ();
+    }
   
 } /* end scanline_s1 */
 
@@ -1054,6 +2259,79 @@ s0c (
 } /* end s0c */
 
 
+/* Decideix si es renderitza el frame que comença. */
+static void
+fskip_new_frame (void)
+{
+  
+  if ( _fskip.on_demand )
+    {
+      _fskip.render= _fskip.requested;
+      _fskip.requested= NES_FALSE;
+    }
+  else if ( _fskip.counter >= _fskip.nframes )
+    {
+      _fskip.render= NES_TRUE;
+      _fskip.counter= 0;
+    }
+  else
+    {
+      _fskip.render= NES_FALSE;
+      ++_fskip.counter;
+    }
+  
+} /* end fskip_new_frame */
+
+
+/* Al acabar el VBlank (principi de la línia 'pre-render'). */
+static void
+frame_begin (void)
+{
+  
+  _render.p= &(_render.fb[0]);
+  if ( _aux.enable_pf || _aux.enable_obj )
+    _status&= 0x0F;
+  else _status&= 0x1F;
+  _render.NMI_occurred= NES_FALSE;
+  fskip_new_frame ();
+  if ( _damage.enabled && _fskip.render )
+    {
+      memset ( _damage.info.lines, 0, sizeof(_damage.info.lines) );
+      _damage.info.nrects= 0;
+      _damage.last_y= -2;
+    }
+  _hash.current= HASH_SEED;
+  
+} /* end frame_begin */
+
+
+/* Al començar el VBlank. */
+static void
+frame_end (void)
+{
+  
+  _status|= 0x90;
+  if ( _tmap.enabled ) tmap_end_frame ();
+  /* Amb el renderitzat ajornat no s'han calculat les línies. */
+  if ( _hash.enabled && _fskip.render )
+    _hash.frame= _deferred.frame_ready == NULL || _engine != NES_PPU_LINE ?
+      hash_mix ( _hash.current ) : 0;
+  if ( !_fskip.render ) ;
+  else if ( _deferred.frame_ready != NULL && _engine == NES_PPU_LINE )
+    {
+      _deferred.frame_ready ( &(_deferred.frames[_deferred.current]),
+        		      _deferred.udata );
+      _deferred.current^= 1;
+    }
+  else _update_screen ( &(_render.fb[0]), _udata );
+  
+  if ( _aux.NMI && !_render.NMI_occurred )
+    NES_cpu_NMI ();
+  _render.NMI_occurred= NES_TRUE;
+  
+} /* end frame_end */
+
+
 static int
 clock_lines (void)
 {
@@ -1068,6 +2346,7 @@ clock_lines (void)
         _timing.oddframe && _timing.isNTSC ?
         _timing.ccperline-_timing.pputocc :
         _timing.ccperline;
+      if ( _mmc3.enabled && !mmc3_clock_rises () ) return 1;
       if ( _timing.ccs < aux ) return 1;
       render_pf_dummy ();
       render_obj_dummy ( /*255*/0 );
@@ -1077,8 +2356,7 @@ clock_lines (void)
       scanline_s2 ();
       _timing.ccs-= aux;
       _timing.ccs_to_end-= aux;
-      if ( _mmc3.enabled )
-        _mmc3.ccs_to_end-= aux;
+      if ( _mmc3.enabled ) mmc3_end_line ( aux );
       ++_render.sline;
     }
   
@@ -1098,13 +2376,13 @@ clock_lines (void)
         _render.sline_step= 2;
         _render.current_pos= 0;
       case 2:
+        if ( _mmc3.enabled && !mmc3_clock_rises () ) return 1;
         if ( _timing.ccs < _timing.ccperline ) return 1;
         scanline_s2 ();
         _render.sline_step= 0;
         _timing.ccs-= _timing.ccperline;
         _timing.ccs_to_end-= _timing.ccperline;
-        if ( _mmc3.enabled )
-          _mmc3.ccs_to_end-= _timing.ccperline + _timing.ccperline_s1;
+        if ( _mmc3.enabled ) mmc3_end_line ( _timing.ccperline );
       }
   
   /* En la última línia no es fa absolutament res. */
@@ -1112,70 +2390,698 @@ clock_lines (void)
   if ( _timing.ccs < _timing.ccperline ) return 1;
   _timing.ccs-= _timing.ccperline;
   _timing.ccs_to_end-= _timing.ccperline;
-  /* ACTUALITZAR MMC3 ACÍ ÉS IRRELLEVANT. */
+  if ( _mmc3.enabled ) mmc3_end_line ( _timing.ccperline );
   ++_render.sline;
   
   return 0;
   
-} /* end clock_lines */
+} /* end clock_lines */
+
+
+static void
+dot_init (void)
+{
+  
+  _dot.line= 241;
+  _dot.dot= 2;
+  _dot.prerender= (_tvmode==NES_PAL) ? 311 : 261;
+  _dot.nt= _dot.at= _dot.pl= _dot.ph= 0;
+  _dot.bg_lo= _dot.bg_hi= _dot.at_lo= _dot.at_hi= 0;
+  memset ( _dot.soam, 0xFF, sizeof(_dot.soam) );
+  _dot.nspr= 0;
+  _dot.s0_line= NES_FALSE;
+  _dot.count= 0;
+  _dot.a12= NES_FALSE;
+  _dot.a12_fall= 0;
+  _dot.dmg_first= 256;
+  _dot.dmg_last= -1;
+  
+} /* end dot_init */
+
+
+/* Actualitza el valor de A12 en el bus i, si és un flanc de pujada
+   després d'estar prou temps a 0, rellotge el comptador del MMC3. */
+static void
+dot_a12 (
+         const NESu16 addr
+         )
+{
+  
+  if ( addr&0x1000 )
+    {
+      if ( !_dot.a12 && (NESu32) (_dot.count-_dot.a12_fall) >= DOT_A12_DELAY )
+        {
+          NES_mapper_mmc3_clock_counter ();
+          _mmc3.irq= NES_mapper_mmc3_check_irq ();
+        }
+      _dot.a12= NES_TRUE;
+    }
+  else if ( _dot.a12 )
+    {
+      _dot.a12= NES_FALSE;
+      _dot.a12_fall= _dot.count;
+    }
+  
+} /* end dot_a12 */
+
+
+static NESu8
+dot_read (
+          const NESu16 addr
+          )
+{
+  
+  if ( _mmc3.enabled ) dot_a12 ( addr );
+  
+  return NES_mapper_vram_read ( addr );
+  
+} /* end dot_read */
+
+
+/* La UCP ha canviat l'adreça del bus de la PPU ($2006 i $2007). */
+static void
+mmc3_cpu_a12 (void)
+{
+  
+  NES_Bool a12;
+  
+  
+  if ( _engine == NES_PPU_DOT )
+    {
+      dot_a12 ( GET_ADDR );
+      return;
+    }
+  a12= (GET_ADDR&0x1000)!=0;
+  if ( a12 == _mmc3.a12 ) return;
+  _mmc3.a12= a12;
+  if ( a12 ) NES_mapper_mmc3_clock_counter ();
+  mmc3_update_deadline ();
+  
+} /* end mmc3_cpu_a12 */
+
+
+/* Lectures del fons i registres de desplaçament. Cada lectura ocupa
+   dos cicles, l'adreça es posa en el bus en el primer. */
+static void
+dot_bg (
+        const int dot
+        )
+{
+  
+  NESu16 NT;
+  
+  
+  if ( (dot >= 2 && dot <= 257) || (dot >= 322 && dot <= 337) )
+    {
+      _dot.bg_lo<<= 1; _dot.bg_hi<<= 1;
+      _dot.at_lo<<= 1; _dot.at_hi<<= 1;
+      if ( (dot&0x7) == 1 )
+        {
+          _dot.bg_lo|= _dot.pl;
+          _dot.bg_hi|= _dot.ph;
+          _dot.at_lo|= (_dot.at&0x1) ? 0xFF : 0x00;
+          _dot.at_hi|= (_dot.at&0x2) ? 0xFF : 0x00;
+        }
+    }
+  if ( (dot >= 1 && dot <= 256) || (dot >= 321 && dot <= 336) )
+    switch ( (dot-1)&0x7 )
+      {
+      case 0:
+        _dot.nt= dot_read ( CALC_NT ( _counters ) |
+        		    (_counters.VT<<5) | _counters.HT );
+        break;
+      case 2:
+        NT= CALC_NT ( _counters );
+        _dot.at= (dot_read ( NT|0x3C0|((_counters.VT&0x1C)<<1)|
+        		     (_counters.HT>>2) ) >>
+        	  (((_counters.VT&0x2)|((_counters.HT&0x2)>>1))<<1))&0x3;
+        break;
+      case 4:
+        _dot.pl= dot_read ( _regs.S|(_dot.nt<<4)|_counters.FV );
+        break;
+      case 6:
+        _dot.ph= dot_read ( _regs.S|(_dot.nt<<4)|0x8|_counters.FV );
+        break;
+      case 7:
+        if ( ++_counters.HT == 32 )
+          {
+            _counters.HT= 0;
+            _counters.H^= 0x1;
+          }
+        break;
+      }
+  
+} /* end dot_bg */
+
+
+/* Avaluació dels sprites de la pròxima línia. */
+static void
+dot_eval_obj (
+              const int line
+              )
+{
+  
+  const NESu8 *p;
+  int h, i, diff;
+  
+  
+  h= _aux.obj_size16 ? 16 : 8;
+  _dot.nspr= 0;
+  _dot.s0_line= NES_FALSE;
+  for ( i= 0, p= &(_obj_ram[0]); i < 64; ++i, p+= 4 )
+    {
+      diff= line-p[0];
+      if ( diff < 0 || diff >= h ) continue;
+      if ( _dot.nspr == 8 )
+        {
+          _status|= 0x20;
+          break;
+        }
+      if ( i == 0 ) _dot.s0_line= NES_TRUE;
+      if ( _tmap.enabled ) tmap_obj ( p );
+      memcpy ( &(_dot.soam[_dot.nspr<<2]), p, 4 );
+      ++_dot.nspr;
+    }
+  
+} /* end dot_eval_obj */
+
+
+static NESu8
+dot_reverse (
+             NESu8 b
+             )
+{
+  
+  b= ((b&0xF0)>>4) | ((b&0x0F)<<4);
+  b= ((b&0xCC)>>2) | ((b&0x33)<<2);
+  b= ((b&0xAA)>>1) | ((b&0x55)<<1);
+  
+  return b;
+  
+} /* end dot_reverse */
+
+
+/* Lectures dels sprites de la pròxima línia (cicles 257-320). Els
+   forats de la 'secondary OAM' llegeixen el tile $FF. */
+static void
+dot_obj (
+         const int line,
+         const int dot
+         )
+{
+  
+  static const NESu8 empty[4]= {0xFF,0xFF,0xFF,0xFF};
+  const NESu8 *p;
+  int i, h, row, tile;
+  NESu16 addr;
+  
+  
+  i= (dot-257)>>3;
+  switch ( (dot-257)&0x7 )
+    {
+    case 0:
+    case 2: /* Lectures de la 'name table' que no s'utilitzen. */
+      if ( _mmc3.enabled ) dot_a12 ( 0x2000 );
+      return;
+    case 4:
+    case 6: break;
+    default: return;
+    }
+  
+  /* Adreça del patró. */
+  p= i < _dot.nspr ? &(_dot.soam[i<<2]) : empty;
+  h= _aux.obj_size16 ? 16 : 8;
+  row= (line-p[0])&(h-1);
+  if ( p[2]&0x80 ) row= (h-1)-row;
+  if ( _aux.obj_size16 )
+    {
+      tile= p[1]&0xFE;
+      if ( row >= 8 ) { ++tile; row-= 8; }
+      addr= ((p[1]&0x1) ? 0x1000 : 0x0000) | (tile<<4) | row;
+    }
+  else addr= _aux.obj_pt | (p[1]<<4) | row;
+  
+  if ( ((dot-257)&0x7) == 4 )
+    {
+      _dot.spr_x[i]= p[3];
+      _dot.spr_attr[i]= p[2];
+      _dot.spr_lo[i]= dot_read ( addr );
+    }
+  else
+    {
+      _dot.spr_hi[i]= dot_read ( addr|0x8 );
+      if ( p[2]&0x40 )
+        {
+          _dot.spr_lo[i]= dot_reverse ( _dot.spr_lo[i] );
+          _dot.spr_hi[i]= dot_reverse ( _dot.spr_hi[i] );
+        }
+    }
+  
+} /* end dot_obj */
+
+
+/* Genera el píxel X de la línia LINE. */
+static void
+dot_pixel (
+           const int line,
+           const int x
+           )
+{
+  
+  NESu16 mask;
+  NESu8 color_pf, color_obj, pri, c, pbitmap;
+  const NESu8 *pal;
+  int i, off, color, emph, *dst;
+  
+  
+  /* Fons. */
+  color_pf= 0;
+  if ( _aux.enable_pf && !(x < 8 && _aux.pf_clipping) )
+    {
+      mask= 0x8000>>_regs.FH;
+      color_pf=
+        ((_dot.bg_lo&mask) ? 0x1 : 0x0) |
+        ((_dot.bg_hi&mask) ? 0x2 : 0x0);
+      if ( color_pf != 0 )
+        color_pf|=
+          ((_dot.at_lo&mask) ? 0x4 : 0x0) |
+          ((_dot.at_hi&mask) ? 0x8 : 0x0);
+    }
+  
+  /* Sprites. */
+  color_obj= 0; pri= 0;
+  if ( _aux.enable_obj && !(x < 8 && _aux.obj_clipping) )
+    for ( i= 0; i < _dot.nspr; ++i )
+      {
+        off= x-_dot.spr_x[i];
+        if ( off < 0 || off > 7 ) continue;
+        off= 7-off;
+        c= (((_dot.spr_hi[i]>>off)&0x1)<<1) | ((_dot.spr_lo[i]>>off)&0x1);
+        if ( c == 0 ) continue;
+        if ( i == 0 && _dot.s0_line && color_pf != 0 && x != 255 )
+          _status|= 0x40;
+        color_obj= ((_dot.spr_attr[i]&0x3)<<2) | c;
+        pri= _dot.spr_attr[i]&0x20;
+        break;
+      }
+  
+  /* Color. */
+  if ( !_fskip.render ||
+       line < _window.top || line >= 240-_window.bottom ||
+       x < _window.left || x >= 256-_window.right ||
+       (_obs.only && !OBS_SAMPLED ( line )) )
+    return;
+  pal= _palettes;
+  pbitmap= _aux.pbitmap;
+  emph= _aux.emph;
+  color= (color_obj != 0 && (pri == 0 || color_pf == 0)) ?
+    LCOLOR_OBJ ( color_obj ) : LCOLOR_PF ( color_pf );
+  dst= &(_render.fb[(line<<8)|x]);
+  if ( _damage.enabled && *dst != color )
+    {
+      if ( x < _dot.dmg_first ) _dot.dmg_first= x;
+      _dot.dmg_last= x;
+    }
+  *dst= color;
+  if ( x == 255-_window.right && _dot.dmg_last != -1 )
+    {
+      damage_add ( line, _dot.dmg_first, _dot.dmg_last );
+      _dot.dmg_first= 256;
+      _dot.dmg_last= -1;
+    }
+  
+} /* end dot_pixel */
+
+
+/* Executa un cicle de PPU. */
+static void
+dot_step (void)
+{
+  
+  int line, dot;
+  NES_Bool rendering;
+  
+  
+  line= _dot.line;
+  dot= _dot.dot;
+  rendering= _aux.enable_pf || _aux.enable_obj;
+  if ( line < 240 || line == _dot.prerender )
+    {
+      if ( line == _dot.prerender && dot == 1 ) frame_begin ();
+      else if ( dot == 1 && line < 240 && (line&0x7) == 4 && _tmap.enabled )
+        tmap_row ( line>>3 );
+      if ( rendering )
+        {
+          dot_bg ( dot );
+          if ( dot == 256 ) inc_vscroll ();
+          else if ( dot == 257 )
+            {
+              _counters.H= _regs.H;
+              _counters.HT= _regs.HT;
+              if ( line < 240 ) dot_eval_obj ( line );
+              else _dot.nspr= 0;
+            }
+          else if ( line == _dot.prerender && dot >= 280 && dot <= 304 )
+            {
+              _counters.FV= _regs.FV;
+              _counters.V= _regs.V;
+              _counters.VT= _regs.VT;
+            }
+          if ( dot >= 257 && dot <= 320 ) dot_obj ( line, dot );
+        }
+      else if ( dot == 257 ) _dot.nspr= 0;
+      if ( line < 240 && dot >= 1 && dot <= 256 )
+        {
+          dot_pixel ( line, dot-1 );
+          if ( dot == 256 && _fskip.render )
+            {
+              if ( _hash.enabled ) hash_line ( line );
+              if ( _obs.width != 0 ) obs_line ( line );
+            }
+        }
+    }
+  else if ( line == 241 && dot == 1 )
+    {
+      _timing.ccs_to_end= _timing.ccperframe;
+      _timing.oddframe^= 1;
+      frame_end ();
+    }
+  
+  /* Següent cicle. En els frames imparells de NTSC, si està
+     renderitzant, la línia 'pre-render' és un cicle més curta. */
+  ++_dot.count;
+  if ( ++_dot.dot == 341 ||
+       (dot == 339 && line == _dot.prerender && rendering &&
+        _timing.oddframe && _timing.isNTSC) )
+    {
+      if ( _dot.dot != 341 ) _timing.ccs_to_end-= _timing.pputocc;
+      _dot.dot= 0;
+      if ( ++_dot.line > _dot.prerender ) _dot.line= 0;
+    }
+  
+} /* end dot_step */
+
+
+static void
+clock_dots (void)
+{
+  
+  while ( _timing.ccs >= _timing.pputocc )
+    {
+      _timing.ccs-= _timing.pputocc;
+      _timing.ccs_to_end-= _timing.pputocc;
+      dot_step ();
+    }
+  
+} /* end clock_dots */
+
+/* Processa els clocks de UCP pendents en el motor per línies. */
+static void
+clock_frame (void)
+{
+  
+  while ( _timing.ccs >= _timing.pputocc )
+    {
+      
+      /* Si encara no s'ha aplegat al scanline 20. */
+      if ( _render.sline == -1 )
+        {
+          if ( _timing.ccs < _timing.ccpervblank ) return;
+          _timing.ccs-= _timing.ccpervblank;
+          _timing.ccs_to_end-= _timing.ccpervblank;
+          _render.sline= 0;
+          frame_begin ();
+          if ( _mmc3.enabled )
+            {
+              mmc3_end_line ( _timing.ccpervblank );
+              _mmc3.nslots= 0;
+              mmc3_predict_line ();
+            }
+        }
+      
+      /* Dibuixa les línies. */
+      if ( clock_lines () ) return;
+      
+      /* Recalcula els límits i acaba. */
+      if ( _render.sline == 242 )
+        {
+          
+          _timing.ccs_to_end= _timing.ccperframe;
+          _timing.oddframe^= 1;
+          if ( _timing.oddframe && _timing.isNTSC )
+            _timing.ccs_to_end-= _timing.pputocc;
+          
+          frame_end ();
+          _render.sline= -1;
+          
+        }
+      
+    }
+  
+} /* end clock_frame */
+
+
+/* Processa els clocks de UCP pendents. */
+static void
+clock (void)
+{
+  
+  if ( _engine == NES_PPU_DOT ) clock_dots ();
+  else clock_frame ();
+  update_sync ();
+  
+} /* end clock */
+
+
+
+
+/* Apunta que ha canviat el byte ADDR ([0000:2FFF]) de la VRAM. */
+static void
+views_mark (
+            const NESu16 addr
+            )
+{
+  
+  int off, row, col, r, c;
+  
+  
+  if ( addr < 0x2000 )
+    {
+      _views.pt_dirty[addr>>4]= 1;
+      return;
+    }
+  off= addr&0x3FF;
+  if ( off < 960 )
+    {
+      _views.nt_dirty[off]= 1;
+      return;
+    }
+  off-= 960;
+  row= (off>>3)<<2;
+  col= (off&0x7)<<2;
+  for ( r= row; r < row+4 && r < 30; ++r )
+    for ( c= col; c < col+4; ++c )
+      _views.nt_dirty[(r<<5)|c]= 1;
+  
+} /* end views_mark */
 
 
-/* Processa els clocks de UCP pendents. */
+/* Dibuixa en DST el tile de l'adreça ADDR amb la paleta PAL. FLIP té
+   el format dels atributs dels sprites. */
 static void
-clock (void)
+views_draw_tile (
+        	 const NESu16  addr,
+        	 const int     pal,
+        	 const NESu8   flip,
+        	 NES_Color    *dst,
+        	 const int     stride
+        	 )
 {
   
-  while ( _timing.ccs >= _timing.pputocc )
+  int r, x, y, bit, c;
+  NESu8 lo, hi;
+  
+  
+  for ( r= 0; r < 8; ++r )
     {
-      
-      /* Si encara no s'ha aplegat al scanline 20. */
-      if ( _render.sline == -1 )
+      lo= NES_mapper_vram_read ( addr|r );
+      hi= NES_mapper_vram_read ( addr|0x8|r );
+      y= (flip&0x80) ? 7-r : r;
+      for ( x= 0; x < 8; ++x )
         {
-          if ( _timing.ccs < _timing.ccpervblank ) return;
-          _timing.ccs-= _timing.ccpervblank;
-          _timing.ccs_to_end-= _timing.ccpervblank;
-          if ( _mmc3.enabled )
-            _mmc3.ccs_to_end-= _timing.ccpervblank;
-          _render.p= &(_render.fb[0]);
-          if ( _aux.enable_pf || _aux.enable_obj )
-            _status&= 0x0F;
-          else _status&= 0x1F;
-          _render.NMI_occurred= NES_FALSE;
-          _render.sline= 0;
+          bit= (flip&0x40) ? x : 7-x;
+          c= ((lo>>bit)&0x1) | (((hi>>bit)&0x1)<<1);
+          dst[y*stride+x]= NES_ppu_palette[c==0 ?
+        				   _palettes[0]&0x3F :
+        				   _palettes[(pal<<2)|c]&0x3F];
         }
-      
-      /* Dibuixa les línies. */
-      if ( clock_lines () ) return;
-      
-      /* Recalcula els límits i acaba. */
-      if ( _render.sline == 242 )
+    }
+  
+} /* end views_draw_tile */
+
+
+static NES_Bool
+views_update_pt (
+        	 const NES_Bool all
+        	 )
+{
+  
+  int t;
+  NES_Bool changed;
+  
+  
+  changed= NES_FALSE;
+  for ( t= 0; t < 512; ++t )
+    if ( all || _views.pt_dirty[t] )
+      {
+        views_draw_tile ( t<<4, _views.pt_palette, 0,
+        		  &(_views.views.pt[t>>8][((t&0xF0)<<6)|((t&0xF)<<3)]),
+        		  NES_PPU_VIEW_PT_SIZE );
+        changed= NES_TRUE;
+      }
+  
+  return changed;
+  
+} /* end views_update_pt */
+
+
+static NES_Bool
+views_update_nt (void)
+{
+  
+  int n, cell, row, col;
+  NESu16 base, attr;
+  NESu8 tile, pal;
+  NES_Bool changed;
+  
+  
+  changed= NES_FALSE;
+  for ( n= 0; n < 4; ++n )
+    {
+      base= 0x2000|(n<<10);
+      for ( cell= 0; cell < 960; ++cell )
         {
-          
-          _timing.ccs_to_end= _timing.ccperframe;
-          _timing.oddframe^= 1;
-          if ( _timing.oddframe && _timing.isNTSC )
-            _timing.ccs_to_end-= _timing.pputocc;
-          if ( _mmc3.enabled )
+          row= cell>>5; col= cell&0x1F;
+          if ( _views.all || _views.nt_dirty[cell] )
             {
-              _mmc3.ccs_to_end= _mmc3.ccs_to_first_clock;
-              if ( _timing.oddframe && _timing.isNTSC )
-        	_mmc3.ccs_to_end-= _timing.pputocc;
+              tile= NES_mapper_vram_read ( base|cell );
+              attr= NES_mapper_vram_read ( base|0x3C0|((row>>2)<<3)|(col>>2) );
+              pal= (attr>>(((row&0x2)<<1)|(col&0x2)))&0x3;
+              _views.nt_tile[n][cell]= tile;
+              _views.nt_pal[n][cell]= pal;
             }
-          
-          _status|= 0x90;
-          _update_screen ( &(_render.fb[0]), _udata );
-          
-          if ( _aux.NMI && !_render.NMI_occurred )
-            NES_cpu_NMI ();
-          _render.NMI_occurred= NES_TRUE;
-          
-          _render.sline= -1;
-          
+          else if ( _views.pt_dirty[(_regs.S>>4)|_views.nt_tile[n][cell]] )
+            {
+              tile= _views.nt_tile[n][cell];
+              pal= _views.nt_pal[n][cell];
+            }
+          else continue;
+          views_draw_tile ( _regs.S|(tile<<4), pal, 0,
+        		    &(_views.views.nt[(((n>>1)*240+(row<<3))*
+        				       NES_PPU_VIEW_NT_COLS) +
+        				      (n&0x1)*256 + (col<<3)]),
+        		    NES_PPU_VIEW_NT_COLS );
+          changed= NES_TRUE;
         }
-      
     }
   
-} /* end clock */
+  return changed;
+  
+} /* end views_update_nt */
+
+
+static NES_Bool
+views_update_obj (void)
+{
+  
+  int i, t0, t1, x, y;
+  const NESu8 *p;
+  NES_Color *dst, bg;
+  NES_Bool changed;
+  
+  
+  changed= NES_FALSE;
+  bg= NES_ppu_palette[_palettes[0]&0x3F];
+  for ( i= 0; i < 64; ++i )
+    {
+      p= &(_obj_ram[i<<2]);
+      if ( _aux.obj_size16 )
+        {
+          t0= ((p[1]&0x1)<<8) | (p[1]&0xFE);
+          t1= t0|1;
+        }
+      else t0= t1= (_aux.obj_pt>>4) | p[1];
+      if ( !_views.all &&
+           memcmp ( p, &(_views.obj_ram[i<<2]), 4 ) == 0 &&
+           !_views.pt_dirty[t0] && !_views.pt_dirty[t1] )
+        continue;
+      dst= &(_views.views.obj[((i>>3)<<4)*NES_PPU_VIEW_OBJ_COLS +
+        		      ((i&0x7)<<3)]);
+      if ( !_aux.obj_size16 )
+        {
+          views_draw_tile ( t0<<4, 4|(p[2]&0x3), p[2], dst,
+        		    NES_PPU_VIEW_OBJ_COLS );
+          dst+= 8*NES_PPU_VIEW_OBJ_COLS;
+          for ( y= 0; y < 8; ++y, dst+= NES_PPU_VIEW_OBJ_COLS )
+            for ( x= 0; x < 8; ++x )
+              dst[x]= bg;
+        }
+      else
+        {
+          if ( p[2]&0x80 ) { t0^= 1; t1^= 1; }
+          views_draw_tile ( t0<<4, 4|(p[2]&0x3), p[2], dst,
+        		    NES_PPU_VIEW_OBJ_COLS );
+          views_draw_tile ( t1<<4, 4|(p[2]&0x3), p[2],
+        		    dst+8*NES_PPU_VIEW_OBJ_COLS,
+        		    NES_PPU_VIEW_OBJ_COLS );
+        }
+      changed= NES_TRUE;
+    }
+  memcpy ( _views.obj_ram, _obj_ram, sizeof(_obj_ram) );
+  
+  return changed;
+  
+} /* end views_update_obj */
+
+
+/* Escriptura en $2007, sense posar al dia la PPU. */
+static void
+write_vram (
+            const NESu8 byte
+            )
+{
+  
+  NESu16 aux, addr;
+  
+  
+  /* ATENCIO!!!!!! ACI FALTA ESTUDIAR EL TEMA DE QUE PASSA QUAN S'ESTA
+     RENDERITZANT. */
+  addr= GET_ADDR & 0x3FFF;
+
+  if ( addr < 0x3F00 )
+    {
+      if ( addr >= 0x3000 ) addr= 0x2000|(addr&0xFFF);
+      /* Sols canvia la versió si canvia el contingut. Amb el MMC2 no
+         es pot llegir (i la cache no s'utilitza). */
+      if ( _engine == NES_PPU_LINE && !_mmc2.enabled &&
+           NES_mapper_vram_read ( addr ) != byte )
+        pfcache_invalidate ();
+      NES_mapper_vram_write ( addr, byte );
+      if ( _views.enabled ) views_mark ( addr );
+    }
+  
+  else
+    {
+      aux= addr & 0x1F;
+      _palettes[aux]= byte;
+      if ( (aux & 0x3) == 0x0 )
+        _palettes[aux^0x10]= byte;
+    }
+  
+  inc_addr ();
+  if ( _mmc3.enabled ) mmc3_cpu_a12 ();
+  
+} /* end write_vram */
 
 
 
@@ -1184,7 +3090,7 @@ clock (void)
 /* FUNCIONS PÚBLIQUES */
 /**********************/
 
-void
+NES_Bool
 NES_ppu_clock (
                int cc
                )
@@ -1194,6 +3100,8 @@ NES_ppu_clock (
   if ( (_timing.ccs >= _timing.ccs_to_end) ||
        (_mmc3.enabled && _timing.ccs >= _mmc3.ccs_to_end) )
     clock ();
+
+  return _mmc3.irq;
   
 } /* end NES_ppu_clock */
 
@@ -1214,6 +3122,7 @@ NES_ppu_CR1 (
   _aux.obj_pt= ((byte&0x8)>>3)!=0 ? 0x1000 : 0x0000;
   _regs.S= ((byte&0x10)>>4)!=0 ? 0x1000 : 0x0000;
   _aux.obj_size16= (byte&0x20) ? NES_TRUE : NES_FALSE;
+  if ( _mmc3.enabled ) mmc3_repredict_line ();
   /* EXT bus direction (0:input; 1:output) ¿¿?? */
   old_NMI= _aux.NMI;
   _aux.NMI= (byte&0x80) ? NES_TRUE : NES_FALSE;
@@ -1235,22 +3144,25 @@ NES_ppu_CR2 (
   _aux.enable_pf= (byte&0x8) ? NES_TRUE : NES_FALSE;
   _aux.enable_obj= (byte&0x10) ? NES_TRUE : NES_FALSE;
   _aux.emph= byte>>5;
+  if ( _mmc3.enabled ) mmc3_repredict_line ();
   
 } /* end NES_ppu_CR2 */
 
 
 void
 NES_ppu_init (
-              const NES_TVMode  tvmode,
-              const NES_Mapper  mapper,
-              NES_UpdateScreen *update_screen,
-              void             *udata
+              const NES_TVMode     tvmode,
+              const NES_Mapper     mapper,
+              const NES_PPUEngine  engine,
+              NES_UpdateScreen    *update_screen,
+              void                *udata
               )
 {
   
   _update_screen= update_screen;
   _udata= udata;
   _tvmode= tvmode;
+  _engine= engine;
   
   /* MMC2. */
   _mmc2.enabled= (mapper == NES_MMC2);
@@ -1276,16 +3188,19 @@ NES_ppu_init_state (void)
   _status= 0xE0;
   _buffer= 0x00;
   init_timing ();
-
-  /* MMC3. */
-  if ( _mmc3.enabled )
-    {
-      /* Final del primer scanline step1. Es possible que calga
-         començar en la dummy. */
-      _mmc3.ccs_to_end= _mmc3.ccs_to_first_clock=
-        _timing.ccperline*(1/*Dummy*/+(_tvmode==NES_PAL?70:20)) +
-        _timing.ccperline_s1;
-    }
+  pfcache_invalidate ();
+  _views.all= NES_TRUE;
+  dot_init ();
+
+  /* MMC3. El motor cicle a cicle detecta els flancs de A12 pel seu
+     compte, i per a no endarrerir les interrupcions s'actualitza
+     sempre. */
+  _mmc3.irq= NES_FALSE;
+  _mmc3.predicted= NES_FALSE;
+  _mmc3.ndots= _mmc3.next= _mmc3.nslots= 0;
+  _mmc3.a12= NES_FALSE;
+  if ( _mmc3.enabled ) mmc3_update_deadline ();
+  else _mmc3.ccs_to_end= MMC3_NO_IRQ;
   
 } /* end NES_ppu_init_state */
 
@@ -1297,18 +3212,37 @@ NES_ppu_DMA (
 {
 
   /*
-   * NOTA: Faig un apanyo per a no canviar molt la part esta del
-   * DMA. Per a fer que els cicles tinguen efecte fora, el que faig és
-   * acumular-los en NES_dma_extra_cc i a la vegada anar fent clock de
-   * la PPU després de cada escritura. Per a què la PPU no torne a
-   * executar eixos cicles el que faig és restar-los al final.
+   * NOTA: Si la pàgina es pot llegir sense efectes laterals (RAM, RAM
+   * del cartutx o ROM) es copia de colp i els cicles de la
+   * transferència s'acumulen en NES_dma_extra_cc, la PPU els
+   * processarà en 'NES_ppu_clock' com qualsevol altre cicle.
+   *
+   * Si no (pàgines d'entrada/eixida o mode traça), cada lectura pot
+   * dependre de l'estat de la PPU i faig un apanyo per a no canviar
+   * molt la part esta del DMA. Per a fer que els cicles tinguen
+   * efecte fora, el que faig és acumular-los en NES_dma_extra_cc i a
+   * la vegada anar fent clock de la PPU després de cada
+   * escritura. Per a què la PPU no torne a executar eixos cicles el
+   * que faig és restar-los al final.
    */
+  NESu8 page[256];
   NESu16 addr;
   NESu8 data;
   int i;
   
   
   CLOCK;
+  if ( NES_mem_read_page ( byte, page ) )
+    {
+      for ( i= 0; i < 256; ++i )
+        {
+          data= page[i];
+          if ( _regs.obj_ptr%4 == 2 ) data&= 0xE3;
+          _obj_ram[_regs.obj_ptr++]= data;
+        }
+      NES_dma_extra_cc+= DMA_CC;
+      return;
+    }
   addr= ((NESu16) byte) << 8;
   for ( i= 0; i < 256; ++i )
     {
@@ -1319,6 +3253,7 @@ NES_ppu_DMA (
       _timing.ccs+= _timing.twoCC;
       clock ();
     }
+  NES_dma_extra_cc+= DMA_CC-512;
   _timing.ccs-= _timing.twoCC*256; /* <-- Apanyo. */
   
 } /* end NES_ppu_DMA */
@@ -1352,6 +3287,7 @@ NES_ppu_read (void)
   
   /*CLOCK; <-- ESTAVA ACÍ !!! */
   inc_addr ();
+  if ( _mmc3.enabled ) mmc3_cpu_a12 ();
   
   return ret;
   
@@ -1433,6 +3369,7 @@ NES_ppu_set_addr (
       _regs.VT|= byte>>5;
       _regs.HT= byte&0x1F;
       update_counters ();
+      if ( _mmc3.enabled ) mmc3_cpu_a12 ();
     }
   else
     {
@@ -1454,7 +3391,7 @@ NES_ppu_status (void)
   NESu8 ret;
   
   
-  clock ();
+  CLOCK;
   ret= _status;
   _regs.flip_flop= 0;
   _status&= 0x70;
@@ -1471,32 +3408,263 @@ NES_ppu_write (
                )
 {
   
-  NESu16 aux, addr;
+  CLOCK;
+  write_vram ( byte );
+  
+} /* end NES_ppu_write */
+
+
+int
+NES_ppu_idle_cc (void)
+{
   
+  int lim;
   
-  CLOCK;
   
-  /* ATENCIO!!!!!! ACI FALTA ESTUDIAR EL TEMA DE QUE PASSA QUAN S'ESTA
-     RENDERITZANT. */
-  addr= GET_ADDR & 0x3FFF;
+  if ( _engine == NES_PPU_DOT ) return 0;
+  lim= MIN ( _timing.ccs_to_sync, _timing.ccs_to_end );
+  if ( _mmc3.enabled ) lim= MIN ( lim, _mmc3.ccs_to_end );
+  
+  return lim > _timing.ccs ? (lim-_timing.ccs-1)/_timing.cputocc : 0;
+  
+} /* end NES_ppu_idle_cc */
 
-  if ( addr < 0x3000 )
-    NES_mapper_vram_write ( addr, byte );
+
+void
+NES_ppu_write_block (
+        	     const NESu8 *data,
+        	     const int    n
+        	     )
+{
   
-  else if ( addr < 0x3F00 )
-    NES_mapper_vram_write ( 0x2000|(addr&0xFFF), byte );
+  int i;
   
-  else
+  
+  for ( i= 0; i < n; ++i )
+    write_vram ( data[i] );
+  
+} /* end NES_ppu_write_block */
+
+
+void
+NES_ppu_set_frame_skip (
+        		int nframes
+        		)
+{
+  
+  _fskip.nframes= nframes>0 ? nframes : 0;
+  _fskip.counter= _fskip.nframes;
+  
+} /* end NES_ppu_set_frame_skip */
+
+
+void
+NES_ppu_set_render_on_demand (
+        		      const NES_Bool val
+        		      )
+{
+  
+  _fskip.on_demand= val;
+  _fskip.requested= NES_FALSE;
+  
+} /* end NES_ppu_set_render_on_demand */
+
+
+void
+NES_ppu_request_frame (void)
+{
+  _fskip.requested= NES_TRUE;
+} /* end NES_ppu_request_frame */
+
+
+void
+NES_ppu_set_damage_tracking (
+        		     const NES_Bool val
+        		     )
+{
+  
+  _damage.enabled= val;
+  memset ( &_damage.info, 0, sizeof(_damage.info) );
+  _damage.last_y= -2;
+  
+} /* end NES_ppu_set_damage_tracking */
+
+
+const NES_PPUDamage *
+NES_ppu_get_damage (void)
+{
+  return &_damage.info;
+} /* end NES_ppu_get_damage */
+
+
+void
+NES_ppu_set_hashing (
+        	     const NES_Bool val
+        	     )
+{
+  
+  _hash.enabled= val;
+  memset ( _hash.lines, 0, sizeof(_hash.lines) );
+  _hash.current= HASH_SEED;
+  _hash.frame= 0;
+  
+} /* end NES_ppu_set_hashing */
+
+
+NESu64
+NES_ppu_get_frame_hash (void)
+{
+  return _hash.frame;
+} /* end NES_ppu_get_frame_hash */
+
+
+const NESu64 *
+NES_ppu_get_line_hashes (void)
+{
+  return &_hash.lines[0];
+} /* end NES_ppu_get_line_hashes */
+
+
+void
+NES_ppu_set_window (
+        	    const int top,
+        	    const int bottom,
+        	    const int left,
+        	    const int right
+        	    )
+{
+  
+  _window.top= top<0 ? 0 : (top>239 ? 239 : top);
+  _window.bottom= bottom<0 ? 0 : bottom;
+  if ( _window.top+_window.bottom > 239 ) _window.bottom= 239-_window.top;
+  _window.left= left<0 ? 0 : (left>255 ? 255 : left);
+  _window.right= right<0 ? 0 : right;
+  if ( _window.left+_window.right > 255 ) _window.right= 255-_window.left;
+  if ( _obs.width != 0 ) obs_map ();
+  
+} /* end NES_ppu_set_window */
+
+
+void
+NES_ppu_set_tilemap (
+        	     const NES_Bool val
+        	     )
+{
+  
+  _tmap.enabled= val;
+  memset ( &_tmap.cur, 0, sizeof(_tmap.cur) );
+  memset ( &_tmap.out, 0, sizeof(_tmap.out) );
+  memset ( _tmap.seen, 0, sizeof(_tmap.seen) );
+  
+} /* end NES_ppu_set_tilemap */
+
+
+const NES_PPUTileMap *
+NES_ppu_get_tilemap (void)
+{
+  return &_tmap.out;
+} /* end NES_ppu_get_tilemap */
+
+
+void
+NES_ppu_set_observation (
+        		 const int              width,
+        		 const int              height,
+        		 const NES_PPUObsFormat format,
+        		 const NES_Bool         only
+        		 )
+{
+  
+  int i;
+  const NES_Color *c;
+  
+  
+  if ( width <= 0 || height <= 0 )
     {
-      aux= addr & 0x1F;
-      _palettes[aux]= byte;
-      if ( (aux & 0x3) == 0x0 )
-        _palettes[aux^0x10]= byte;
+      _obs.width= _obs.height= 0;
+      _obs.only= NES_FALSE;
+      memset ( _obs.first, 0, sizeof(_obs.first) );
+      return;
+    }
+  _obs.width= width>256 ? 256 : width;
+  _obs.height= height>240 ? 240 : height;
+  _obs.format= format;
+  _obs.only= only;
+  for ( i= 0; i < NES_PALETTE_SIZE; ++i )
+    {
+      c= &(NES_ppu_palette[i]);
+      _obs.grey[i]= (77*c->r + 150*c->g + 29*c->b)>>8;
+      _obs.rgb[i]= c->r | (c->g<<8) | (c->b<<16);
     }
+#ifdef USE_AVX2
+  _obs.avx2= HAS_AVX2 ? NES_TRUE : NES_FALSE;
+#else
+  _obs.avx2= NES_FALSE;
+#endif
+  memset ( _obs.data, 0, sizeof(_obs.data) );
+  obs_map ();
   
-  inc_addr ();
+} /* end NES_ppu_set_observation */
+
+
+const NESu8 *
+NES_ppu_get_observation (void)
+{
+  return &(_obs.data[0]);
+} /* end NES_ppu_get_observation */
+
+
+void
+NES_ppu_set_deferred_render (
+        		     NES_PPUFrameReady *frame_ready,
+        		     void              *udata
+        		     )
+{
   
-} /* end NES_ppu_write */
+  _deferred.frame_ready= frame_ready;
+  _deferred.udata= udata;
+  _deferred.current= 0;
+  
+} /* end NES_ppu_set_deferred_render */
+
+
+void
+NES_ppu_render_lines (
+        	      const NES_PPUFrame *frame,
+        	      const int           begin,
+        	      const int           end,
+        	      int                 fb[61440]
+        	      )
+{
+  
+  NESu8 pf[256], obj[256], objpri[256];
+  int i;
+  
+  
+  memset ( objpri, BACK, sizeof(objpri) );
+  for ( i= begin; i < end; ++i )
+    draw_line ( &(frame->lines[i]), pf, obj, objpri, &(fb[i<<8]) );
+  
+} /* end NES_ppu_render_lines */
+
+
+void
+NES_ppu_vram_changed (void)
+{
+  _views.all= NES_TRUE;
+  pfcache_invalidate ();
+} /* end NES_ppu_vram_changed */
+
+
+void
+NES_ppu_irq_changed (void)
+{
+  
+  if ( !_initialised || !_mmc3.enabled ) return;
+  
+  mmc3_update_deadline ();
+  
+} /* end NES_ppu_irq_changed */
 
 
 void
@@ -1510,6 +3678,68 @@ NES_ppu_sync (void)
 } /* end NES_ppu_sync */
 
 
+void
+NES_ppu_set_views (
+        	   const NES_Bool val
+        	   )
+{
+  
+  _views.enabled= val;
+  _views.all= NES_TRUE;
+  
+} /* end NES_ppu_set_views */
+
+
+const NES_PPUViews *
+NES_ppu_get_views (
+        	   const int palette
+        	   )
+{
+  
+  NES_PPUViews *v;
+  NES_Bool pt_all;
+  
+  
+  if ( !_views.enabled ) return NULL;
+  
+  /* Tot allò que afecta a tots els tiles. Amb el MMC2 els bancs
+     canvien en llegir sense avisar, i es dibuixa tot sempre. */
+  if ( _mmc2.enabled ||
+       memcmp ( _views.palettes, _palettes, sizeof(_palettes) ) != 0 )
+    _views.all= NES_TRUE;
+  memcpy ( _views.palettes, _palettes, sizeof(_palettes) );
+  
+  /* Dibuixa. */
+  MMC2_SAVE_STATE ( 0 );
+  v= &_views.views;
+  pt_all= _views.all || (palette&0x7) != _views.pt_palette;
+  _views.pt_palette= palette&0x7;
+  v->pt_changed= views_update_pt ( pt_all );
+  if ( _regs.S != _views.S )
+    {
+      _views.S= _regs.S;
+      memset ( _views.nt_dirty, 1, sizeof(_views.nt_dirty) );
+    }
+  v->nt_changed= views_update_nt ();
+  if ( _aux.obj_pt != _views.obj_pt || _aux.obj_size16 != _views.obj_size16 )
+    {
+      _views.obj_pt= _aux.obj_pt;
+      _views.obj_size16= _aux.obj_size16;
+      _views.all= NES_TRUE;
+    }
+  v->obj_changed= views_update_obj ();
+  MMC2_LOAD_STATE ( 0 );
+  
+  /* Tot està al dia. */
+  _views.all= NES_FALSE;
+  memset ( _views.pt_dirty, 0, sizeof(_views.pt_dirty) );
+  memset ( _views.nt_dirty, 0, sizeof(_views.nt_dirty) );
+  
+  return v;
+  
+} /* end NES_ppu_get_views */
+
+
 void
 NES_ppu_read_vram (
         	   NESu8 vram[0x4000]
@@ -1564,6 +3794,8 @@ NES_ppu_save_state (
   SAVE ( _mmc2 );
   SAVE ( _palettes );
   SAVE ( _obj_ram );
+  SAVE ( _engine );
+  SAVE ( _dot );
   
   return 0;
   
@@ -1577,6 +3809,7 @@ NES_ppu_load_state (
 {
 
   NES_TVMode fake_tvmode;
+  NES_PPUEngine fake_engine;
   NES_Bool tmp;
   ptrdiff_t diff;
   int i;
@@ -1608,12 +3841,11 @@ NES_ppu_load_state (
   CHECK ( diff < sizeof(_render.fb) && diff >= 0 );
   CHECK ( _render.sline >= -1 && _render.sline <= 241 );
   CHECK ( _render.scounter >= 0 && _render.scounter <= 8 );
-  for ( i= 0; i < 16; ++i )
-    CHECK ( _render.map[i] == 0 || _render.map[i] == 1 );
   for ( i= 0; i < 8; ++i )
     CHECK ( _render.s0c_pos[i] >= 0 && _render.s0c_pos[i] < 256 );
   CHECK ( _render.s0c_N >= 0 && _render.s0c_N < 8 );
   LOAD ( _timing );
+  _timing.ccs_to_sync= 0;
   tmp= _mmc3.enabled;
   LOAD ( _mmc3 );
   if ( _mmc3.enabled != tmp )
@@ -1621,6 +3853,9 @@ NES_ppu_load_state (
       _mmc3.enabled= tmp;
       return -1;
     }
+  CHECK ( _mmc3.ndots >= 0 && _mmc3.ndots <= MMC3_MAX_DOTS );
+  CHECK ( _mmc3.next >= 0 && _mmc3.next <= _mmc3.ndots );
+  CHECK ( _mmc3.nslots >= 0 && _mmc3.nslots <= 8 );
   tmp= _mmc2.enabled;
   LOAD ( _mmc2 );
   if ( _mmc2.enabled != tmp )
@@ -1630,6 +3865,17 @@ NES_ppu_load_state (
     }
   LOAD ( _palettes );
   LOAD ( _obj_ram );
+  LOAD ( fake_engine );
+  CHECK ( fake_engine == _engine );
+  LOAD ( _dot );
+  _views.all= NES_TRUE;
+  CHECK ( _dot.line >= 0 && _dot.line <= _dot.prerender );
+  CHECK ( _dot.prerender == ((_tvmode==NES_PAL) ? 311 : 261) );
+  CHECK ( _dot.dot >= 0 && _dot.dot <= 340 );
+  CHECK ( _dot.nspr >= 0 && _dot.nspr <= 8 );
+  CHECK ( _dot.dmg_first >= 0 && _dot.dmg_first <= 256 );
+  CHECK ( _dot.dmg_last >= -1 && _dot.dmg_last < 256 );
+  pfcache_invalidate ();
   
   return 0;
   
@@ -85,6 +85,7 @@ read_header_ines (
   mapper= (NESu8 ) ((bytes[7]&0xF0) | (bytes[6]>>4));
   rom->mapper= ines2nes_mapper ( mapper );
   rom->tvmode= (bytes[9] & 0x1) ? NES_PAL : NES_NTSC;
+  rom->ppu_engine= NES_PPU_LINE;
 
   /* Memòria pàgines. */
   rom->prgs= NES_PRG_NULL;